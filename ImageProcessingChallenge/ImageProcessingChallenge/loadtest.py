@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#
+# Load test for "imgpro --serve": sends jobs from concurrent clients over
+# the daemon's Unix domain socket and reports throughput and latency.
+#
+#   python3 loadtest.py [--socket s.sock | --imgpro src/imgpro] [--clients n]
+#     [--requests n] [--send-path] [--format jpg] [--compare] image [-option ...]
+#
+# With --imgpro a daemon is started on a temporary socket (and stopped at
+# the end).  With --compare the same jobs are also run by starting imgpro
+# once per job, for the cost of a cold process.
+#
+
+import argparse
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def send_job(connection, input_image, data, output_format, operations):
+    # Send one request and return (status, reply bytes)
+    arguments = b"".join(a.encode() + b"\0" for a in [input_image, output_format] + operations)
+    connection.sendall(struct.pack("<I", len(arguments)) + arguments)
+    connection.sendall(struct.pack("<Q", len(data)) + data)
+    status, = struct.unpack("<I", receive(connection, 4))
+    size, = struct.unpack("<Q", receive(connection, 8))
+    return status, receive(connection, size)
+
+
+def receive(connection, size):
+    # Read exactly size bytes
+    chunks = []
+    while size > 0:
+        chunk = connection.recv(min(size, 1 << 20))
+        if not chunk:
+            raise EOFError("daemon closed the connection")
+        chunks.append(chunk)
+        size -= len(chunk)
+    return b"".join(chunks)
+
+
+def run_client(args, data, latencies, failures):
+    # Send requests over one connection, recording the latency of each.  An
+    # error (e.g. the daemon dying) is recorded as a failure and ends the client
+    input_image = os.path.abspath(args.image) if args.send_path else "-"
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as connection:
+            connection.connect(args.socket)
+            for _ in range(args.requests):
+                start = time.perf_counter()
+                status, reply = send_job(connection, input_image, data, args.format, args.operations)
+                latencies.append(time.perf_counter() - start)
+                if status != 0:
+                    failures.append(reply.decode(errors="replace"))
+    except Exception as error:
+        failures.append("client error: %r" % error)
+
+
+def percentile(values, p):
+    # Nearest-rank percentile of sorted values
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def report(name, elapsed, latencies):
+    latencies = sorted(latencies)
+    if not latencies:
+        print("%-8s     0 jobs %8.2f s" % (name, elapsed))
+        return
+    print("%-8s %5d jobs %8.2f s %8.1f jobs/s   latency p50 %7.1f ms  p95 %7.1f ms  p99 %7.1f ms" % (
+        name, len(latencies), elapsed, len(latencies) / elapsed,
+        1000 * percentile(latencies, 50), 1000 * percentile(latencies, 95), 1000 * percentile(latencies, 99)))
+
+
+def run_cold(args, directory):
+    # Run the same jobs with one imgpro process each
+    output = os.path.join(directory, "output." + args.format)
+    latencies, failures = [], []
+    lock = threading.Lock()
+
+    def worker():
+        for _ in range(args.requests):
+            start = time.perf_counter()
+            status = subprocess.run([args.imgpro, args.image, output] + args.operations).returncode
+            with lock:
+                latencies.append(time.perf_counter() - start)
+                if status != 0:
+                    failures.append("imgpro exited with status %d" % status)
+
+    start = time.perf_counter()
+    threads = [threading.Thread(target=worker) for _ in range(args.clients)]
+    for thread in threads: thread.start()
+    for thread in threads: thread.join()
+    report("process", time.perf_counter() - start, latencies)
+    if failures:
+        print("%d jobs failed: %s" % (len(failures), failures[0]))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test an imgpro daemon")
+    parser.add_argument("--socket", help="socket of a running daemon")
+    parser.add_argument("--imgpro", help="start this imgpro as the daemon")
+    parser.add_argument("--jobs", type=int, default=0, help="daemon concurrency (with --imgpro)")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent connections")
+    parser.add_argument("--requests", type=int, default=25, help="requests per connection")
+    parser.add_argument("--format", default="jpg", help="output format (jpg, bmp or ppm)")
+    parser.add_argument("--send-path", action="store_true", help="send the path instead of the bytes")
+    parser.add_argument("--compare", action="store_true", help="also run one imgpro process per job")
+    parser.add_argument("image")
+    parser.add_argument("operations", nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+    if not args.socket and not args.imgpro:
+        parser.error("give --socket or --imgpro")
+    if args.compare and not args.imgpro:
+        parser.error("--compare needs --imgpro")
+
+    # Start daemon
+    daemon = None
+    directory = tempfile.TemporaryDirectory(prefix="imgpro-loadtest-")
+    if not args.socket:
+        args.socket = os.path.join(directory.name, "imgpro.sock")
+        command = [args.imgpro, "--serve", args.socket]
+        if args.jobs > 0: command += ["--jobs", str(args.jobs)]
+        daemon = subprocess.Popen(command)
+        while not os.path.exists(args.socket):
+            if daemon.poll() is not None: sys.exit("daemon exited")
+            time.sleep(0.05)
+
+    # Run clients
+    failures = []
+    try:
+        data = b"" if args.send_path else open(args.image, "rb").read()
+        latencies = []
+        start = time.perf_counter()
+        threads = [threading.Thread(target=run_client, args=(args, data, latencies, failures))
+                   for _ in range(args.clients)]
+        for thread in threads: thread.start()
+        for thread in threads: thread.join()
+        report("daemon", time.perf_counter() - start, latencies)
+        if failures:
+            print("%d jobs failed: %s" % (len(failures), failures[0]))
+        if args.compare:
+            failures += run_cold(args, directory.name)
+    finally:
+        if daemon:
+            daemon.terminate()
+            daemon.wait()
+        directory.cleanup()
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
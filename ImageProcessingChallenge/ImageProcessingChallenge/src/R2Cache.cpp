@@ -0,0 +1,415 @@
+// Source file for the on-disk cache of encoded results
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include "R2Cache.h"
+#include "R2Trace.h"
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+
+
+// Entries start with this magic and the size of the data that follows
+// (so that a truncated or foreign file is not taken for a result)
+#define R2_CACHE_ENTRY_MAGIC "R2CACHE1"
+#define R2_CACHE_HEADER_BYTES 16
+
+// Temporary files older than this were left by processes that died
+#define R2_CACHE_STALE_SECONDS 3600
+
+
+
+////////////////////////////////////////////////////////////////////////
+// SHA-256
+////////////////////////////////////////////////////////////////////////
+
+struct R2CacheHash {
+  uint32_t state[8];
+  uint64_t nbytes;
+  unsigned char block[64];
+};
+
+
+
+static const uint32_t sha256_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+
+static inline uint32_t
+RotateRight(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+
+
+static void
+HashBlock(R2CacheHash *hash, const unsigned char *block)
+{
+  // Expand message schedule
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = ((uint32_t) block[4*i] << 24) | ((uint32_t) block[4*i+1] << 16) | ((uint32_t) block[4*i+2] << 8) | block[4*i+3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = RotateRight(w[i-15], 7) ^ RotateRight(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = RotateRight(w[i-2], 17) ^ RotateRight(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+
+  // Compress block into state
+  uint32_t a = hash->state[0], b = hash->state[1], c = hash->state[2], d = hash->state[3];
+  uint32_t e = hash->state[4], f = hash->state[5], g = hash->state[6], h = hash->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_constants[i] + w[i];
+    uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  hash->state[0] += a; hash->state[1] += b; hash->state[2] += c; hash->state[3] += d;
+  hash->state[4] += e; hash->state[5] += f; hash->state[6] += g; hash->state[7] += h;
+}
+
+
+
+static void
+StartHash(R2CacheHash *hash)
+{
+  // Initial state
+  static const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(hash->state, initial_state, sizeof(initial_state));
+  hash->nbytes = 0;
+}
+
+
+
+static void
+AddToHash(R2CacheHash *hash, const void *data, size_t size)
+{
+  // Hash whole blocks, buffering the rest
+  const unsigned char *p = (const unsigned char *) data;
+  while (size > 0) {
+    size_t offset = hash->nbytes % 64;
+    if ((offset == 0) && (size >= 64)) {
+      HashBlock(hash, p);
+      p += 64; size -= 64; hash->nbytes += 64;
+      continue;
+    }
+    size_t n = std::min(size, (size_t) (64 - offset));
+    memcpy(hash->block + offset, p, n);
+    p += n; size -= n; hash->nbytes += n;
+    if ((hash->nbytes % 64) == 0) HashBlock(hash, hash->block);
+  }
+}
+
+
+
+static std::string
+FinishHash(R2CacheHash *hash)
+{
+  // Pad with a one bit, zeros and the length in bits
+  uint64_t nbits = hash->nbytes * 8;
+  unsigned char padding[72] = { 0x80 };
+  size_t npadding = ((hash->nbytes % 64) < 56) ? (56 - (hash->nbytes % 64)) : (120 - (hash->nbytes % 64));
+  for (int i = 0; i < 8; i++) padding[npadding + i] = (unsigned char) (nbits >> (56 - 8 * i));
+  AddToHash(hash, padding, npadding + 8);
+
+  // Return digest in hex
+  char digest[65];
+  for (int i = 0; i < 8; i++) sprintf(&digest[8*i], "%08x", (unsigned int) hash->state[i]);
+  return std::string(digest, 64);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors/destructors
+////////////////////////////////////////////////////////////////////////
+
+R2Cache::
+R2Cache(const char *directory, size_t max_bytes)
+  : directory(directory),
+    max_bytes(max_bytes),
+    valid(0),
+    nhits(0),
+    nmisses(0),
+    ninserts(0),
+    nevictions(0),
+    nbytes(0)
+{
+#if defined(_WIN32)
+  fprintf(stderr, "Result cache is not supported here: %s\n", directory);
+#else
+  // Create directory if necessary
+  struct stat status;
+  if ((mkdir(directory, 0777) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "Unable to create cache directory %s: %s\n", directory, strerror(errno));
+    return;
+  }
+  if ((stat(directory, &status) < 0) || !S_ISDIR(status.st_mode)) {
+    fprintf(stderr, "Cache directory %s is not a directory\n", directory);
+    return;
+  }
+
+  // Measure directory (and shrink it to a smaller budget)
+  valid = 1;
+  Evict();
+#endif
+}
+
+
+
+R2Cache::
+~R2Cache(void)
+{
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Cache properties
+////////////////////////////////////////////////////////////////////////
+
+R2CacheStatistics R2Cache::
+Statistics(void) const
+{
+  // Return counts for this process
+  R2CacheStatistics statistics;
+  statistics.nhits = nhits;
+  statistics.nmisses = nmisses;
+  statistics.ninserts = ninserts;
+  statistics.nevictions = nevictions;
+  statistics.nbytes = nbytes;
+  return statistics;
+}
+
+
+
+std::string R2Cache::
+Key(const std::string& description, const void *data, size_t size)
+{
+  // Hash the description and its length, then the data
+  R2TraceScope trace("cache", "Key", 0, 0, size);
+  R2CacheHash hash;
+  StartHash(&hash);
+  char length[32];
+  sprintf(length, "%lu\n", (unsigned long) description.size());
+  AddToHash(&hash, length, strlen(length));
+  AddToHash(&hash, description.data(), description.size());
+  AddToHash(&hash, data, size);
+  return FinishHash(&hash);
+}
+
+
+
+std::string R2Cache::
+EntryName(const std::string& key) const
+{
+  // Return the filename of key's entry
+  return directory + "/" + key + ".r2c";
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Lookup and insertion
+////////////////////////////////////////////////////////////////////////
+
+int R2Cache::
+Find(const std::string& key, std::vector<uint8_t>& data)
+{
+  // Check cache
+  if (!valid) return 0;
+  R2TraceScope trace("cache", "Find");
+  std::string filename = EntryName(key);
+
+  // Open entry
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    nmisses++;
+    return 0;
+  }
+
+  // Read header and check that the whole entry is there
+  unsigned char header[R2_CACHE_HEADER_BYTES];
+  uint64_t size = 0;
+  int status = (fread(header, sizeof(header), 1, fp) == 1) && !memcmp(header, R2_CACHE_ENTRY_MAGIC, 8);
+  for (int i = 7; status && (i >= 0); i--) size = (size << 8) | header[8 + i];
+  if (status) {
+    data.resize(size);
+    status = (size == 0) || (fread(data.data(), 1, size, fp) == size);
+    status = status && (getc(fp) == EOF);
+  }
+
+  // Close entry
+  fclose(fp);
+
+  // Count a damaged entry as a miss (inserting the result replaces it)
+  if (!status) {
+    fprintf(stderr, "Ignoring damaged cache entry %s\n", filename.c_str());
+    data.clear();
+    nmisses++;
+    return 0;
+  }
+
+  // Mark entry as recently used
+#if !defined(_WIN32)
+  utime(filename.c_str(), NULL);
+#endif
+
+  // Return success
+  trace.SetImage(0, 0, size);
+  nhits++;
+  return 1;
+}
+
+
+
+int R2Cache::
+Insert(const std::string& key, const std::vector<uint8_t>& data)
+{
+  // Check cache
+  if (!valid) return 0;
+  R2TraceScope trace("cache", "Insert", 0, 0, data.size());
+
+  // Name a temporary file unique to this process and thread
+  static std::atomic<unsigned int> ntemporaries(0);
+  char suffix[128];
+  sprintf(suffix, "/.tmp-%ld-%lx-%u", (long) getpid(),
+    (unsigned long) std::hash<std::thread::id>()(std::this_thread::get_id()), ntemporaries++);
+  std::string temporary_name = directory + suffix;
+  std::string filename = EntryName(key);
+
+  // Write entry to the temporary file
+  FILE *fp = fopen(temporary_name.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open cache entry %s\n", temporary_name.c_str());
+    return 0;
+  }
+  unsigned char header[R2_CACHE_HEADER_BYTES];
+  memcpy(header, R2_CACHE_ENTRY_MAGIC, 8);
+  for (int i = 0; i < 8; i++) header[8 + i] = (unsigned char) ((uint64_t) data.size() >> (8 * i));
+  int status = (fwrite(header, sizeof(header), 1, fp) == 1);
+  status = status && (data.empty() || (fwrite(data.data(), 1, data.size(), fp) == data.size()));
+  status = (fclose(fp) == 0) && status;
+
+  // Move it into place (replacing any entry another process wrote meanwhile)
+  if (!status || (rename(temporary_name.c_str(), filename.c_str()) < 0)) {
+    fprintf(stderr, "Unable to write cache entry %s\n", filename.c_str());
+    remove(temporary_name.c_str());
+    return 0;
+  }
+
+  // Keep cache within its budget
+  ninserts++;
+  nbytes += R2_CACHE_HEADER_BYTES + data.size();
+  if (nbytes > max_bytes) Evict();
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Eviction
+////////////////////////////////////////////////////////////////////////
+
+struct R2CacheEntry {
+  std::string filename;
+  time_t time;
+  size_t nbytes;
+};
+
+
+
+void R2Cache::
+Evict(void)
+{
+#if !defined(_WIN32)
+  // Let one thread scan at a time (others carry on over budget until it is done)
+  std::unique_lock<std::mutex> lock(eviction_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) return;
+  R2TraceScope trace("cache", "Evict");
+
+  // Open directory
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) {
+    fprintf(stderr, "Unable to open cache directory %s\n", directory.c_str());
+    return;
+  }
+
+  // Find entries, with the sizes and times of last use from every process,
+  // and remove temporary files left by processes that died
+  std::vector<R2CacheEntry> entries;
+  size_t total_bytes = 0;
+  time_t now = time(NULL);
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const char *name = dirent->d_name;
+    int length = strlen(name);
+    int is_entry = (length > 4) && !strcmp(name + length - 4, ".r2c");
+    int is_temporary = !strncmp(name, ".tmp-", 5);
+    if (!is_entry && !is_temporary) continue;
+    std::string filename = directory + "/" + name;
+    struct stat status;
+    if (stat(filename.c_str(), &status) < 0) continue;
+    if (is_temporary) {
+      if (now - status.st_mtime > R2_CACHE_STALE_SECONDS) remove(filename.c_str());
+      continue;
+    }
+    R2CacheEntry entry = { filename, status.st_mtime, (size_t) status.st_size };
+    entries.push_back(entry);
+    total_bytes += entry.nbytes;
+  }
+
+  // Close directory
+  closedir(dir);
+
+  // Remove least recently used entries until under the target
+  if (total_bytes > max_bytes) {
+    size_t target_bytes = (size_t) (R2_CACHE_EVICTION_TARGET * max_bytes);
+    std::sort(entries.begin(), entries.end(), [](const R2CacheEntry& a, const R2CacheEntry& b) {
+      return a.time < b.time;
+    });
+    for (unsigned int i = 0; (i < entries.size()) && (total_bytes > target_bytes); i++) {
+      if (remove(entries[i].filename.c_str()) < 0) continue;
+      total_bytes -= entries[i].nbytes;
+      nevictions++;
+    }
+  }
+
+  // Remember size
+  nbytes = total_bytes;
+#endif
+}
@@ -0,0 +1,86 @@
+// Include file for the on-disk cache of encoded results
+#ifndef R2_CACHE_INCLUDED
+#define R2_CACHE_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+
+
+// Constant definitions
+
+// Budget for the cache directory when none is given
+#define R2_CACHE_DEFAULT_MAX_BYTES ((size_t) 1 << 30)
+
+// Eviction removes entries until the cache is this fraction of its
+// budget (so that the next inserts do not each have to scan it again)
+#define R2_CACHE_EVICTION_TARGET 0.9
+
+struct R2CacheStatistics {
+  size_t nhits;        // lookups that found an entry
+  size_t nmisses;      // lookups that did not
+  size_t ninserts;     // entries written
+  size_t nevictions;   // entries removed to stay within the budget
+  size_t nbytes;       // in entries (as of the last scan, plus inserts since)
+};
+
+
+
+// Class definition
+
+// Encoded results stored in a directory, one file per key, which several
+// processes can share.  Entries are written to a temporary file and then
+// renamed into place, so readers see whole entries or none.  Finding an
+// entry touches its modification time, and inserts that take the
+// directory over its budget remove the least recently used entries.
+
+class R2Cache {
+ public:
+  // Constructor/destructor
+  R2Cache(const char *directory, size_t max_bytes = R2_CACHE_DEFAULT_MAX_BYTES);
+  ~R2Cache(void);
+
+  // Cache properties
+  int IsValid(void) const;
+  R2CacheStatistics Statistics(void) const;
+
+  // Keys are the SHA-256 (in hex) of a description of the work and its input
+  static std::string Key(const std::string& description, const void *data, size_t size);
+
+  // Lookup (filling data on a hit) and insertion
+  int Find(const std::string& key, std::vector<uint8_t>& data);
+  int Insert(const std::string& key, const std::vector<uint8_t>& data);
+
+ private:
+  std::string EntryName(const std::string& key) const;
+  void Evict(void);
+
+ private:
+  std::string directory;
+  size_t max_bytes;
+  int valid;
+  std::mutex eviction_mutex;
+  std::atomic<size_t> nhits;
+  std::atomic<size_t> nmisses;
+  std::atomic<size_t> ninserts;
+  std::atomic<size_t> nevictions;
+  std::atomic<size_t> nbytes;
+};
+
+
+
+// Inline functions
+
+inline int R2Cache::
+IsValid(void) const
+{
+  // Return whether the directory could be used
+  return valid;
+}
+
+
+
+#endif
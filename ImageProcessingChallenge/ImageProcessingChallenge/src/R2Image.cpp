@@ -6,967 +6,3469 @@
 #include "R2/R2.h"
 #include "R2Pixel.h"
 #include "R2Image.h"
+#include "R2Threads.h"
+#include "R2Trace.h"
+#include "R2ImageKernels.h"
 #include <iostream>
+#include <utility>
 #include <vector>
+#include <complex>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <limits.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 
 
 ////////////////////////////////////////////////////////////////////////
-// Constructors/Destructors
+// Aligned allocation
 ////////////////////////////////////////////////////////////////////////
 
+// Buffers are aligned for vector loads/stores (one cache line)
+#define R2_IMAGE_PLANE_ALIGNMENT 64
 
-R2Image::
-R2Image(void)
-  : pixels(NULL),
-    npixels(0),
-    width(0), 
-    height(0)
-{
-}
+// A kept buffer serves requests up to 1/R2_IMAGE_POOL_SLACK smaller than it
+#define R2_IMAGE_POOL_SLACK 8
 
 
 
-R2Image::
-R2Image(const char *filename)
-  : pixels(NULL),
-    npixels(0),
-    width(0), 
-    height(0)
+// Freed buffers are kept in a pool and handed out again for requests of
+// about the same size, so filter temporaries and the images of a batch
+// do not go back to the allocator (and fault in new pages) every time.
+// Each buffer starts with one aligned block that records its size.
+
+struct R2ImagePool {
+  std::mutex mutex;
+  std::multimap<size_t, char *> idle;
+  size_t limit = R2_IMAGE_POOL_AUTOMATIC_LIMIT;
+  R2ImagePoolStatistics statistics = { 0, 0, 0, 0, 0 };
+};
+
+
+
+static R2ImagePool&
+ImagePool(void)
 {
-  // Read image
-  Read(filename);
+  // Return the pool (never destroyed, so images can still be freed at exit)
+  static R2ImagePool *pool = new R2ImagePool();
+  return *pool;
 }
 
 
 
-R2Image::
-R2Image(int width, int height)
-  : pixels(NULL),
-    npixels(width * height),
-    width(width), 
-    height(height)
+static char *
+AllocateBlock(size_t nbytes, int required = 1)
 {
-  // Allocate pixels
-  pixels = new R2Pixel [ npixels ];
-  assert(pixels);
+  // Allocate nbytes aligned to R2_IMAGE_PLANE_ALIGNMENT (aborting on
+  // failure unless the caller can handle NULL)
+#if defined(_WIN32)
+  void *ptr = _aligned_malloc(nbytes, R2_IMAGE_PLANE_ALIGNMENT);
+#else
+  void *ptr = NULL;
+  if (posix_memalign(&ptr, R2_IMAGE_PLANE_ALIGNMENT, nbytes) != 0) ptr = NULL;
+#endif
+  if (!ptr) {
+    fprintf(stderr, "Unable to allocate %lu bytes for image planes\n", (unsigned long) nbytes);
+    if (required) abort();
+  }
+  return (char *) ptr;
 }
 
 
 
-R2Image::
-R2Image(int width, int height, const R2Pixel *p)
-  : pixels(NULL),
-    npixels(width * height),
-    width(width), 
-    height(height)
+static void
+FreeBlock(char *block)
 {
-  // Allocate pixels
-  pixels = new R2Pixel [ npixels ];
-  assert(pixels);
-
-  // Copy pixels 
-  for (int i = 0; i < npixels; i++) 
-    pixels[i] = p[i];
+  // Free memory allocated with AllocateBlock
+#if defined(_WIN32)
+  _aligned_free(block);
+#else
+  free(block);
+#endif
 }
 
 
 
-R2Image::
-R2Image(const R2Image& image)
-  : pixels(NULL),
-    npixels(image.npixels),
-    width(image.width), 
-    height(image.height)
-    
+static void
+TrimImagePool(R2ImagePool& pool, size_t limit, std::vector<char *>& blocks)
 {
-  // Allocate pixels
-  pixels = new R2Pixel [ npixels ];
-  assert(pixels);
-
-  // Copy pixels 
-  for (int i = 0; i < npixels; i++) 
-    pixels[i] = image.pixels[i];
+  // Take the largest kept buffers out of the pool until it holds at most
+  // limit bytes (called with the mutex locked, the caller frees blocks)
+  while (!pool.idle.empty() && (pool.statistics.idle_bytes > limit)) {
+    std::multimap<size_t, char *>::iterator it = --pool.idle.end();
+    pool.statistics.idle_bytes -= it->first;
+    blocks.push_back(it->second);
+    pool.idle.erase(it);
+  }
 }
 
 
 
-R2Image::
-~R2Image(void)
+static void *
+AllocateAligned(size_t nbytes, int required = 1)
 {
-  // Free image pixels
-  if (pixels) delete [] pixels;
+  // Allocate nbytes aligned to R2_IMAGE_PLANE_ALIGNMENT, reusing a kept
+  // buffer if the pool has one of about that size (contents undefined,
+  // returns NULL on failure if not required)
+  if (nbytes > SIZE_MAX / 2) {
+    fprintf(stderr, "Unable to allocate %lu bytes for image planes\n", (unsigned long) nbytes);
+    if (required) abort();
+    return NULL;
+  }
+  if (nbytes == 0) nbytes = R2_IMAGE_PLANE_ALIGNMENT;
+  nbytes = (nbytes + R2_IMAGE_PLANE_ALIGNMENT - 1) / R2_IMAGE_PLANE_ALIGNMENT * R2_IMAGE_PLANE_ALIGNMENT;
+  R2ImagePool& pool = ImagePool();
+  char *block = NULL;
+  size_t size = nbytes;
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    std::multimap<size_t, char *>::iterator it = pool.idle.lower_bound(nbytes);
+    if ((it != pool.idle.end()) && (it->first - nbytes <= nbytes / R2_IMAGE_POOL_SLACK)) {
+      size = it->first;
+      block = it->second;
+      pool.idle.erase(it);
+      pool.statistics.idle_bytes -= size;
+      pool.statistics.nhits++;
+    }
+    else {
+      pool.statistics.nmisses++;
+    }
+    pool.statistics.used_bytes += size;
+    if (pool.statistics.used_bytes > pool.statistics.high_water_bytes)
+      pool.statistics.high_water_bytes = pool.statistics.used_bytes;
+  }
+
+  // Allocate a new buffer, with its size in front
+  if (!block) {
+    block = AllocateBlock(R2_IMAGE_PLANE_ALIGNMENT + size, required);
+    if (!block) {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      pool.statistics.used_bytes -= size;
+      return NULL;
+    }
+    *((size_t *) block) = size;
+  }
+
+  // Return the memory after the size
+  return block + R2_IMAGE_PLANE_ALIGNMENT;
 }
 
 
 
-R2Image& R2Image::
-operator=(const R2Image& image)
+static void
+FreeAligned(void *ptr)
 {
-  // Delete previous pixels
-  if (pixels) { delete [] pixels; pixels = NULL; }
+  // Return memory allocated with AllocateAligned to the pool, freeing the
+  // largest kept buffers if the pool would exceed its limit
+  char *block = (char *) ptr - R2_IMAGE_PLANE_ALIGNMENT;
+  size_t size = *((size_t *) block);
+  R2ImagePool& pool = ImagePool();
+  std::vector<char *> blocks;
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.statistics.used_bytes -= size;
+    size_t limit = (pool.limit == R2_IMAGE_POOL_AUTOMATIC_LIMIT) ? pool.statistics.high_water_bytes : pool.limit;
+    if (size > limit) {
+      blocks.push_back(block);
+    }
+    else {
+      TrimImagePool(pool, limit - size, blocks);
+      pool.idle.insert(std::make_pair(size, block));
+      pool.statistics.idle_bytes += size;
+    }
+  }
 
-  // Reset width and height
-  npixels = image.npixels;
-  width = image.width;
-  height = image.height;
+  // Free buffers outside the lock
+  for (unsigned int i = 0; i < blocks.size(); i++) FreeBlock(blocks[i]);
+}
 
-  // Allocate new pixels
-  pixels = new R2Pixel [ npixels ];
-  assert(pixels);
 
-  // Copy pixels 
-  for (int i = 0; i < npixels; i++) 
-    pixels[i] = image.pixels[i];
 
-  // Return image
-  return *this;
-}
+// Temporary array of n elements from the pool, returned to it when
+// destroyed (elements are not initialized)
 
+template <class T>
+class ScratchArray {
+ public:
+  ScratchArray(size_t n) : data((T *) AllocateAligned(n * sizeof(T))) {}
+  ~ScratchArray(void) { FreeAligned(data); }
+  T& operator[](size_t i) { return data[i]; }
+  const T& operator[](size_t i) const { return data[i]; }
+ private:
+  ScratchArray(const ScratchArray&) = delete;
+  ScratchArray& operator=(const ScratchArray&) = delete;
+  T *data;
+};
 
 
-////////////////////////////////////////////////////////////////////////
-// Utility functions
-////////////////////////////////////////////////////////////////////////
 
-static double 
-RandomNumber(void) 
+static std::shared_ptr<void>
+OwnAligned(void *ptr)
 {
-#if defined(_WIN32)
-  int r1 = rand();
-  double r2 = ((double) rand()) / ((double) (RAND_MAX + 1));
-  return (r1 + r2) / ((double) (RAND_MAX + 1));
-#else
-  return drand48();
-#endif
+  // Return shared ownership of memory allocated with AllocateAligned
+  return std::shared_ptr<void>(ptr, FreeAligned);
 }
 
 
 
-////////////////////////////////////////////////////////////////////////
-// Image processing functions
-// YOU IMPLEMENT THE FUNCTIONS IN THIS SECTION
-////////////////////////////////////////////////////////////////////////
-
- 
-void R2Image::
-ApplyGamma(double exponent)
+static R2Pixel *
+AllocatePixels(size_t nsamples, int required = 1)
 {
-  // Apply a gamma correction with exponent to each pixel
-  //It defines the relationship between a pixel's numerical value and its actual luminance.
-// gamma is what translates between our eye's light sensitivity and that of the camera
-  if(exponent < 0) {
-    fprintf(stderr, "Gamma exponent (%f) negative\n", exponent);
-    return;
-  }
-  
-  for (int i = 0; i < npixels; i++) {
-    pixels[i].SetRed(pow(pixels[i].Red(), exponent));
-    pixels[i].SetGreen(pow(pixels[i].Green(), exponent));
-    pixels[i].SetBlue(pow(pixels[i].Blue(), exponent));
-  }
+  // Allocate aligned R2Pixels, zeroed like R2Pixel() would
+  // (a size that overflows is passed on as SIZE_MAX, which fails)
+  size_t nbytes = (nsamples <= SIZE_MAX / sizeof(R2Pixel)) ? nsamples * sizeof(R2Pixel) : SIZE_MAX;
+  R2Pixel *p = (R2Pixel *) AllocateAligned(nbytes, required);
+  if (!p) return NULL;
+  memset((void *) p, 0, nbytes);
+  return p;
 }
 
 
 
-R2Pixel R2Image::Sample(double x0, double y0, int sampling_method, double sigma_x, double sigma_y)
+static float *
+AllocatePlanes(size_t nsamples, int required = 1)
 {
-  if(sampling_method == R2_IMAGE_POINT_SAMPLING) {
-    int x_orig = lround(x0);
-    int y_orig = lround(y0);
-    // Just in case for range violations
-    if(x_orig < 0) x_orig = 0;
-    if(x_orig >= width) x_orig = width - 1;
-    if(y_orig < 0) y_orig = 0;
-    if(y_orig >= height) y_orig = height - 1;
-    return Pixel(x_orig, y_orig);
-  }
-  else if(sampling_method == R2_IMAGE_GAUSSIAN_SAMPLING) {
-    int x_orig = lround(x0);
-    int y_orig = lround(y0);
-
-    R2Pixel p(0.0, 0.0, 0.0, 1.0);
-    double total=0;
-    int size_x = sigma_x * 3;
-    if(size_x < 1) size_x = 1;
-    int size_y = sigma_y * 3;
-    if(size_y < 1) size_y = 1;
-    //x is the distance from the origin in the horizontal axis, y is the distance from the origin in the vertical axis
-    for(int x = (x_orig - size_x < 0 ? 0 : x_orig - size_x); x < (x_orig + size_x + 1 > width ? width : x_orig + size_x + 1); x++) {
-      for(int y = (y_orig - size_y < 0 ? 0 : y_orig - size_y); y < (y_orig + size_y + 1 > height ? height : y_orig + size_y + 1); y++) {
-        double g = exp(-(x-x0)*(x-x0) / 2.0 / sigma_x / sigma_x) * exp(-(y-y0)*(y-y0) / 2.0 / sigma_y / sigma_y);
-        p += g*Pixel(x,y);
-        total += g;
-      }
-    }
-    p /= total;
-    return p;
-  }
-  else if(sampling_method == R2_IMAGE_BILINEAR_SAMPLING) {
-    int xlow = floor(x0) > 0 ? floor(x0) : 0;
-    int xhigh = ceil(x0) < width ? ceil(x0) : width - 1;
-    int ylow = floor(y0) > 0 ? floor(y0) : 0;
-    int yhigh = ceil(y0) < height ? ceil(y0) : height - 1;
-    //using the BILINEAR_SAMPLING formula
-    R2Pixel a = (1.0 - (x0-xlow))*Pixel(xlow, yhigh) + (x0-xlow)*Pixel(xhigh, yhigh);
-    R2Pixel b = (1.0 - (x0-xlow))*Pixel(xlow, ylow) + (x0-xlow)*Pixel(xhigh, ylow);
-    R2Pixel dst = (1.0 - (y0-ylow))*b + (y0-ylow)*a;
-    return dst;
-  }
-  else {
-    fprintf(stderr, "Invalid sampling method (%d)\n", sampling_method);
-    return R2Pixel();
-  }
+  // Allocate aligned, zeroed float planes for all channels
+  // (a size that overflows is passed on as SIZE_MAX, which fails)
+  size_t nbytes = (nsamples <= SIZE_MAX / (R2_IMAGE_NUM_CHANNELS * sizeof(float))) ?
+    R2_IMAGE_NUM_CHANNELS * nsamples * sizeof(float) : SIZE_MAX;
+  float *p = (float *) AllocateAligned(nbytes, required);
+  if (!p) return NULL;
+  memset(p, 0, nbytes);
+  return p;
 }
 
 
 
-
-// Luminance Operations ////////////////////////////////////////////////
-
-void R2Image::
-AddNoise(double magnitude)
+R2ImagePoolStatistics
+R2GetImagePoolStatistics(void)
 {
-  // Add noise to an image.  The amount of noise is given by the magnitude
-  // in the range [0.0..1.0].  0.0 adds no noise.  1.0 adds a lot of noise.
-
- 
-  // This implementation is provided as an example of one way to manipulate pixels
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      R2Pixel& pixel = Pixel(i, j);
-      pixel[0] += magnitude * (RandomNumber() - 0.5);
-      pixel[1] += magnitude * (RandomNumber() - 0.5);
-      pixel[2] += magnitude * (RandomNumber() - 0.5);
-      pixel.Clamp();
-    }
-  }
- 
+  // Return a snapshot of the pool's statistics
+  R2ImagePool& pool = ImagePool();
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  return pool.statistics;
 }
 
-void R2Image::
-Brighten(double factor)
+
+
+void
+R2SetImagePoolLimit(size_t nbytes)
 {
-  // Brighten the image by multiplying each pixel component by the factor.
-  // This is implemented for you as an example of how to access and set pixels
-  for (int i = 0; i < width; i++) {
-    for (int j = 0;  j < height; j++) {
-      //each pixel is multiplied by the factor
-      Pixel(i,j) *= factor;
-      Pixel(i,j).Clamp();
-    }
+  // Set the most bytes the pool keeps, freeing kept buffers beyond it
+  R2ImagePool& pool = ImagePool();
+  std::vector<char *> blocks;
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.limit = nbytes;
+    if (nbytes != R2_IMAGE_POOL_AUTOMATIC_LIMIT) TrimImagePool(pool, nbytes, blocks);
   }
+  for (unsigned int i = 0; i < blocks.size(); i++) FreeBlock(blocks[i]);
 }
 
 
 
-void R2Image::
-ChangeContrast(double factor)
+void
+R2TrimImagePool(void)
 {
-  // Change the contrast of an image by interpolating between the image
-  // and a constant gray image with the average luminance.
-  // Interpolation reduces constrast, extrapolation boosts constrast,
-  // and negative factors generate inverted images.
-  double avg = 0;
-
-  for (int i = 0; i < npixels; ++i)
+  // Free all kept buffers
+  R2ImagePool& pool = ImagePool();
+  std::vector<char *> blocks;
   {
-    //finding of average luminance using formula
-    avg += pixels[i].Luminance();
-  }
-
-  avg /= npixels;
-
-  R2Pixel greypixel(avg, avg, avg, 1.0);
-  
-  for (int i = 0; i < npixels; i++) {
-    //interpolation with avg greyscale luminance image
-    pixels[i] = (1-factor)*greypixel + factor*pixels[i];
-    pixels[i].Clamp();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    TrimImagePool(pool, 0, blocks);
   }
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "ChangeContrast(%g) not implemented\n", factor);
+  for (unsigned int i = 0; i < blocks.size(); i++) FreeBlock(blocks[i]);
 }
 
 
-// Linear filtering ////////////////////////////////////////////////
 
-void R2Image::
-Blur(double sigma)
+static int
+DefaultRowStride(int width)
 {
- 
-// Blur an image with a Gaussian filter with a given sigma.
-
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "Blur(%g) not implemented\n", sigma);
-  // Convolve with a filter whose entries sum to one 
-  if(sigma == 0) return;
-// gamma is   set slightly greater than 1.0 in order to improve contrast
-  ApplyGamma(2.2);
-
-  R2Image original(*this);
-
-  int size = 3*sigma;
-  if(size < 1) size = 1;
-  std::vector<double> col(size+1, 0.0);
-  std::vector<std::vector<double> > gaussiankernel(size+1, col);
-  for(int i=0; i<=size; i++) {
-    for(int j=0; j<=size; j++) {
-      double distancesquared = i*i + j*j;
-      gaussiankernel[i][j] = exp(-distancesquared / 2.0 / sigma / sigma);
-    }
-  }
-
-  for (int i = 0; i < npixels; i++) {
-    R2Pixel p(0.0, 0.0, 0.0, pixels[i].Alpha());
-    int x0 = i/height;
-    int y0 = i%height;
-    double total=0;
-
-    for(int x = (x0 - size < 0 ? 0 : x0 - size); x < (x0 + size + 1 > width ? width : x0 + size + 1); x++) {
-      for(int y = (y0 - size < 0 ? 0 : y0 - size); y < (y0 + size + 1 > height ? height : y0 + size + 1); y++) {
-        double g = gaussiankernel[abs(x-x0)][abs(y-y0)];
-        p += g*original.Pixel(x,y);
-        total += g;
-      }
-    }
-    p /= total;
-    pixels[i] = p;
-  }
-
-  ApplyGamma(1.0/2.2);
+  // Round width up so that every row starts on an aligned boundary
+  return ((width + R2_IMAGE_ROW_ALIGNMENT - 1) / R2_IMAGE_ROW_ALIGNMENT) * R2_IMAGE_ROW_ALIGNMENT;
+}
 
 
 
+static int
+ValidImageSize(int width, int height)
+{
+  // Return whether an image read from a file can be allocated
+  // (positive, with samples in all planes countable in an int)
+  if ((width <= 0) || (height <= 0)) return 0;
+  if (width > INT_MAX - R2_IMAGE_ROW_ALIGNMENT) return 0;
+  size_t nsamples = (size_t) DefaultRowStride(width) * (size_t) height;
+  return nsamples <= (size_t) INT_MAX / R2_IMAGE_NUM_CHANNELS;
 }
 
 
 
-void R2Image::
-Sharpen()
+static double
+PixelBytes(int npixels)
 {
-  // Sharpen an image using a linear filter
-  R2Image blurredImage(*this);
-  blurredImage.Blur(2.0);
-
-  double factor=2.0;
-  for (int i = 0; i < npixels; i++) {
-    //interpolation Extrapolation method to sharpen the image
-    //from original image we remove the blur portion of image
-    pixels[i] = (1-factor)*blurredImage.Pixels()[i] + factor*pixels[i];
-    pixels[i].Clamp();
-  }
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "Sharpen() not implemented\n");
+  // Return bytes in npixels R2Pixels (traces report the bytes touched)
+  return (double) npixels * sizeof(R2Pixel);
 }
 
 
 
-void R2Image::
-EdgeDetect(void)
-{
-    // Detect edges in an image.
-
-//em gamma is   set slightly greater than 1.0 in order to improve contrast
-    ApplyGamma(2.2);
-  R2Image orig(*this);
-  
-  for (int i = 0; i < npixels; i++) {
-    int x0 = i/height;
-    int y0 = i%height;
-    
-    R2Pixel p(0.0, 0.0, 0.0, 1.0);
-    double counter = 0;
+////////////////////////////////////////////////////////////////////////
+// Tiles
+////////////////////////////////////////////////////////////////////////
 
-    for(int x = x0 - 1; x <= x0 + 1; x++) {
-      if(x < 0) continue;
-      if(x >= width) continue;
-      for(int y = y0 - 1; y <= y0 + 1; y++) {
-        if(y < 0) continue;
-        if(y >= height) continue;
+// Parallel loops hand out tiles of about this many samples, rows are
+// never split, so every sample is computed exactly as in a serial loop
+#define R2_IMAGE_TILE_SAMPLES 16384
 
-        if(x == x0 && y == y0) {
-          p += 8*orig.Pixel(x,y);
-          counter += 8;
-        } else {
+// Column strips for filters that run down columns
+#define R2_IMAGE_TILE_COLUMNS 64
 
-          p += -1.0*orig.Pixel(x,y);
-          counter++;
-        }
-      }
-    }
-    
-    p /= counter;
-    pixels[i] = p;
-  }
-//removing the gamma effect
-  ApplyGamma(1.0/2.2);
 
 
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "EdgeDetect() not implemented\n");
+static int
+RowGrain(int width)
+{
+  // Return number of rows in a tile
+  int rows = R2_IMAGE_TILE_SAMPLES / (width > 0 ? width : 1);
+  return (rows > 0) ? rows : 1;
 }
 
-// Resampling operations  ////////////////////////////////////////////////
 
 
-void R2Image::
-Scale(double sx, double sy, int sampling_method)
-{
-  // Scale an image in x by sx, and y by sy.
-  R2Image orig(*this);
-  width = lround(sx*orig.width);
-  height = lround(sy*orig.height);
+////////////////////////////////////////////////////////////////////////
+// Gamma tables
+////////////////////////////////////////////////////////////////////////
 
-  delete [] pixels;
-  npixels = width*height;
-  pixels = new R2Pixel[npixels];
+// pow(x, e) is evaluated as pow(m, e) * 2^(k*e) for x = m * 2^k, with 
+// pow(m, e) interpolated from a table over m in [0.5, 1) by cubic Hermite
+// polynomials (matching pow and its derivative at both ends of each interval).
+// Tables are only used when the interpolation error bound is below
+// R2_IMAGE_GAMMA_MAX_ERROR (relative), otherwise pow() is called.  The bound
+// is a few units in the last place, so results differ from pow() only by
+// rounding (linear interpolation erred by up to 3e-7, which moved values
+// on 8-bit boundaries, as after a 2.2 and 1/2.2 round trip, down a level).
+#define R2_IMAGE_GAMMA_TABLE_SIZE 1024
+#define R2_IMAGE_GAMMA_MIN_EXPONENT -60
+#define R2_IMAGE_GAMMA_MAX_EXPONENT 4
+#define R2_IMAGE_GAMMA_MAX_ERROR 1.0E-14
+#define R2_IMAGE_GAMMA_CACHE_SIZE 8
+
+struct R2GammaTable {
+  double exponent;
+  double polynomial[R2_IMAGE_GAMMA_TABLE_SIZE][4];
+  double scale[R2_IMAGE_GAMMA_MAX_EXPONENT - R2_IMAGE_GAMMA_MIN_EXPONENT + 1];
+};
 
-  double xoffset = 0.5 * ((double)orig.width) / ((double)width) - 0.5;
-  double yoffset = 0.5 * ((double)orig.height) / ((double)height) - 0.5;
-  
-  for(int i=0; i<npixels; i++) {
-    int x0 = i/height;
-    int y0 = i%height;
 
-    double x_orig = ((double)orig.width) / ((double)width) * x0 + xoffset; 
-    double y_orig = ((double)orig.height) / ((double)height) * y0 + yoffset; 
 
-    double sigma_x = 1.0/3.0/sx, sigma_y = 1.0/3.0/sy;
-    if(sx > 1.0) { sigma_x = 0.5; }
-    if(sy > 1.0) { sigma_y = 0.5; }
-    pixels[i] = orig.Sample(x_orig, y_orig, sampling_method, sigma_x, sigma_y);
+static const R2GammaTable *
+GammaTable(double exponent)
+{
+  // Return cached table for exponent, or NULL if a table would not be accurate
+  static R2GammaTable *cache[R2_IMAGE_GAMMA_CACHE_SIZE] = { NULL };
+  static std::mutex cache_mutex;
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  // Look for existing table
+  for (int i = 0; i < R2_IMAGE_GAMMA_CACHE_SIZE; i++) {
+    if (!cache[i]) break;
+    if (cache[i]->exponent == exponent) return cache[i];
   }
 
-
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "Scale(%g, %g, %d) not implemented\n", sx, sy, sampling_method);
+  // Bound cubic Hermite interpolation error relative to the smallest value,
+  // h^4/384 * max|f''''| / min f, over m in [0.5, 1)
+  double h = 0.5 / R2_IMAGE_GAMMA_TABLE_SIZE;
+  double max_f4 = fabs(exponent * (exponent - 1) * (exponent - 2) * (exponent - 3)) *
+    ((exponent < 4) ? pow(0.5, exponent - 4) : 1.0);
+  double min_f = (exponent > 0) ? pow(0.5, exponent) : 1.0;
+  if (h * h * h * h / 384 * max_f4 / min_f > R2_IMAGE_GAMMA_MAX_ERROR) return NULL;
+
+  // Find free cache slot
+  int slot = 0;
+  while ((slot < R2_IMAGE_GAMMA_CACHE_SIZE) && cache[slot]) slot++;
+  if (slot == R2_IMAGE_GAMMA_CACHE_SIZE) return NULL;
+
+  // Build table
+  R2GammaTable *table = new R2GammaTable;
+  table->exponent = exponent;
+  for (int i = 0; i < R2_IMAGE_GAMMA_TABLE_SIZE; i++) {
+    // Coefficients in t in [0,1) from values and slopes (times h) at the ends
+    double m0 = 0.5 + h * i, m1 = 0.5 + h * (i + 1);
+    double v0 = pow(m0, exponent), v1 = pow(m1, exponent);
+    double d0 = h * exponent * pow(m0, exponent - 1), d1 = h * exponent * pow(m1, exponent - 1);
+    table->polynomial[i][0] = v0;
+    table->polynomial[i][1] = d0;
+    table->polynomial[i][2] = 3 * (v1 - v0) - 2 * d0 - d1;
+    table->polynomial[i][3] = 2 * (v0 - v1) + d0 + d1;
+  }
+  for (int k = R2_IMAGE_GAMMA_MIN_EXPONENT; k <= R2_IMAGE_GAMMA_MAX_EXPONENT; k++) 
+    table->scale[k - R2_IMAGE_GAMMA_MIN_EXPONENT] = pow(2.0, k * exponent);
+  cache[slot] = table;
+  return table;
 }
 
 
-void R2Image::
-Composite(const R2Image& top, int operation)
+
+static inline double
+GammaLookup(const R2GammaTable *table, double x)
 {
-  // Composite passed image on top of this one using operation (e.g., OVER)
-  for(int i=0; i<npixels; i++) {
-    //alpha Encodes transparency 
-    double alphatop = top.pixels[i].Alpha();
-    double alphabottom = pixels[i].Alpha();
-    //pixel are set using the alpha component of top image and 1-alpha component  of bottom image
-    pixels[i] = alphatop * top.pixels[i] + alphabottom * (1 - alphatop) * pixels[i];
-    pixels[i].SetAlpha(alphatop + alphabottom * (1-alphatop));
-  }
-  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
-  //fprintf(stderr, "Composite not implemented\n");
+  // Split x into mantissa m in [0.5,1) and exponent k
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  int k = (int) ((bits >> 52) & 0x7ff) - 1022;
+
+  // Exact fallback for negatives, zero, denormals, huge values, inf and nan
+  if ((bits >> 63) || (k < R2_IMAGE_GAMMA_MIN_EXPONENT) || (k > R2_IMAGE_GAMMA_MAX_EXPONENT)) 
+    return pow(x, table->exponent);
+
+  // Interpolate pow(m, e) and scale by 2^(k*e)
+  double m;
+  bits = (bits & 0x000fffffffffffffULL) | 0x3fe0000000000000ULL;
+  memcpy(&m, &bits, sizeof(m));
+  double t = (m - 0.5) * (2 * R2_IMAGE_GAMMA_TABLE_SIZE);
+  int i = (int) t;
+  double f = t - i;
+  const double *c = table->polynomial[i];
+  return (c[0] + f * (c[1] + f * (c[2] + f * c[3]))) * table->scale[k - R2_IMAGE_GAMMA_MIN_EXPONENT];
 }
 
 
-// Miscellaneous operations ////////////////////////////////////////////////
 
-void R2Image::
-ExtractChannel(int channel)
+static void
+GammaPlane(float *plane, int width, int height, int rowstride, double exponent)
 {
-  // Extracts a channel of an image (e.g., R2_IMAGE_RED_CHANNEL).  
-  // Leaves the specified channel intact, 
-  // and sets all the other ones to zero.
-
-  // Extract channel
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      R2Pixel& pixel = Pixel(i, j);
-      for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
-        if (c != channel) pixel[c] = 0.0;
+  // Raise every sample of a float plane to exponent
+  // (through a table with relative error below R2_IMAGE_GAMMA_MAX_ERROR 
+  //  when the exponent allows it, and pow() otherwise)
+  const R2GammaTable *table = GammaTable(exponent);
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      float *row = plane + j*rowstride;
+      if (table) {
+        for (int i = 0; i < width; i++) 
+          row[i] = (float) GammaLookup(table, row[i]);
+      }
+      else {
+        for (int i = 0; i < width; i++) 
+          row[i] = (float) pow(row[i], exponent);
       }
     }
-  }
-
+  });
 }
 
 
 
-void R2Image::
+static void
+GammaPixels(R2Pixel *pixels, int width, int height, int rowstride, double exponent)
+{
+  // Raise red, green, and blue of every pixel to exponent (alpha is kept)
+  const R2GammaTable *table = GammaTable(exponent);
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      R2Pixel *row = pixels + j*rowstride;
+      if (table) {
+        for (int i = 0; i < width; i++) {
+          row[i].SetRed(GammaLookup(table, row[i].Red()));
+          row[i].SetGreen(GammaLookup(table, row[i].Green()));
+          row[i].SetBlue(GammaLookup(table, row[i].Blue()));
+        }
+      }
+      else {
+        for (int i = 0; i < width; i++) {
+          row[i].SetRed(pow(row[i].Red(), exponent));
+          row[i].SetGreen(pow(row[i].Green(), exponent));
+          row[i].SetBlue(pow(row[i].Blue(), exponent));
+        }
+      }
+    }
+  });
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors/Destructors
+////////////////////////////////////////////////////////////////////////
+
+
+R2Image::
+R2Image(void)
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+}
+
+
+
+R2Image::
+R2Image(const char *filename)
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Read image
+  Read(filename);
+}
+
+
+
+R2Image::
+R2Image(int width, int height)
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Allocate pixels
+  Resize(width, height);
+}
+
+
+
+R2Image::
+R2Image(int width, int height, const R2Pixel *p)
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Allocate pixels
+  Resize(width, height);
+
+  // Copy pixels (p is packed, row after row)
+  for (int j = 0; j < height; j++) 
+    for (int i = 0; i < width; i++) 
+      pixels[j*rowstride + i] = p[j*width + i];
+}
+
+
+
+R2Image::
+R2Image(const R2Image& image)
+  : pixels(NULL),
+    planes(NULL),
+    storage(image.storage),
+    transfer(image.transfer),
+    owner(),
+    npixels(image.npixels),
+    width(image.width), 
+    height(image.height),
+    rowstride(image.rowstride),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Share pixels or planes, until one of the images changes them
+  pixels = image.pixels;
+  planes = image.planes;
+  owner = image.owner;
+}
+
+
+
+R2Image::
+R2Image(R2Image&& image) noexcept
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Take pixels or planes from image, leaving it empty
+  Swap(image);
+}
+
+
+
+R2Image::
+R2Image(const R2ImageView& view)
+  : pixels(NULL),
+    planes(NULL),
+    storage(R2_IMAGE_PIXEL_STORAGE),
+    transfer(R2_IMAGE_GAMMA_TRANSFER),
+    owner(),
+    npixels(0),
+    width(0), 
+    height(0),
+    rowstride(0),
+    converted_pixels(NULL),
+    converted_planes(NULL)
+{
+  // Allocate pixels
+  Resize(view.Width(), view.Height());
+
+  // Copy rows of the view
+  if (npixels == 0) return;
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) 
+      memcpy((void *) &pixels[j*rowstride], view[j], width * sizeof(R2Pixel));
+  });
+}
+
+
+
+R2Image::
+~R2Image(void)
+{
+  // Free image pixels
+  FreeStorage();
+}
+
+
+
+R2Image& R2Image::
+operator=(const R2Image& image)
+{
+  // Check for self assignment
+  if (this == &image) return *this;
+
+  // Release previous pixels
+  FreeStorage();
+
+  // Reset width and height
+  npixels = image.npixels;
+  width = image.width;
+  height = image.height;
+  rowstride = image.rowstride;
+  storage = image.storage;
+  transfer = image.transfer;
+
+  // Share pixels or planes, until one of the images changes them
+  pixels = image.pixels;
+  planes = image.planes;
+  owner = image.owner;
+
+  // Return image
+  return *this;
+}
+
+
+
+R2Image& R2Image::
+operator=(R2Image&& image) noexcept
+{
+  // Take pixels or planes from image, leaving it empty
+  if (this != &image) {
+    R2Image previous(std::move(*this));
+    Swap(image);
+  }
+
+  // Return image
+  return *this;
+}
+
+
+
+void R2Image::
+Swap(R2Image& image) noexcept
+{
+  // Exchange pixels or planes and their dimensions with image
+  // (dropping copies made for the const accessors of either)
+  ClearConverted();
+  image.ClearConverted();
+  std::swap(pixels, image.pixels);
+  std::swap(planes, image.planes);
+  std::swap(storage, image.storage);
+  std::swap(transfer, image.transfer);
+  std::swap(owner, image.owner);
+  std::swap(npixels, image.npixels);
+  std::swap(width, image.width);
+  std::swap(height, image.height);
+  std::swap(rowstride, image.rowstride);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Storage functions
+////////////////////////////////////////////////////////////////////////
+
+int R2Image::
+Resize(int width, int height)
+{
+  // Replace storage with zeroed R2Pixels for a width x height image
+  // (if it is too large to allocate, leave an empty image and return 0)
+  FreeStorage();
+  int status = 1;
+  R2Pixel *new_pixels = NULL;
+  if ((width == 0) || (height == 0) || ValidImageSize(width, height)) 
+    new_pixels = AllocatePixels((size_t) DefaultRowStride(width) * height, 0);
+  if (!new_pixels) {
+    fprintf(stderr, "Unable to allocate image of size %dx%d\n", width, height);
+    new_pixels = AllocatePixels(0);
+    width = height = 0;
+    status = 0;
+  }
+
+  // Remember size
+  this->width = width;
+  this->height = height;
+  this->npixels = width * height;
+  this->rowstride = DefaultRowStride(width);
+  this->storage = R2_IMAGE_PIXEL_STORAGE;
+  this->transfer = R2_IMAGE_GAMMA_TRANSFER;
+  pixels = new_pixels;
+  owner = OwnAligned(pixels);
+  return status;
+}
+
+
+
+void R2Image::
+FreeStorage(void)
+{
+  // Release pixels and planes (freed once no view shares them)
+  ClearConverted();
+  pixels = NULL;
+  planes = NULL;
+  owner.reset();
+}
+
+
+
+void R2Image::
+Detach(void)
+{
+  // Copy pixels or planes into a buffer of this image's own if the buffer
+  // is shared with copies of the image or with views, so they keep the
+  // values they had (no need to zero what is copied over), after dropping
+  // copies made for the const accessors, since pixels are about to change
+  ClearConverted();
+  if (owner.use_count() <= 1) return;
+  size_t nbytes = (size_t) rowstride * height;
+  if (planes) nbytes *= R2_IMAGE_NUM_CHANNELS * sizeof(float);
+  else nbytes *= sizeof(R2Pixel);
+  void *buffer = AllocateAligned(nbytes);
+  if (planes) planes = (float *) memcpy(buffer, planes, nbytes);
+  else if (pixels) pixels = (R2Pixel *) memcpy(buffer, pixels, nbytes);
+  owner = OwnAligned(buffer);
+}
+
+
+
+void R2Image::
+SetStorage(int storage)
+{
+  // Convert pixels to the given storage mode
+  ConvertStorage(storage);
+}
+
+
+
+void R2Image::
+SetRowStride(int new_rowstride)
+{
+  // Check row stride
+  if (new_rowstride < width) {
+    fprintf(stderr, "Row stride (%d) smaller than image width (%d)\n", new_rowstride, width);
+    return;
+  }
+
+  // Keep rows aligned
+  new_rowstride = DefaultRowStride(new_rowstride);
+  if (new_rowstride == rowstride) return;
+
+  // Copy rows into buffer with new row stride
+  ClearConverted();
+  size_t nsamples = (size_t) new_rowstride * height;
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    float *new_planes = AllocatePlanes(nsamples);
+    for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+      for (int j = 0; j < height; j++) {
+        memcpy(&new_planes[c*nsamples + j*new_rowstride], 
+          &planes[c*rowstride*height + j*rowstride], width * sizeof(float));
+      }
+    }
+    planes = new_planes;
+    owner = OwnAligned(planes);
+  }
+  else {
+    R2Pixel *new_pixels = AllocatePixels(nsamples);
+    for (int j = 0; j < height; j++) 
+      memcpy((void *) &new_pixels[j*new_rowstride], &pixels[j*rowstride], width * sizeof(R2Pixel));
+    pixels = new_pixels;
+    owner = OwnAligned(pixels);
+  }
+
+  // Remember row stride
+  rowstride = new_rowstride;
+}
+
+
+
+void R2Image::
+ConvertStorage(int new_storage)
+{
+  // Check if already in storage mode
+  if (new_storage == storage) return;
+  R2TraceScope trace("image", "ConvertStorage", width, height, 2 * PixelBytes(npixels));
+
+  // Convert between R2Pixel array and float planes
+  // (every sample is written, so the new buffer is not zeroed)
+  ClearConverted();
+  size_t nsamples = (size_t) rowstride * height;
+  if (new_storage == R2_IMAGE_PLANAR_STORAGE) {
+    planes = (float *) AllocateAligned(R2_IMAGE_NUM_CHANNELS * nsamples * sizeof(float));
+    R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+      for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+        float *plane = &planes[c*nsamples];
+        for (int i = begin*rowstride; i < end*rowstride; i++) 
+          plane[i] = (float) pixels[i][c];
+      }
+    });
+    pixels = NULL;
+    owner = OwnAligned(planes);
+  }
+  else if (new_storage == R2_IMAGE_PIXEL_STORAGE) {
+    pixels = (R2Pixel *) AllocateAligned(nsamples * sizeof(R2Pixel));
+    R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+      for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+        const float *plane = &planes[c*nsamples];
+        for (int i = begin*rowstride; i < end*rowstride; i++) 
+          pixels[i][c] = plane[i];
+      }
+    });
+    planes = NULL;
+    owner = OwnAligned(pixels);
+  }
+  else {
+    fprintf(stderr, "Invalid storage mode (%d)\n", new_storage);
+    return;
+  }
+
+  // Remember storage mode
+  storage = new_storage;
+}
+
+
+
+void R2Image::
+SetTransfer(int transfer)
+{
+  // Convert pixels to the given transfer function
+  ConvertTransfer(transfer);
+}
+
+
+
+void R2Image::
+ConvertTransfer(int new_transfer)
+{
+  // Check if already encoded with transfer function
+  if (new_transfer == transfer) return;
+  R2TraceScope trace("image", "ConvertTransfer", width, height, 2 * PixelBytes(npixels));
+
+  // Convert color channels between gamma encoded and linear light
+  double exponent;
+  if (new_transfer == R2_IMAGE_LINEAR_TRANSFER) exponent = R2_IMAGE_GAMMA;
+  else if (new_transfer == R2_IMAGE_GAMMA_TRANSFER) exponent = 1.0 / R2_IMAGE_GAMMA;
+  else {
+    fprintf(stderr, "Invalid transfer function (%d)\n", new_transfer);
+    return;
+  }
+  Detach();
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+      GammaPlane(&planes[c*rowstride*height], width, height, rowstride, exponent);
+  }
+  else {
+    GammaPixels(pixels, width, height, rowstride, exponent);
+  }
+
+  // Remember transfer function
+  transfer = new_transfer;
+}
+
+
+
+const R2Image& R2Image::
+Converted(int new_storage, R2Image& copy) const
+{
+  // Return this image if it is gamma encoded in new_storage, and otherwise
+  // copy converted to that, for const functions that read pixels (the copy
+  // shares the buffer until it converts, so this image is not changed)
+  if ((storage == new_storage) && (transfer == R2_IMAGE_GAMMA_TRANSFER)) return *this;
+  copy = *this;
+  copy.ConvertStorage(new_storage);
+  copy.ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  return copy;
+}
+
+
+
+const R2Image& R2Image::
+ConvertedCopy(int new_storage) const
+{
+  // Return a gamma encoded copy of this image in new_storage for the const
+  // accessors, made on first use and kept until the image changes (threads
+  // that make it at the same time keep the first one stored)
+  std::atomic<R2Image *>& converted = (new_storage == R2_IMAGE_PLANAR_STORAGE) ? converted_planes : converted_pixels;
+  R2Image *copy = converted.load(std::memory_order_acquire);
+  if (copy) return *copy;
+  copy = new R2Image(*this);
+  copy->ConvertStorage(new_storage);
+  copy->ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  R2Image *stored = NULL;
+  if (!converted.compare_exchange_strong(stored, copy, std::memory_order_acq_rel)) {
+    delete copy;
+    copy = stored;
+  }
+  return *copy;
+}
+
+
+
+void R2Image::
+ClearConverted(void)
+{
+  // Delete copies made for the const accessors
+  delete converted_pixels.exchange(NULL);
+  delete converted_planes.exchange(NULL);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Views
+////////////////////////////////////////////////////////////////////////
+
+void
+R2CropRectangle(int image_width, int image_height, int& x, int& y, int& width, int& height)
+{
+  // Clip rectangle to the image, leaving it empty if they do not overlap
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  if (x > image_width) x = image_width;
+  if (y > image_height) y = image_height;
+  if (width > image_width - x) width = image_width - x;
+  if (height > image_height - y) height = image_height - y;
+  if (width < 0) width = 0;
+  if (height < 0) height = 0;
+}
+
+
+
+R2ImageView::
+R2ImageView(void)
+  : owner(),
+    origin(NULL),
+    width(0),
+    height(0),
+    rowstride(0)
+{
+}
+
+
+
+R2ImageView::
+R2ImageView(const R2Image& image)
+  : owner(),
+    origin(NULL),
+    width(image.width),
+    height(image.height),
+    rowstride(image.rowstride)
+{
+  // Share the image's pixels, gamma encoded like its const accessors return them
+  // (or a converted copy of them, which the view keeps alive)
+  R2Image copy;
+  const R2Image& converted = image.Converted(R2_IMAGE_PIXEL_STORAGE, copy);
+  owner = converted.owner;
+  origin = converted.pixels;
+}
+
+
+
+R2ImageView R2ImageView::
+Crop(int x, int y, int width, int height) const
+{
+  // Return view of the rectangle with lower-left corner (x,y), clipped to this view
+  R2CropRectangle(this->width, this->height, x, y, width, height);
+  R2ImageView view(*this);
+  view.origin = (width * height > 0) ? &origin[(ptrdiff_t) y*rowstride + x] : NULL;
+  view.width = width;
+  view.height = height;
+  return view;
+}
+
+
+
+R2ImageView R2ImageView::
+FlipVertical(void) const
+{
+  // Return view whose rows run from the top of this view to the bottom
+  R2ImageView view(*this);
+  if (height > 0) view.origin = &origin[(ptrdiff_t) (height - 1)*rowstride];
+  view.rowstride = -rowstride;
+  return view;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Utility functions
+////////////////////////////////////////////////////////////////////////
+
+static double 
+RandomNumber(void) 
+{
+#if defined(_WIN32)
+  int r1 = rand();
+  double r2 = ((double) rand()) / ((double) (RAND_MAX + 1));
+  return (r1 + r2) / ((double) (RAND_MAX + 1));
+#else
+  return drand48();
+#endif
+}
+
+
+
+void
+R2BlurWeights(double sigma, int size, int n, std::vector<double>& kernel, std::vector<double>& scale)
+{
+  // Fill kernel[0..size] with 1-D Gaussian weights, and scale[0..n-1] with
+  // the reciprocal of the weights that fall inside [0,n) around each position.
+  // Since the 2-D kernel is separable and clipped to a rectangle, the product
+  // of the x and y scales equals the per-pixel renormalization at borders
+  // (up to rounding: the sums are taken in a different order).
+  kernel.resize(size+1);
+  for (int k = 0; k <= size; k++) 
+    kernel[k] = exp(-(double) (k*k) / 2.0 / sigma / sigma);
+  scale.resize(n);
+  for (int p = 0; p < n; p++) {
+    double total = 0;
+    for (int q = (p - size < 0 ? 0 : p - size); q < (p + size + 1 > n ? n : p + size + 1); q++) 
+      total += kernel[abs(q - p)];
+    scale[p] = 1.0 / total;
+  }
+}
+
+
+
+static void
+BlurPlane(float *plane, int width, int height, int rowstride, int size,
+  const std::vector<double>& kernel, const std::vector<double>& xscale, const std::vector<double>& yscale)
+{
+  // Blur one float plane with a horizontal and then a vertical 1-D pass
+  std::vector<float> weights(kernel.begin(), kernel.end());
+  ScratchArray<float> horizontal(rowstride * height);
+
+  // Horizontal pass into temporary plane
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const float *src = &plane[y*rowstride];
+      float *dst = &horizontal[y*rowstride];
+      for (int x0 = 0; x0 < width; x0++) {
+        float p = 0;
+        for (int x = (x0 - size < 0 ? 0 : x0 - size); x < (x0 + size + 1 > width ? width : x0 + size + 1); x++) 
+          p += weights[abs(x - x0)] * src[x];
+        dst[x0] = p * (float) xscale[x0];
+      }
+    }
+  });
+
+  // Vertical pass back into plane, accumulating whole rows
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    float *sum = (float *) R2ThreadScratch(0, width * sizeof(float));
+    for (int y0 = begin; y0 < end; y0++) {
+      for (int x = 0; x < width; x++) sum[x] = 0;
+      for (int y = (y0 - size < 0 ? 0 : y0 - size); y < (y0 + size + 1 > height ? height : y0 + size + 1); y++) {
+        const float *src = &horizontal[y*rowstride];
+        float w = weights[abs(y - y0)];
+        for (int x = 0; x < width; x++) sum[x] += w * src[x];
+      }
+      float *dst = &plane[y0*rowstride];
+      float s = (float) yscale[y0];
+      for (int x = 0; x < width; x++) dst[x] = sum[x] * s;
+    }
+  });
+}
+
+
+
+static void
+RecursiveGaussianCoefficients(double sigma, double c[4], double m[3][3])
+{
+  // Coefficients of a 3rd-order recursive Gaussian (Young and van Vliet),
+  // w[n] = c[0] x[n] + c[1] w[n-1] + c[2] w[n-2] + c[3] w[n-3], and the
+  // boundary matrix m giving the anticausal pass its starting state.
+  // The poles for sigma 2 are scaled by 1/q, with q solved (Newton) so that
+  // the variance of the forward+backward filter is exactly sigma^2.
+  const std::complex<double> d[3] = {
+    std::complex<double>(1.41650, 1.00829),
+    std::complex<double>(1.41650, -1.00829),
+    std::complex<double>(1.86543, 0.0)
+  };
+  double q = 0.5 * sigma;
+  for (int iteration = 0; iteration < 20; iteration++) {
+    // Variance is 2 * sum of d/(d-1)^2 over the scaled poles
+    double variance = 0, dvariance = 0;
+    for (int k = 0; k < 3; k++) {
+      std::complex<double> dk = pow(d[k], 1.0 / q);
+      std::complex<double> ddk = -dk * log(d[k]) / (q * q);
+      variance += 2 * (dk / ((dk - 1.0) * (dk - 1.0))).real();
+      dvariance += 2 * (-(dk + 1.0) / ((dk - 1.0) * (dk - 1.0) * (dk - 1.0)) * ddk).real();
+    }
+    double step = (variance - sigma * sigma) / dvariance;
+    q -= step;
+    if (fabs(step) < 1.0E-10 * q) break;
+  }
+
+  // Expand the denominator (1 - p1/z)(1 - p2/z)(1 - p3/z) with p = 1/d
+  std::complex<double> p1 = 1.0 / pow(d[0], 1.0 / q);
+  std::complex<double> p2 = 1.0 / pow(d[1], 1.0 / q);
+  std::complex<double> p3 = 1.0 / pow(d[2], 1.0 / q);
+  c[1] = (p1 + p2 + p3).real();
+  c[2] = -(p1*p2 + p1*p3 + p2*p3).real();
+  c[3] = (p1*p2*p3).real();
+  c[0] = 1.0 - c[1] - c[2] - c[3];
+
+  // Past the end of a line the input is zero, so the causal output goes on
+  // as w[n-1+k] = sum of a_j p_j^k, with a fit to w[n-1], w[n-2], w[n-3],
+  // and the anticausal pass over that tail is sum of a_j p_j^k g_j with
+  // g_j = c[0] / (1 - c[1] p_j - c[2] p_j^2 - c[3] p_j^3) (Triggs and Sdika).
+  // Row k of m gives its value at n+k from (w[n-1], w[n-2], w[n-3]).
+  const std::complex<double> p[3] = { p1, p2, p3 };
+  std::complex<double> v[3][3], vinverse[3][3];
+  for (int s = 0; s < 3; s++) 
+    for (int j = 0; j < 3; j++) v[s][j] = pow(p[j], -s);
+  std::complex<double> determinant = 0;
+  for (int j = 0; j < 3; j++) {
+    for (int s = 0; s < 3; s++) {
+      // Cofactor of v[s][j], transposed into the inverse
+      int s1 = (s + 1) % 3, s2 = (s + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+      vinverse[j][s] = v[s1][j1] * v[s2][j2] - v[s1][j2] * v[s2][j1];
+    }
+    determinant += v[0][j] * vinverse[j][0];
+  }
+  for (int k = 0; k < 3; k++) {
+    for (int s = 0; s < 3; s++) {
+      std::complex<double> sum = 0;
+      for (int j = 0; j < 3; j++) {
+        std::complex<double> g = c[0] / (1.0 - c[1] * p[j] - c[2] * p[j] * p[j] - c[3] * p[j] * p[j] * p[j]);
+        sum += pow(p[j], k + 1) * g * vinverse[j][s];
+      }
+      m[k][s] = (sum / determinant).real();
+    }
+  }
+}
+
+
+
+static void
+RecursiveGaussianLine(double *line, int n, const double c[4], const double m[3][3])
+{
+  // Filter line[0..n-1] in place with a causal and then an anticausal
+  // recursion.  Samples before 0 and after n-1 are taken to be zero, and
+  // the anticausal pass starts from its exact state for that (through m).
+  double B = c[0], c1 = c[1], c2 = c[2], c3 = c[3];
+  double w1 = 0, w2 = 0, w3 = 0;
+  for (int i = 0; i < n; i++) {
+    double w = B * line[i] + c1 * w1 + c2 * w2 + c3 * w3;
+    line[i] = w;
+    w3 = w2; w2 = w1; w1 = w;
+  }
+  double tail[3];
+  for (int k = 0; k < 3; k++) tail[k] = m[k][0] * w1 + m[k][1] * w2 + m[k][2] * w3;
+  w1 = tail[0]; w2 = tail[1]; w3 = tail[2];
+  for (int i = n-1; i >= 0; i--) {
+    double w = B * line[i] + c1 * w1 + c2 * w2 + c3 * w3;
+    line[i] = w;
+    w3 = w2; w2 = w1; w1 = w;
+  }
+}
+
+
+
+static void
+RecursiveGaussianPlane(double *plane, int width, int height, const double c[4], const double m[3][3])
+{
+  // Filter a width x height plane of doubles along rows, then along
+  // columns.  The vertical recursion advances a whole row at a time so
+  // memory is walked in order.
+  double B = c[0], c1 = c[1], c2 = c[2], c3 = c[3];
+  int n = height;
+
+  // Horizontal pass
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int y = begin; y < end; y++) 
+      RecursiveGaussianLine(&plane[y*width], width, c, m);
+  });
+
+  // Rows past the end that start the vertical anticausal pass
+  ScratchArray<double> tail(3 * width);
+
+  // Vertical passes, in strips of columns (which are independent)
+  R2ParallelFor(width, R2_IMAGE_TILE_COLUMNS, [&](int begin, int end) {
+    // Vertical causal pass
+    for (int y = 0; y < n; y++) {
+      double *row = &plane[y*width];
+      const double *row1 = (y >= 1) ? &plane[(y-1)*width] : NULL;
+      const double *row2 = (y >= 2) ? &plane[(y-2)*width] : NULL;
+      const double *row3 = (y >= 3) ? &plane[(y-3)*width] : NULL;
+      for (int x = begin; x < end; x++) {
+        double w = B * row[x];
+        if (row1) w += c1 * row1[x];
+        if (row2) w += c2 * row2[x];
+        if (row3) w += c3 * row3[x];
+        row[x] = w;
+      }
+    }
+
+    // Vertical anticausal pass
+    for (int k = 0; k < 3; k++) {
+      for (int x = begin; x < end; x++) {
+        double w = 0;
+        for (int s = 0; s < 3; s++) 
+          if (n-1-s >= 0) w += m[k][s] * plane[(n-1-s)*width + x];
+        tail[k*width + x] = w;
+      }
+    }
+    for (int y = n-1; y >= 0; y--) {
+      double *row = &plane[y*width];
+      const double *row1 = (y+1 < n) ? &plane[(y+1)*width] : &tail[(y+1-n)*width];
+      const double *row2 = (y+2 < n) ? &plane[(y+2)*width] : &tail[(y+2-n)*width];
+      const double *row3 = (y+3 < n) ? &plane[(y+3)*width] : &tail[(y+3-n)*width];
+      for (int x = begin; x < end; x++) 
+        row[x] = B * row[x] + c1 * row1[x] + c2 * row2[x] + c3 * row3[x];
+    }
+  });
+}
+
+
+
+void
+R2BlurRowHorizontal(const R2Pixel *src, double *dst, int width, int size,
+  const double *kernel, const double *xscale)
+{
+  // Blur the colors of one row with the 1-D kernel, renormalized at the ends
+  for (int x0 = 0; x0 < width; x0++) {
+    double r = 0, g = 0, b = 0;
+    for (int x = (x0 - size < 0 ? 0 : x0 - size); x < (x0 + size + 1 > width ? width : x0 + size + 1); x++) {
+      double w = kernel[abs(x - x0)];
+      r += w * src[x].Red();
+      g += w * src[x].Green();
+      b += w * src[x].Blue();
+    }
+    dst[3*x0+0] = r * xscale[x0];
+    dst[3*x0+1] = g * xscale[x0];
+    dst[3*x0+2] = b * xscale[x0];
+  }
+}
+
+
+
+void
+R2BlurRowVertical(const double *const *rows, int ylow, int yhigh, int y0, int width,
+  const double *kernel, double yscale, double *sum, R2Pixel *dst)
+{
+  // Accumulate whole rows of the horizontal pass (alpha of dst is kept)
+  for (int k = 0; k < 3*width; k++) sum[k] = 0;
+  for (int y = ylow; y < yhigh; y++) {
+    const double *src = rows[y - ylow];
+    double w = kernel[abs(y - y0)];
+    for (int k = 0; k < 3*width; k++) sum[k] += w * src[k];
+  }
+  for (int x = 0; x < width; x++) {
+    dst[x].SetRed(sum[3*x+0] * yscale);
+    dst[x].SetGreen(sum[3*x+1] * yscale);
+    dst[x].SetBlue(sum[3*x+2] * yscale);
+  }
+}
+
+
+
+static void
+BlurPixels(R2Pixel *pixels, int width, int height, int rowstride, int size,
+  const std::vector<double>& kernel, const std::vector<double>& xscale, const std::vector<double>& yscale)
+{
+  // Blur the color channels of R2Pixels with two 1-D passes (alpha is kept)
+  ScratchArray<double> horizontal(3 * width * height);
+
+  // Horizontal pass into temporary rgb buffer
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int y = begin; y < end; y++) 
+      R2BlurRowHorizontal(&pixels[y*rowstride], &horizontal[3*y*width], width, size, &kernel[0], &xscale[0]);
+  });
+
+  // Vertical pass back into pixels
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    double *sum = (double *) R2ThreadScratch(0, 3 * width * sizeof(double));
+    std::vector<const double *> rows(2*size + 1);
+    for (int y0 = begin; y0 < end; y0++) {
+      int ylow = (y0 - size < 0) ? 0 : y0 - size;
+      int yhigh = (y0 + size + 1 > height) ? height : y0 + size + 1;
+      for (int y = ylow; y < yhigh; y++) rows[y - ylow] = &horizontal[3*y*width];
+      R2BlurRowVertical(&rows[0], ylow, yhigh, y0, width, &kernel[0], yscale[y0], sum, &pixels[y0*rowstride]);
+    }
+  });
+}
+
+
+
+void
+R2EdgeDetectRow(const R2Pixel *const *rows, int width, R2Pixel *dst)
+{
+  // Apply the 3x3 Laplacian (8 in the center, -1 around it), normalized
+  // by the sum of the absolute weights inside the image
+  for (int x0 = 0; x0 < width; x0++) {
+    R2Pixel p(0.0, 0.0, 0.0, 1.0);
+    double counter = 0;
+    for (int k = 0; k < 3; k++) {
+      const R2Pixel *row = rows[k];
+      if (!row) continue;
+      for (int x = x0 - 1; x <= x0 + 1; x++) {
+        if (x < 0) continue;
+        if (x >= width) continue;
+        if (x == x0 && k == 1) {
+          p += 8*row[x];
+          counter += 8;
+        } else {
+          p += -1.0*row[x];
+          counter++;
+        }
+      }
+    }
+    p /= counter;
+    dst[x0] = p;
+  }
+}
+
+
+
+void
+R2SharpenRow(const R2Pixel *blurred, R2Pixel *row, int width, double factor)
+{
+  // Extrapolate away from the blurred row
+  // (from the original image we remove the blur portion of the image)
+  for (int i = 0; i < width; i++) {
+    row[i] = (1-factor)*blurred[i] + factor*row[i];
+    row[i].Clamp();
+  }
+}
+
+
+
+static double
+CubicWeight(double t)
+{
+  // Keys cubic convolution kernel (a = -0.5)
+  t = fabs(t);
+  if (t < 1) return (1.5*t - 2.5)*t*t + 1;
+  if (t < 2) return ((-0.5*t + 2.5)*t - 4)*t + 2;
+  return 0;
+}
+
+
+
+static double
+LanczosWeight(double t)
+{
+  // Lanczos kernel with three lobes
+  if (t == 0) return 1;
+  if (fabs(t) >= 3) return 0;
+  double u = M_PI * t;
+  return 3 * sin(u) * sin(u / 3) / (u * u);
+}
+
+
+
+static int
+MaxFilterTaps(int sampling_method, double sigma)
+{
+  // Return the most input positions one sample can read
+  // (sigma is the Gaussian's standard deviation, or how far the
+  //  bicubic and Lanczos kernels are stretched when downsampling)
+  switch (sampling_method) {
+  case R2_IMAGE_POINT_SAMPLING: return 1;
+  case R2_IMAGE_BILINEAR_SAMPLING: return 2;
+  case R2_IMAGE_GAUSSIAN_SAMPLING: {
+    int size = sigma * 3;
+    if (size < 1) size = 1;
+    return 2*size + 1; }
+  case R2_IMAGE_BICUBIC_SAMPLING: return 2 * (int) ceil(2 * sigma) + 1;
+  case R2_IMAGE_LANCZOS_SAMPLING: return 2 * (int) ceil(3 * sigma) + 1;
+  }
+  return 0;
+}
+
+
+
+static int
+FilterTaps(double x, int n, int sampling_method, double sigma, int *index, double *weight, int *alpha)
+{
+  // Fill index and weight with the input positions in [0,n) that a sample
+  // at x reads, and return how many there are.  Alpha is copied from the
+  // input position returned in alpha (or set to 1 if it is negative).
+  int nearest = lround(x);
+  if (nearest < 0) nearest = 0;
+  if (nearest >= n) nearest = n - 1;
+  if (sampling_method == R2_IMAGE_POINT_SAMPLING) {
+    index[0] = nearest;
+    weight[0] = 1.0;
+    *alpha = nearest;
+    return 1;
+  }
+  else if (sampling_method == R2_IMAGE_BILINEAR_SAMPLING) {
+    int low = floor(x) > 0 ? floor(x) : 0;
+    int high = ceil(x) < n ? ceil(x) : n - 1;
+    if (low > n - 1) low = n - 1;
+    index[0] = low;
+    index[1] = high;
+    weight[0] = 1.0 - (x - low);
+    weight[1] = x - low;
+    *alpha = low;
+    return 2;
+  }
+
+  // Weigh positions around x and renormalize by the weights inside [0,n)
+  int count = 0;
+  double total = 0;
+  if (sampling_method == R2_IMAGE_GAUSSIAN_SAMPLING) {
+    int center = lround(x);
+    int size = sigma * 3;
+    if (size < 1) size = 1;
+    for (int i = (center - size < 0 ? 0 : center - size); i < (center + size + 1 > n ? n : center + size + 1); i++) {
+      double w = exp(-(i - x)*(i - x) / 2.0 / sigma / sigma);
+      index[count] = i;
+      weight[count++] = w;
+      total += w;
+    }
+    *alpha = -1;
+  }
+  else {
+    double support = ((sampling_method == R2_IMAGE_BICUBIC_SAMPLING) ? 2 : 3) * sigma;
+    int low = (int) floor(x - support) + 1;
+    int high = (int) ceil(x + support) - 1;
+    for (int i = (low < 0 ? 0 : low); i <= (high > n - 1 ? n - 1 : high); i++) {
+      double t = (i - x) / sigma;
+      double w = (sampling_method == R2_IMAGE_BICUBIC_SAMPLING) ? CubicWeight(t) : LanczosWeight(t);
+      index[count] = i;
+      weight[count++] = w;
+      total += w;
+    }
+    *alpha = nearest;
+  }
+
+  // Fall back to the nearest position if no weight falls inside
+  if ((count == 0) || (total == 0)) {
+    index[0] = nearest;
+    weight[0] = 1.0;
+    return 1;
+  }
+  for (int t = 0; t < count; t++) weight[t] /= total;
+  return count;
+}
+
+
+
+int
+R2CheckScale(int width, int height, double sx, double sy)
+{
+  // Check scale factors (NaN fails the comparisons)
+  if (!(sx > 0) || !(sy > 0) || !isfinite(sx) || !isfinite(sy)) {
+    fprintf(stderr, "Invalid scale factors (%g %g)\n", sx, sy);
+    return 0;
+  }
+
+  // Check scaled size
+  if ((sx * width > INT_MAX) || (sy * height > INT_MAX)) {
+    fprintf(stderr, "Scaled image (%gx%g) is too large\n", sx * width, sy * height);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+void
+R2ResampleWeights(int n, int m, double scale, int sampling_method, R2ResampleFilter& filter)
+{
+  // Output position i samples input position n/m*i + (n/m - 1)/2, with
+  // a Gaussian of sigma 1/(3*scale) (at most 0.5), or the bicubic or
+  // Lanczos kernel stretched by 1/scale when downsampling
+  double sigma;
+  if (sampling_method == R2_IMAGE_GAUSSIAN_SAMPLING) sigma = (scale > 1.0) ? 0.5 : 1.0/3.0/scale;
+  else sigma = (scale < 1.0) ? 1.0/scale : 1.0;
+  filter.ntaps = (m > 0) ? MaxFilterTaps(sampling_method, sigma) : 0;
+  filter.index.assign(m * filter.ntaps, 0);
+  filter.weight.assign(m * filter.ntaps, 0.0);
+  filter.alpha.assign(m, 0);
+  if (filter.ntaps == 0) return;
+
+  // Fill taps, padding with zero weights
+  int ntaps = filter.ntaps;
+  double offset = 0.5 * ((double)n) / ((double)m) - 0.5;
+  for (int i = 0; i < m; i++) {
+    double x = ((double)n) / ((double)m) * i + offset;
+    int *index = &filter.index[i*ntaps];
+    double *weight = &filter.weight[i*ntaps];
+    int count = FilterTaps(x, n, sampling_method, sigma, index, weight, &filter.alpha[i]);
+    for (int t = count; t < ntaps; t++) {
+      index[t] = index[count-1];
+      weight[t] = 0.0;
+    }
+  }
+}
+
+
+
+void
+R2ResampleRowHorizontal(const R2Pixel *src, R2Pixel *dst, int width, const R2ResampleFilter& filter)
+{
+  // Weigh the taps of each output column (R2Pixels are four doubles,
+  // accumulated two at a time)
+  int ntaps = filter.ntaps;
+  for (int x = 0; x < width; x++) {
+    const int *index = &filter.index[x*ntaps];
+    const double *weight = &filter.weight[x*ntaps];
+    double *d = (double *) &dst[x];
+#if defined(__SSE2__)
+    const double *p = (const double *) &src[index[0]];
+    __m128d w = _mm_set1_pd(weight[0]);
+    __m128d rg = _mm_mul_pd(_mm_loadu_pd(p), w);
+    __m128d ba = _mm_mul_pd(_mm_loadu_pd(p + 2), w);
+    for (int t = 1; t < ntaps; t++) {
+      p = (const double *) &src[index[t]];
+      w = _mm_set1_pd(weight[t]);
+      rg = _mm_add_pd(rg, _mm_mul_pd(_mm_loadu_pd(p), w));
+      ba = _mm_add_pd(ba, _mm_mul_pd(_mm_loadu_pd(p + 2), w));
+    }
+    _mm_storeu_pd(d, rg);
+    _mm_storeu_pd(d + 2, ba);
+#else
+    const R2Pixel& p = src[index[0]];
+    double r = weight[0] * p.Red(), g = weight[0] * p.Green(), b = weight[0] * p.Blue();
+    for (int t = 1; t < ntaps; t++) {
+      const R2Pixel& q = src[index[t]];
+      r += weight[t] * q.Red();
+      g += weight[t] * q.Green();
+      b += weight[t] * q.Blue();
+    }
+    d[0] = r; d[1] = g; d[2] = b;
+#endif
+    d[3] = (filter.alpha[x] < 0) ? 1.0 : src[filter.alpha[x]].Alpha();
+  }
+}
+
+
+
+void
+R2ResampleRowVertical(const R2Pixel *const *rows, const double *weights, int ntaps,
+  const R2Pixel *alpha_row, int width, R2Pixel *dst)
+{
+  // Weigh whole rows (as 4*width doubles) into dst
+  int n = 4 * width;
+  double *d = (double *) dst;
+  const double *p = (const double *) rows[0];
+  int k = 0;
+#if defined(__SSE2__)
+  __m128d w = _mm_set1_pd(weights[0]);
+  for (; k + 2 <= n; k += 2) _mm_storeu_pd(d + k, _mm_mul_pd(_mm_loadu_pd(p + k), w));
+#endif
+  for (; k < n; k++) d[k] = weights[0] * p[k];
+  for (int t = 1; t < ntaps; t++) {
+    p = (const double *) rows[t];
+    k = 0;
+#if defined(__SSE2__)
+    w = _mm_set1_pd(weights[t]);
+    for (; k + 2 <= n; k += 2) 
+      _mm_storeu_pd(d + k, _mm_add_pd(_mm_loadu_pd(d + k), _mm_mul_pd(_mm_loadu_pd(p + k), w)));
+#endif
+    for (; k < n; k++) d[k] += weights[t] * p[k];
+  }
+
+  // Copy alpha from one row
+  for (int x = 0; x < width; x++) dst[x].SetAlpha(alpha_row ? alpha_row[x].Alpha() : 1.0);
+}
+
+
+
+void
+R2PointOperationRow(R2Pixel *row, int n, const R2ImagePointOperation& operation, double average)
+{
+  // Apply one point operation to n pixels.  Each case does the same 
+  // arithmetic as the corresponding R2Image function on R2Pixels
+  // (average is the luminance used by contrast changes).
+  const double *parameters = operation.parameters;
+  switch (operation.type) {
+  case R2_IMAGE_BRIGHTNESS_OPERATION:
+    for (int i = 0; i < n; i++) {
+      row[i] *= parameters[0];
+      row[i].Clamp();
+    }
+    break;
+
+  case R2_IMAGE_CONTRAST_OPERATION: {
+    double factor = parameters[0];
+    R2Pixel greypixel(average, average, average, 1.0);
+    for (int i = 0; i < n; i++) {
+      row[i] = (1-factor)*greypixel + factor*row[i];
+      row[i].Clamp();
+    }
+    break; }
+
+  case R2_IMAGE_SATURATION_OPERATION: {
+    // Interpolate between the pixel and its grey (luminance) value
+    double factor = parameters[0];
+    for (int i = 0; i < n; i++) {
+      double grey = (1-factor) * row[i].Luminance();
+      row[i].SetRed(grey + factor * row[i].Red());
+      row[i].SetGreen(grey + factor * row[i].Green());
+      row[i].SetBlue(grey + factor * row[i].Blue());
+      row[i].Clamp();
+    }
+    break; }
+
+  case R2_IMAGE_NOISE_OPERATION:
+    for (int i = 0; i < n; i++) {
+      R2Pixel& pixel = row[i];
+      pixel[0] += parameters[0] * (RandomNumber() - 0.5);
+      pixel[1] += parameters[0] * (RandomNumber() - 0.5);
+      pixel[2] += parameters[0] * (RandomNumber() - 0.5);
+      pixel.Clamp();
+    }
+    break;
+
+  case R2_IMAGE_GAMMA_OPERATION: {
+    const R2GammaTable *table = GammaTable(parameters[0]);
+    for (int i = 0; i < n; i++) {
+      for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+        row[i][c] = (table) ? GammaLookup(table, row[i][c]) : pow(row[i][c], parameters[0]);
+    }
+    break; }
+
+  case R2_IMAGE_WHITEBALANCE_OPERATION:
+    // Scale channels so that (red, green, blue) becomes white
+    for (int i = 0; i < n; i++) {
+      for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+        row[i][c] /= parameters[c];
+      row[i].Clamp();
+    }
+    break;
+
+  case R2_IMAGE_QUANTIZE_OPERATION: {
+    // Round color channels to 2^nbits evenly spaced levels
+    double levels = pow(2.0, parameters[0]) - 1;
+    for (int i = 0; i < n; i++) {
+      row[i].Clamp();
+      for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+        row[i][c] = floor(row[i][c] * levels + 0.5) / levels;
+    }
+    break; }
+
+  case R2_IMAGE_BLACKANDWHITE_OPERATION:
+    for (int i = 0; i < n; i++) {
+      double grey = row[i].Luminance();
+      row[i].SetRed(grey);
+      row[i].SetGreen(grey);
+      row[i].SetBlue(grey);
+    }
+    break;
+
+  case R2_IMAGE_EXTRACT_OPERATION: {
+    int channel = (int) parameters[0];
+    for (int i = 0; i < n; i++) {
+      for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+        if (c != channel) row[i][c] = 0.0;
+      }
+    }
+    break; }
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Image processing functions
+// YOU IMPLEMENT THE FUNCTIONS IN THIS SECTION
+////////////////////////////////////////////////////////////////////////
+
+ 
+void R2Image::
+ApplyGamma(double exponent)
+{
+  // Apply a gamma correction with exponent to each pixel
+  R2TraceScope trace("image", "ApplyGamma", width, height, 2 * PixelBytes(npixels));
+  //It defines the relationship between a pixel's numerical value and its actual luminance.
+// gamma is what translates between our eye's light sensitivity and that of the camera
+  if(exponent < 0) {
+    fprintf(stderr, "Gamma exponent (%f) negative\n", exponent);
+    return;
+  }
+
+  // Gamma applies to the encoded values
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+
+  // Walk the color planes directly in planar storage
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+      GammaPlane(&planes[c*rowstride*height], width, height, rowstride, exponent);
+  }
+  else {
+    GammaPixels(pixels, width, height, rowstride, exponent);
+  }
+}
+
+
+
+R2Pixel R2Image::Sample(double x0, double y0, int sampling_method, double sigma_x, double sigma_y)
+{
+  // Sample gamma encoded pixels around (x0, y0)
+  // (sigma is the Gaussian's standard deviation, or the stretch of the
+  //  bicubic and Lanczos kernels)
+  int nx = MaxFilterTaps(sampling_method, sigma_x);
+  int ny = MaxFilterTaps(sampling_method, sigma_y);
+  if ((nx <= 0) || (ny <= 0)) {
+    fprintf(stderr, "Invalid sampling method (%d)\n", sampling_method);
+    return R2Pixel();
+  }
+  if (storage != R2_IMAGE_PIXEL_STORAGE) ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+
+  // Get taps in each direction
+  std::vector<int> xindex(nx), yindex(ny);
+  std::vector<double> xweight(nx), yweight(ny);
+  int xalpha, yalpha;
+  nx = FilterTaps(x0, width, sampling_method, sigma_x, &xindex[0], &xweight[0], &xalpha);
+  ny = FilterTaps(y0, height, sampling_method, sigma_y, &yindex[0], &yweight[0], &yalpha);
+
+  // Filter rows horizontally, then the results vertically
+  R2Pixel p;
+  for (int t = 0; t < ny; t++) {
+    const R2Pixel *row = &pixels[yindex[t]*rowstride];
+    R2Pixel h = xweight[0] * row[xindex[0]];
+    for (int s = 1; s < nx; s++) h += xweight[s] * row[xindex[s]];
+    if (t == 0) p = yweight[0] * h;
+    else p += yweight[t] * h;
+  }
+  p.SetAlpha(((xalpha < 0) || (yalpha < 0)) ? 1.0 : pixels[yalpha*rowstride + xalpha].Alpha());
+  return p;
+}
+
+
+
+
+// Luminance Operations ////////////////////////////////////////////////
+
+void R2Image::
+AddNoise(double magnitude)
+{
+  // Add noise to an image.  The amount of noise is given by the magnitude
+  // in the range [0.0..1.0].  0.0 adds no noise.  1.0 adds a lot of noise.
+
+ 
+  // This implementation is provided as an example of one way to manipulate pixels
+  R2TraceScope trace("image", "AddNoise", width, height, 2 * PixelBytes(npixels));
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      R2Pixel& pixel = Pixel(i, j);
+      pixel[0] += magnitude * (RandomNumber() - 0.5);
+      pixel[1] += magnitude * (RandomNumber() - 0.5);
+      pixel[2] += magnitude * (RandomNumber() - 0.5);
+      pixel.Clamp();
+    }
+  }
+  ConvertStorage(saved_storage);
+ 
+}
+
+void R2Image::
+Brighten(double factor)
+{
+  // Brighten the image by multiplying each pixel component by the factor.
+  // This is implemented for you as an example of how to access and set pixels
+  R2TraceScope trace("image", "Brighten", width, height, 2 * PixelBytes(npixels));
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+      // Scale color channels, then clamp all channels like R2Pixel::Clamp
+      float scale = (c == R2_IMAGE_ALPHA_CHANNEL) ? 1.0f : (float) factor;
+      float *plane = Channel(c);
+      R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+        for (int j = begin; j < end; j++) {
+          float *row = plane + j*rowstride;
+          for (int i = 0; i < width; i++) {
+            float value = scale * row[i];
+            row[i] = (value > 1.0f) ? 1.0f : ((value < 0.0f) ? 0.0f : value);
+          }
+        }
+      });
+    }
+    return;
+  }
+
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      R2Pixel *row = &pixels[j*rowstride];
+      for (int i = 0; i < width; i++) {
+        //each pixel is multiplied by the factor
+        row[i] *= factor;
+        row[i].Clamp();
+      }
+    }
+  });
+}
+
+
+
+void R2Image::
+ChangeContrast(double factor)
+{
+  // Change the contrast of an image by interpolating between the image
+  // and a constant gray image with the average luminance.
+  // Interpolation reduces constrast, extrapolation boosts constrast,
+  // and negative factors generate inverted images.
+  // Luminance is summed per row and then over rows in order, so the
+  // average does not depend on how rows are split among threads
+  R2TraceScope trace("image", "ChangeContrast", width, height, 3 * PixelBytes(npixels));
+  double avg = 0;
+  std::vector<double> row_sums(height, 0.0);
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    // Same computation one channel plane at a time
+    R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+      for (int j = begin; j < end; j++) {
+        const float *r = &planes[R2_IMAGE_RED_CHANNEL*rowstride*height + j*rowstride];
+        const float *g = &planes[R2_IMAGE_GREEN_CHANNEL*rowstride*height + j*rowstride];
+        const float *b = &planes[R2_IMAGE_BLUE_CHANNEL*rowstride*height + j*rowstride];
+        double sum = 0;
+        for (int i = 0; i < width; i++) 
+          sum += 0.30 * r[i] + 0.59 * g[i] + 0.11 * b[i];
+        row_sums[j] = sum;
+      }
+    });
+    for (int j = 0; j < height; j++) avg += row_sums[j];
+    avg /= npixels;
+
+    R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+      for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) {
+        for (int j = begin; j < end; j++) {
+          float *row = &planes[c*rowstride*height + j*rowstride];
+          for (int i = 0; i < width; i++) {
+            double value = (1-factor)*avg + factor*row[i];
+            row[i] = (value > 1.0) ? 1.0f : ((value < 0.0) ? 0.0f : (float) value);
+          }
+        }
+      }
+
+      // Alpha comes from the grey pixel
+      for (int j = begin; j < end; j++) {
+        float *row = &planes[R2_IMAGE_ALPHA_CHANNEL*rowstride*height + j*rowstride];
+        for (int i = 0; i < width; i++) row[i] = 1.0f;
+      }
+    });
+    return;
+  }
+
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      const R2Pixel *row = &pixels[j*rowstride];
+      double sum = 0;
+      for (int i = 0; i < width; ++i)
+      {
+        //finding of average luminance using formula
+        sum += row[i].Luminance();
+      }
+      row_sums[j] = sum;
+    }
+  });
+  for (int j = 0; j < height; j++) avg += row_sums[j];
+
+  avg /= npixels;
+
+  R2Pixel greypixel(avg, avg, avg, 1.0);
+  
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      R2Pixel *row = &pixels[j*rowstride];
+      for (int i = 0; i < width; i++) {
+        //interpolation with avg greyscale luminance image
+        row[i] = (1-factor)*greypixel + factor*row[i];
+        row[i].Clamp();
+      }
+    }
+  });
+  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
+  //fprintf(stderr, "ChangeContrast(%g) not implemented\n", factor);
+}
+
+
+void R2Image::
+ChangeSaturation(double factor)
+{
+  // Change the saturation of an image by interpolating between the image
+  // and its grey (luminance) version.  0 makes the image grey, 
+  // factors above 1 boost saturation.
+  R2ImagePointOperation operation = { R2_IMAGE_SATURATION_OPERATION, { factor, 0, 0 } };
+  ApplyPointOperations(&operation, 1);
+}
+
+
+
+void R2Image::
+WhiteBalance(double red, double green, double blue)
+{
+  // Scale the color channels so that (red, green, blue) becomes white
+  if ((red <= 0) || (green <= 0) || (blue <= 0)) {
+    fprintf(stderr, "Invalid white balance color (%g %g %g)\n", red, green, blue);
+    return;
+  }
+  R2ImagePointOperation operation = { R2_IMAGE_WHITEBALANCE_OPERATION, { red, green, blue } };
+  ApplyPointOperations(&operation, 1);
+}
+
+
+
+void R2Image::
+Quantize(int nbits)
+{
+  // Round the color channels to nbits per channel
+  if ((nbits < 1) || (nbits > 16)) {
+    fprintf(stderr, "Invalid number of bits for quantization (%d)\n", nbits);
+    return;
+  }
+  R2ImagePointOperation operation = { R2_IMAGE_QUANTIZE_OPERATION, { (double) nbits, 0, 0 } };
+  ApplyPointOperations(&operation, 1);
+}
+
+
+
+void R2Image::
+BlackAndWhite(void)
+{
+  // Replace the color channels with luminance
+  R2ImagePointOperation operation = { R2_IMAGE_BLACKANDWHITE_OPERATION, { 0, 0, 0 } };
+  ApplyPointOperations(&operation, 1);
+}
+
+
+
+void R2Image::
+ApplyPointOperations(const R2ImagePointOperation *operations, int noperations)
+{
+  // Apply a sequence of per-pixel operations, fusing them into as few
+  // passes over the pixels as possible.  Passes are broken only where 
+  // an operation needs something from the whole image first:
+  //   a contrast change needs the average luminance of its input, which
+  //   the pass before it sums while writing its output (a barrier), and
+  //   a second noise operation starts a new pass so that random numbers
+  //   are drawn in the same order as by separate AddNoise calls
+  // (passes with noise run serially for the same reason).
+  // Results match applying the operations one at a time on R2Pixels.
+  if (noperations <= 0) return;
+  R2TraceScope trace("image", "ApplyPointOperations", width, height, 2 * PixelBytes(npixels));
+
+  // Check parameters
+  for (int k = 0; k < noperations; k++) {
+    const R2ImagePointOperation& operation = operations[k];
+    if ((operation.type < 0) || (operation.type >= R2_IMAGE_NUM_POINT_OPERATIONS)) {
+      fprintf(stderr, "Invalid point operation (%d)\n", operation.type);
+      return;
+    }
+    if ((operation.type == R2_IMAGE_GAMMA_OPERATION) && (operation.parameters[0] < 0)) {
+      fprintf(stderr, "Gamma exponent (%f) negative\n", operation.parameters[0]);
+      return;
+    }
+  }
+
+  // Point operations work on gamma encoded R2Pixels
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+
+  // Run passes
+  std::vector<double> averages(noperations, 0.0);
+  std::vector<bool> averaged(noperations, false);
+  std::vector<double> row_sums(height, 0.0);
+  int start = 0;
+  while (start < noperations) {
+    // Find end of pass
+    int end = start, nnoise = 0;
+    while (end < noperations) {
+      int type = operations[end].type;
+      if ((type == R2_IMAGE_CONTRAST_OPERATION) && !averaged[end]) break;
+      if ((type == R2_IMAGE_NOISE_OPERATION) && (nnoise++ > 0)) break;
+      end++;
+    }
+    bool reduce = (end < noperations) && (operations[end].type == R2_IMAGE_CONTRAST_OPERATION);
+
+    // Apply operations [start, end) to each row, summing luminance of the result if needed
+    R2ParallelFunction pass = [&](int begin, int finish) {
+      for (int j = begin; j < finish; j++) {
+        R2Pixel *row = &pixels[j*rowstride];
+        for (int k = start; k < end; k++) 
+          R2PointOperationRow(row, width, operations[k], averages[k]);
+        if (reduce) {
+          double sum = 0;
+          for (int i = 0; i < width; ++i) sum += row[i].Luminance();
+          row_sums[j] = sum;
+        }
+      }
+    };
+    if (nnoise > 0) pass(0, height);
+    else R2ParallelFor(height, RowGrain(width), pass);
+
+    // Compute average luminance for the contrast change that ends the pass
+    if (reduce) {
+      double avg = 0;
+      for (int j = 0; j < height; j++) avg += row_sums[j];
+      averages[end] = avg / npixels;
+      averaged[end] = true;
+    }
+
+    // Continue with next pass
+    start = end;
+  }
+
+  // Restore storage mode
+  ConvertStorage(saved_storage);
+}
+
+
+// Linear filtering ////////////////////////////////////////////////
+
+void R2Image::
+Blur(double sigma)
+{
+ 
+// Blur an image with a Gaussian filter with a given sigma.
+
+  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
+  //fprintf(stderr, "Blur(%g) not implemented\n", sigma);
+  // Convolve with a filter whose entries sum to one 
+  if(sigma == 0) return;
+  R2TraceScope trace("image", "Blur", width, height, 2 * PixelBytes(npixels));
+
+  // Large kernels are cheaper with the recursive filter
+  if (sigma >= R2_IMAGE_IIR_BLUR_THRESHOLD) {
+    BlurIIR(sigma);
+    return;
+  }
+
+// gamma is   set slightly greater than 1.0 in order to improve contrast
+  // (filter in linear light, converting back only when pixels are next read)
+  ConvertTransfer(R2_IMAGE_LINEAR_TRANSFER);
+  Detach();
+
+  // The (2*size+1)^2 Gaussian is separable, so filter rows and then
+  // columns with precomputed 1-D weights, renormalized at the borders
+  // (the sums are not bit-exact with the 2-D loop's, see R2BlurWeights)
+  int size = 3*sigma;
+  if(size < 1) size = 1;
+  std::vector<double> kernel, xscale, yscale;
+  R2BlurWeights(sigma, size, width, kernel, xscale);
+  R2BlurWeights(sigma, size, height, kernel, yscale);
+
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) 
+      BlurPlane(&planes[c*rowstride*height], width, height, rowstride, size, kernel, xscale, yscale);
+  }
+  else {
+    BlurPixels(pixels, width, height, rowstride, size, kernel, xscale, yscale);
+  }
+}
+
+
+
+void R2Image::
+BlurIIR(double sigma)
+{
+  // Blur an image with a recursive (IIR) approximation of a Gaussian filter.
+  // The cost per pixel does not depend on sigma.  Like Blur, the result is
+  // renormalized by the filter weights that fall inside the image: the same
+  // recursion is run on a line of ones to get the per-row/column scales.
+  // Compared to the truncated (3 sigma) FIR Gaussian, the maximum
+  // per-channel difference on input/princeton_small.jpg / input/c.jpg is
+  // 0.006 / 0.013 for sigma 6, 0.003 / 0.011 for sigma 8 and 0.002 / 0.004
+  // for sigma 16.  The largest differences are in dark regions, where the
+  // 1/2.2 gamma expands them; over 99.9% of samples agree to within 1/255.
+  if (sigma < 0.5) {
+    Blur(sigma);
+    return;
+  }
+  R2TraceScope trace("image", "BlurIIR", width, height, 2 * PixelBytes(npixels));
+
+  // Beyond many times the image size a larger sigma no longer changes the
+  // result, and beyond R2_IMAGE_IIR_BLUR_MAX_SIGMA the coefficients lose
+  // precision, so clamp sigma to both
+  double max_sigma = 32.0 * ((width > height) ? width : height);
+  if (max_sigma > R2_IMAGE_IIR_BLUR_MAX_SIGMA) max_sigma = R2_IMAGE_IIR_BLUR_MAX_SIGMA;
+  if ((sigma > max_sigma) && (max_sigma > 0)) sigma = max_sigma;
+
+  // Get recursion coefficients
+  double coefficients[4], boundary[3][3];
+  RecursiveGaussianCoefficients(sigma, coefficients, boundary);
+
+  // Compute renormalization for each column and row
+  std::vector<double> xscale(width, 1.0), yscale(height, 1.0);
+  if (width > 0) RecursiveGaussianLine(&xscale[0], width, coefficients, boundary);
+  if (height > 0) RecursiveGaussianLine(&yscale[0], height, coefficients, boundary);
+
+  // Filter in linear light
+  ConvertTransfer(R2_IMAGE_LINEAR_TRANSFER);
+  Detach();
+
+  // Filter one channel at a time in a plane of doubles
+  ScratchArray<double> plane(width * height);
+  for (int c = R2_IMAGE_RED_CHANNEL; c <= R2_IMAGE_BLUE_CHANNEL; c++) {
+    // Gather channel
+    for (int y = 0; y < height; y++) {
+      double *dst = &plane[y*width];
+      if (storage == R2_IMAGE_PLANAR_STORAGE) {
+        const float *src = &planes[c*rowstride*height + y*rowstride];
+        for (int x = 0; x < width; x++) dst[x] = src[x];
+      }
+      else {
+        const R2Pixel *src = &pixels[y*rowstride];
+        for (int x = 0; x < width; x++) dst[x] = src[x][c];
+      }
+    }
+
+    // Filter
+    RecursiveGaussianPlane(&plane[0], width, height, coefficients, boundary);
+
+    // Scatter channel
+    for (int y = 0; y < height; y++) {
+      const double *src = &plane[y*width];
+      if (storage == R2_IMAGE_PLANAR_STORAGE) {
+        float *dst = &planes[c*rowstride*height + y*rowstride];
+        for (int x = 0; x < width; x++) dst[x] = (float) (src[x] / (xscale[x] * yscale[y]));
+      }
+      else {
+        R2Pixel *dst = &pixels[y*rowstride];
+        for (int x = 0; x < width; x++) dst[x][c] = src[x] / (xscale[x] * yscale[y]);
+      }
+    }
+  }
+}
+
+
+
+void R2Image::
+Sharpen()
+{
+  // Sharpen an image using a linear filter
+  R2TraceScope trace("image", "Sharpen", width, height, 3 * PixelBytes(npixels));
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  R2Image blurredImage(*this);
+  blurredImage.Blur(2.0);
+
+  double factor=2.0;
+  blurredImage.ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    //interpolation Extrapolation method to sharpen the image
+    for (int j = begin; j < end; j++) 
+      R2SharpenRow(&blurredImage.pixels[j*rowstride], &pixels[j*rowstride], width, factor);
+  });
+  ConvertStorage(saved_storage);
+  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
+  //fprintf(stderr, "Sharpen() not implemented\n");
+}
+
+
+
+void R2Image::
+EdgeDetect(void)
+{
+    // Detect edges in an image.
+    R2TraceScope trace("image", "EdgeDetect", width, height, 2 * PixelBytes(npixels));
+
+    int saved_storage = storage;
+    ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+
+//em gamma is   set slightly greater than 1.0 in order to improve contrast
+    ConvertTransfer(R2_IMAGE_LINEAR_TRANSFER);
+
+  // Detect edges into a new buffer with the same layout and swap it in
+  // (rather than reading from a copy of the whole image, and zeroing
+  //  only the row padding, since the rest is written)
+  R2Image edges;
+  edges.pixels = (R2Pixel *) AllocateAligned(rowstride * height * sizeof(R2Pixel));
+  edges.owner = OwnAligned(edges.pixels);
+  edges.transfer = R2_IMAGE_LINEAR_TRANSFER;
+  edges.npixels = npixels;
+  edges.width = width;
+  edges.height = height;
+  edges.rowstride = rowstride;
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int y0 = begin; y0 < end; y0++) {
+      const R2Pixel *rows[3];
+      for (int k = 0; k < 3; k++) {
+        int y = y0 - 1 + k;
+        rows[k] = ((y < 0) || (y >= height)) ? NULL : &pixels[y*rowstride];
+      }
+      R2EdgeDetectRow(rows, width, &edges.pixels[y0*rowstride]);
+      memset((void *) &edges.pixels[y0*rowstride + width], 0, (rowstride - width) * sizeof(R2Pixel));
+    }
+  });
+  Swap(edges);
+  ConvertStorage(saved_storage);
+
+
+  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
+  //fprintf(stderr, "EdgeDetect() not implemented\n");
+}
+
+// Resampling operations  ////////////////////////////////////////////////
+
+
+void R2Image::
+Scale(double sx, double sy, int sampling_method)
+{
+  // Scale an image in x by sx, and y by sy.
+  // Output columns and rows sample the input through precomputed filter
+  // taps, first along each needed input row and then down the columns
+  if ((sampling_method < 0) || (sampling_method >= R2_IMAGE_NUM_SAMPLING_METHODS)) {
+    fprintf(stderr, "Invalid sampling method (%d)\n", sampling_method);
+    return;
+  }
+  if (!R2CheckScale(width, height, sx, sy)) return;
+  R2TraceScope trace("image", "Scale", width, height);
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  int new_width = lround(sx*width);
+  int new_height = lround(sy*height);
+  trace.SetImage(new_width, new_height, PixelBytes(npixels) + PixelBytes(new_width * new_height));
+  R2ResampleFilter xfilter, yfilter;
+  R2ResampleWeights(width, new_width, sx, sampling_method, xfilter);
+  R2ResampleWeights(height, new_height, sy, sampling_method, yfilter);
+
+  // Find input rows that are read
+  std::vector<char> used(height, 0);
+  for (unsigned int i = 0; i < yfilter.index.size(); i++) used[yfilter.index[i]] = 1;
+  for (int y = 0; y < new_height; y++) 
+    if (yfilter.alpha[y] >= 0) used[yfilter.alpha[y]] = 1;
+
+  // Resample those rows horizontally
+  ScratchArray<R2Pixel> horizontal((size_t) new_width * height);
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      if (!used[y]) continue;
+      R2ResampleRowHorizontal(&pixels[y*rowstride], &horizontal[(size_t) y*new_width], new_width, xfilter);
+    }
+  });
+
+  // Resample columns into the new image
+  Resize(new_width, new_height);
+  int ntaps = yfilter.ntaps;
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    std::vector<const R2Pixel *> rows(ntaps);
+    for (int y = begin; y < end; y++) {
+      for (int t = 0; t < ntaps; t++) rows[t] = &horizontal[(size_t) yfilter.index[y*ntaps + t]*width];
+      const R2Pixel *alpha_row = (yfilter.alpha[y] < 0) ? NULL : &horizontal[(size_t) yfilter.alpha[y]*width];
+      R2ResampleRowVertical(&rows[0], &yfilter.weight[y*ntaps], ntaps, alpha_row, width, &pixels[y*rowstride]);
+    }
+  });
+  ConvertStorage(saved_storage);
+}
+
+
+void R2Image::
+Crop(int x, int y, int width, int height)
+{
+  // Keep the rectangle with lower-left corner (x,y), clipped to the image
+  // (copying rows with the transfer function they have)
+  R2TraceScope trace("image", "Crop", this->width, this->height);
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  R2CropRectangle(this->width, this->height, x, y, width, height);
+  trace.SetImage(width, height, 2 * PixelBytes(width * height));
+  R2Image cropped(width, height);
+  cropped.transfer = transfer;
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for (int j = begin; j < end; j++) 
+      memcpy((void *) &cropped.pixels[j*cropped.rowstride], &pixels[(y + j)*rowstride + x], width * sizeof(R2Pixel));
+  });
+  Swap(cropped);
+  ConvertStorage(saved_storage);
+}
+
+
+
+void R2Image::
+Composite(const R2Image& top, int operation)
+{
+  // Composite passed image on top of this one using operation (e.g., OVER)
+  Composite(R2ImageView(top), operation);
+}
+
+
+
+void R2Image::
+Composite(const R2ImageView& top, int operation)
+{
+  // Composite passed view on top of this image using operation (e.g., OVER)
+  if ((top.Width() < width) || (top.Height() < height)) {
+    fprintf(stderr, "Top image (%dx%d) smaller than bottom image (%dx%d)\n", top.Width(), top.Height(), width, height);
+    return;
+  }
+  R2TraceScope trace("image", "Composite", width, height, 3 * PixelBytes(npixels));
+  int saved_storage = storage;
+  ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  Detach();
+  R2ParallelFor(height, RowGrain(width), [&](int begin, int end) {
+    for(int j=begin; j<end; j++) {
+      const R2Pixel *toprow = top[j];
+      R2Pixel *row = &pixels[j*rowstride];
+      for(int i=0; i<width; i++) {
+        //alpha Encodes transparency 
+        double alphatop = toprow[i].Alpha();
+        double alphabottom = row[i].Alpha();
+        //pixel are set using the alpha component of top image and 1-alpha component  of bottom image
+        row[i] = alphatop * toprow[i] + alphabottom * (1 - alphatop) * row[i];
+        row[i].SetAlpha(alphatop + alphabottom * (1-alphatop));
+      }
+    }
+  });
+  ConvertStorage(saved_storage);
+  // FILL IN IMPLEMENTATION HERE (REMOVE PRINT STATEMENT WHEN DONE)
+  //fprintf(stderr, "Composite not implemented\n");
+}
+
+
+// Miscellaneous operations ////////////////////////////////////////////////
+
+void R2Image::
+ExtractChannel(int channel)
+{
+  // Extracts a channel of an image (e.g., R2_IMAGE_RED_CHANNEL).  
+  // Leaves the specified channel intact, 
+  // and sets all the other ones to zero.
+  R2TraceScope trace("image", "ExtractChannel", width, height, 2 * PixelBytes(npixels));
+
+  // Extract channel
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+      if (c != channel) memset(Channel(c), 0, rowstride * height * sizeof(float));
+    }
+    return;
+  }
+
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      R2Pixel& pixel = Pixel(i, j);
+      for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+        if (c != channel) pixel[c] = 0.0;
+      }
+    }
+  }
+
+}
+
+
+
+void R2Image::
 CopyChannel(const R2Image& from_image, int from_channel, int to_channel)
 {
-  // Copies one channel of an image (e.g., R2_IMAGE_RED_CHANNEL).  
-  // to another channel
+  // Copies one channel of an image (e.g., R2_IMAGE_RED_CHANNEL).  
+  // to another channel
+
+  // Check consistency of image dimensions
+  if ((from_image.Width() != Width()) || (from_image.Height() != Height())) {
+    fprintf(stderr, "Invalid image dimensions in R2Image::CopyChannel\n");
+    abort();
+  }
+  R2TraceScope trace("image", "CopyChannel", width, height, 3 * PixelBytes(npixels));
+
+  // Copy channel (from a converted copy if from_image is stored differently)
+  R2Image copy;
+  if (storage == R2_IMAGE_PLANAR_STORAGE) {
+    const R2Image& from = from_image.Converted(R2_IMAGE_PLANAR_STORAGE, copy);
+    for (int j = 0; j < height; j++) {
+      memcpy(Channel(to_channel) + j*rowstride, 
+        from.Channel(from_channel) + j*from.rowstride, width * sizeof(float));
+    }
+    return;
+  }
+
+  const R2Image& from = from_image.Converted(R2_IMAGE_PIXEL_STORAGE, copy);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      R2Pixel& to_pixel = Pixel(i, j);
+      const R2Pixel& from_pixel = from.Pixel(i, j);
+      to_pixel[to_channel] = from_pixel[from_channel];
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// I/O Functions
+////////////////////////////////////////////////////////////////////////
+
+int R2Image::
+Read(const char *filename)
+{
+  // Initialize everything
+  FreeStorage();
+  storage = R2_IMAGE_PIXEL_STORAGE;
+  transfer = R2_IMAGE_GAMMA_TRANSFER;
+  npixels = width = height = rowstride = 0;
+
+  // Parse input filename extension
+  char *input_extension;
+  if (!(input_extension = (char*)strrchr(filename, '.'))) {
+    fprintf(stderr, "Input file has no extension (e.g., .jpg).\n");
+    return 0;
+  }
+  
+  // Read file of appropriate type
+  if (!strncmp(input_extension, ".bmp", 4)) return ReadBMP(filename);
+  else if (!strncmp(input_extension, ".ppm", 4)) return ReadPPM(filename);
+  else if (!strncmp(input_extension, ".pgm", 4)) return ReadPPM(filename);
+  else if (!strncmp(input_extension, ".jpg", 4)) return ReadJPEG(filename);
+  else if (!strncmp(input_extension, ".jpeg", 5)) return ReadJPEG(filename);
+  else if (!strncmp(input_extension, ".txt", 4)) return ReadTXT(filename);
+  else if (!strncmp(input_extension, ".r2img", 6)) return ReadR2IMG(filename);
+  
+  // Should never get here
+  fprintf(stderr, "Unrecognized image file extension");
+  return 0;
+}
+
+
+
+int R2Image::
+Read(const char *filename, double sx, double sy, int sampling_method)
+{
+  // Read image scaled by sx and sy
+  // JPEGs are decoded at reduced size where that covers the scale
+  // (for the filtering sampling methods, see ReadJPEG)
+  const char *input_extension = strrchr(filename, '.');
+  if (input_extension && (!strncmp(input_extension, ".jpg", 4) || !strncmp(input_extension, ".jpeg", 5))) {
+    return ReadJPEG(filename, sx, sy, sampling_method);
+  }
+
+  // Read other files at full size and scale them
+  if (!Read(filename)) return 0;
+  Scale(sx, sy, sampling_method);
+  return 1;
+}
+
+
+
+int R2Image::
+Write(const char *filename, int ascii) const
+{
+  // Parse input filename extension
+  char *input_extension;
+  if (!(input_extension = (char*)strrchr(filename, '.'))) {
+    fprintf(stderr, "Input file has no extension (e.g., .jpg).\n");
+    return 0;
+  }
+  
+  // Write file of appropriate type
+  if (!strncmp(input_extension, ".bmp", 4)) return WriteBMP(filename);
+  else if (!strncmp(input_extension, ".ppm", 4)) return WritePPM(filename, ascii);
+  else if (!strncmp(input_extension, ".pgm", 4)) return WritePGM(filename, ascii);
+  else if (!strncmp(input_extension, ".jpg", 4)) return WriteJPEG(filename);
+  else if (!strncmp(input_extension, ".jpeg", 5)) return WriteJPEG(filename);
+  else if (!strncmp(input_extension, ".txt", 4)) return WriteTXT(filename);
+  else if (!strncmp(input_extension, ".r2img", 6)) return WriteR2IMG(filename);
+
+  // Should never get here
+  fprintf(stderr, "Unrecognized image file extension");
+  return 0;
+}
+
+
+
+static const double *
+ByteToUnitTable(void)
+{
+  // Return table mapping 8-bit samples to [0,1] (same as dividing by 255)
+  static const struct Table {
+    double values[256];
+    Table(void) { for (int i = 0; i < 256; i++) values[i] = (double) i / 255; }
+  } table;
+  return table.values;
+}
+
+
+
+static void
+UnpackRow(const unsigned char *p, int ncomponents, int sample_bytes, int bgr,
+  const double *table, R2Pixel *row, int width)
+{
+  // Convert a row of 1 (gray), 3 (rgb or bgr) or 4 (rgba) interleaved
+  // 8 or 16-bit (big endian) samples to pixels through table
+  if (sample_bytes == 2) {
+    for (int i = 0; i < width; i++) {
+      double c[4] = { 0, 0, 0, 1 };
+      for (int k = 0; k < ncomponents; k++, p += 2) c[k] = table[(p[0] << 8) | p[1]];
+      if (ncomponents == 1) row[i].Reset(c[0], c[0], c[0], 1);
+      else row[i].Reset(c[0], c[1], c[2], c[3]);
+    }
+  }
+  else if (ncomponents == 1) {
+    for (int i = 0; i < width; i++, p += 1) row[i].Reset(table[p[0]], table[p[0]], table[p[0]], 1);
+  }
+  else if (ncomponents == 3) {
+    if (bgr) for (int i = 0; i < width; i++, p += 3) row[i].Reset(table[p[2]], table[p[1]], table[p[0]], 1);
+    else for (int i = 0; i < width; i++, p += 3) row[i].Reset(table[p[0]], table[p[1]], table[p[2]], 1);
+  }
+  else {
+    for (int i = 0; i < width; i++, p += 4) row[i].Reset(table[p[0]], table[p[1]], table[p[2]], table[p[3]]);
+  }
+}
+
+
+
+static void
+PackRow(const R2Pixel *row, int width, int ncomponents, int bgr, unsigned char *p)
+{
+  // Convert a row of pixels to 1 (luminance) or 3 (rgb or bgr) 8-bit samples,
+  // truncating 255 times each value clamped to [0,1]
+  if (ncomponents == 1) {
+    for (int i = 0; i < width; i++) {
+      double v = 255 * row[i].Luminance();
+      *(p++) = (unsigned char) ((v > 255) ? 255 : ((v < 0) ? 0 : v));
+    }
+    return;
+  }
+  int r = (bgr) ? 2 : 0, b = 2 - r;
+#if defined(__SSE2__)
+  const __m128d scale = _mm_set1_pd(255.0);
+  const __m128d zero = _mm_setzero_pd();
+  for (int i = 0; i < width; i++, p += 3) {
+    const double *c = (const double *) &row[i];
+    __m128d rg = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(c), scale), zero), scale);
+    __m128d ba = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(c + 2), scale), zero), scale);
+    __m128i irg = _mm_cvttpd_epi32(rg);
+    __m128i iba = _mm_cvttpd_epi32(ba);
+    p[r] = (unsigned char) _mm_cvtsi128_si32(irg);
+    p[1] = (unsigned char) _mm_cvtsi128_si32(_mm_srli_si128(irg, 4));
+    p[b] = (unsigned char) _mm_cvtsi128_si32(iba);
+  }
+#else
+  for (int i = 0; i < width; i++, p += 3) {
+    for (int k = 0; k < 3; k++) {
+      double v = 255 * row[i][k];
+      p[(k == 1) ? 1 : ((k == 0) ? r : b)] = (unsigned char) ((v > 255) ? 255 : ((v < 0) ? 0 : v));
+    }
+  }
+#endif
+}
+
+
+
+static int
+ReadSampleRows(FILE *fp, R2Pixel *rows, int rowstride, int width, int height, int rowsize,
+  int ncomponents, int sample_bytes, int bgr, const double *table)
+{
+  // Read rows of rowsize bytes in strips of about 1MB and unpack them in parallel
+  // (the kth row read goes to rows + k*rowstride, so a negative stride flips them)
+  if ((width <= 0) || (height <= 0) || (rowsize <= 0)) return 1;
+  int nrows = (1 << 20) / rowsize;
+  if (nrows < 1) nrows = 1;
+  if (nrows > height) nrows = height;
+  std::vector<unsigned char> buffer((size_t) nrows * rowsize);
+  for (int y0 = 0; y0 < height; y0 += nrows) {
+    int n = (height - y0 < nrows) ? height - y0 : nrows;
+    if (fread(&buffer[0], rowsize, n, fp) != (size_t) n) return 0;
+    R2ParallelFor(n, RowGrain(width), [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        UnpackRow(&buffer[(size_t) k * rowsize], ncomponents, sample_bytes, bgr, table, &rows[(ptrdiff_t) (y0 + k) * rowstride], width);
+      }
+    });
+  }
+  return 1;
+}
+
+
+
+static int
+WriteSampleRows(FILE *fp, const R2ImageView& view, int rowsize, int ncomponents, int bgr)
+{
+  // Pack the rows of view into strips of about 1MB in parallel and write them
+  // (bytes after the samples in each row are zero padding)
+  int width = view.Width(), height = view.Height();
+  if ((width <= 0) || (height <= 0) || (rowsize <= 0)) return 1;
+  int nrows = (1 << 20) / rowsize;
+  if (nrows < 1) nrows = 1;
+  if (nrows > height) nrows = height;
+  std::vector<unsigned char> buffer((size_t) nrows * rowsize, 0);
+  for (int y0 = 0; y0 < height; y0 += nrows) {
+    int n = (height - y0 < nrows) ? height - y0 : nrows;
+    R2ParallelFor(n, RowGrain(width), [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        PackRow(view[y0 + k], width, ncomponents, bgr, &buffer[(size_t) k * rowsize]);
+      }
+    });
+    if (fwrite(&buffer[0], rowsize, n, fp) != (size_t) n) return 0;
+  }
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// BMP I/O
+////////////////////////////////////////////////////////////////////////
+
+#if !defined(_WIN32)
+
+typedef struct tagBITMAPFILEHEADER {
+  unsigned short int bfType;
+  unsigned int bfSize;
+  unsigned short int bfReserved1;
+  unsigned short int bfReserved2;
+  unsigned int bfOffBits;
+} BITMAPFILEHEADER;
+
+typedef struct tagBITMAPINFOHEADER {
+  unsigned int biSize;
+  int biWidth;
+  int biHeight;
+  unsigned short int biPlanes;
+  unsigned short int biBitCount;
+  unsigned int biCompression;
+  unsigned int biSizeImage;
+  int biXPelsPerMeter;
+  int biYPelsPerMeter;
+  unsigned int biClrUsed;
+  unsigned int biClrImportant;
+} BITMAPINFOHEADER;
+
+typedef struct tagRGBTRIPLE {
+  unsigned char rgbtBlue;
+  unsigned char rgbtGreen;
+  unsigned char rgbtRed;
+} RGBTRIPLE;
+
+typedef struct tagRGBQUAD {
+  unsigned char rgbBlue;
+  unsigned char rgbGreen;
+  unsigned char rgbRed;
+  unsigned char rgbReserved;
+} RGBQUAD;
+
+#endif
+
+#define BI_RGB        0L
+#define BI_RLE8       1L
+#define BI_RLE4       2L
+#define BI_BITFIELDS  3L
+
+#define BMP_BF_TYPE 0x4D42 /* word BM */
+#define BMP_BF_OFF_BITS 54 /* 14 for file header + 40 for info header (not sizeof(), but packed size) */
+#define BMP_BI_SIZE 40 /* packed size of info header */
+
+
+static unsigned short int WordReadLE(FILE *fp)
+{
+  // Read a unsigned short int from a file in little endian format 
+  unsigned short int lsb, msb;
+  lsb = getc(fp);
+  msb = getc(fp);
+  return (msb << 8) | lsb;
+}
+
+
+
+static void WordWriteLE(unsigned short int x, FILE *fp)
+{
+  // Write a unsigned short int to a file in little endian format
+  unsigned char lsb = (unsigned char) (x & 0x00FF); putc(lsb, fp); 
+  unsigned char msb = (unsigned char) (x >> 8); putc(msb, fp);
+}
+
+
+
+static unsigned int DWordReadLE(FILE *fp)
+{
+  // Read a unsigned int word from a file in little endian format 
+  unsigned int b1 = getc(fp);
+  unsigned int b2 = getc(fp);
+  unsigned int b3 = getc(fp);
+  unsigned int b4 = getc(fp);
+  return (b4 << 24) | (b3 << 16) | (b2 << 8) | b1;
+}
+
+
+
+static void DWordWriteLE(unsigned int x, FILE *fp)
+{
+  // Write a unsigned int to a file in little endian format 
+  unsigned char b1 = (x & 0x000000FF); putc(b1, fp);
+  unsigned char b2 = ((x >> 8) & 0x000000FF); putc(b2, fp);
+  unsigned char b3 = ((x >> 16) & 0x000000FF); putc(b3, fp);
+  unsigned char b4 = ((x >> 24) & 0x000000FF); putc(b4, fp);
+}
+
+
+
+static int LongReadLE(FILE *fp)
+{
+  // Read a int word from a file in little endian format 
+  int b1 = getc(fp);
+  int b2 = getc(fp);
+  int b3 = getc(fp);
+  int b4 = getc(fp);
+  return (b4 << 24) | (b3 << 16) | (b2 << 8) | b1;
+}
+
+
+
+static void LongWriteLE(int x, FILE *fp)
+{
+  // Write a int to a file in little endian format 
+  char b1 = (x & 0x000000FF); putc(b1, fp);
+  char b2 = ((x >> 8) & 0x000000FF); putc(b2, fp);
+  char b3 = ((x >> 16) & 0x000000FF); putc(b3, fp);
+  char b4 = ((x >> 24) & 0x000000FF); putc(b4, fp);
+}
+
+
+
+int R2Image::
+ReadBMP(const char *filename)
+{
+  // Open file
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Read image
+  int status = ReadBMP(fp);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+int R2Image::
+ReadBMP(FILE *fp)
+{
+  R2TraceScope trace("codec", "ReadBMP");
+
+  /* Read file header */
+  BITMAPFILEHEADER bmfh;
+  bmfh.bfType = WordReadLE(fp);
+  bmfh.bfSize = DWordReadLE(fp);
+  bmfh.bfReserved1 = WordReadLE(fp);
+  bmfh.bfReserved2 = WordReadLE(fp);
+  bmfh.bfOffBits = DWordReadLE(fp);
+  
+  /* Check file header */
+  /* ignore bmfh.bfSize */
+  /* ignore bmfh.bfReserved1 */
+  /* ignore bmfh.bfReserved2 */
+  if ((bmfh.bfType != BMP_BF_TYPE) || (bmfh.bfOffBits != BMP_BF_OFF_BITS)) {
+    fprintf(stderr, "Invalid header in BMP file\n");
+    return 0;
+  }
+  
+  /* Read info header */
+  BITMAPINFOHEADER bmih;
+  bmih.biSize = DWordReadLE(fp);
+  bmih.biWidth = LongReadLE(fp);
+  bmih.biHeight = LongReadLE(fp);
+  bmih.biPlanes = WordReadLE(fp);
+  bmih.biBitCount = WordReadLE(fp);
+  bmih.biCompression = DWordReadLE(fp);
+  bmih.biSizeImage = DWordReadLE(fp);
+  bmih.biXPelsPerMeter = LongReadLE(fp);
+  bmih.biYPelsPerMeter = LongReadLE(fp);
+  bmih.biClrUsed = DWordReadLE(fp);
+  bmih.biClrImportant = DWordReadLE(fp);
+  
+  // Check info header (only uncompressed 24-bit RGB is supported)
+  if ((bmih.biSize != BMP_BI_SIZE) || (bmih.biPlanes != 1)) {
+    fprintf(stderr, "Invalid info header in BMP file\n");
+    return 0;
+  }
+  if ((bmih.biBitCount != 24) || (bmih.biCompression != BI_RGB)) {
+    fprintf(stderr, "Unsupported BMP file (%d bits per pixel, compression %u), only 24-bit RGB can be read\n",
+      (int) bmih.biBitCount, (unsigned int) bmih.biCompression);
+    return 0;
+  }
+  if (!ValidImageSize(bmih.biWidth, bmih.biHeight)) {
+    fprintf(stderr, "Invalid image size (%dx%d) in BMP file\n", (int) bmih.biWidth, (int) bmih.biHeight);
+    return 0;
+  }
+  int lineLength = bmih.biWidth * 3;  /* RGB */
+  if ((lineLength % 4) != 0) lineLength = (lineLength / 4 + 1) * 4;
+  if (bmih.biSizeImage != (unsigned int) lineLength * (unsigned int) bmih.biHeight) {
+    fprintf(stderr, "Invalid image data size (%u) in BMP file\n", (unsigned int) bmih.biSizeImage);
+    return 0;
+  }
+
+  // Allocate pixels for image
+  if (!Resize(bmih.biWidth, bmih.biHeight)) return 0;
+
+  // Read pixels in strips (BMP rows are bottom-up and bgr, padded to 4 bytes)
+  fseek(fp, (long) bmfh.bfOffBits, SEEK_SET);
+  if (!ReadSampleRows(fp, pixels, rowstride, width, height, lineLength, 3, 1, 1, ByteToUnitTable())) {
+    fprintf(stderr, "Error while reading BMP file\n");
+    return 0;
+  }
+  trace.SetImage(width, height, ftell(fp) + PixelBytes(npixels));
+
+  // Return success
+  return 1;
+}
+
+
+
+int R2Image::
+WriteBMP(const char *filename) const
+{
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Write image
+  int status = WriteBMP(fp);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+int R2Image::
+WriteBMP(FILE *fp) const
+{
+  R2TraceScope trace("codec", "WriteBMP");
+
+  // Compute number of bytes in row
+  int rowsize = 3 * width;
+  if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
 
-  // Check consistency of image dimensions
-  if ((from_image.Width() != Width()) || (from_image.Height() != Height())) {
-    fprintf(stderr, "Invalid image dimensions in R2Image::CopyChannel\n");
-    abort();
-  }
+  // Write file header 
+  BITMAPFILEHEADER bmfh;
+  bmfh.bfType = BMP_BF_TYPE;
+  bmfh.bfSize = BMP_BF_OFF_BITS + rowsize * height;
+  bmfh.bfReserved1 = 0;
+  bmfh.bfReserved2 = 0;
+  bmfh.bfOffBits = BMP_BF_OFF_BITS;
+  WordWriteLE(bmfh.bfType, fp);
+  DWordWriteLE(bmfh.bfSize, fp);
+  WordWriteLE(bmfh.bfReserved1, fp);
+  WordWriteLE(bmfh.bfReserved2, fp);
+  DWordWriteLE(bmfh.bfOffBits, fp);
 
-  // Copy channel
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      R2Pixel& to_pixel = Pixel(i, j);
-      const R2Pixel& from_pixel = from_image.Pixel(i, j);
-      to_pixel[to_channel] = from_pixel[from_channel];
-    }
+  // Write info header 
+  BITMAPINFOHEADER bmih;
+  bmih.biSize = BMP_BI_SIZE;
+  bmih.biWidth = width;
+  bmih.biHeight = height;
+  bmih.biPlanes = 1;
+  bmih.biBitCount = 24;       /* RGB */
+  bmih.biCompression = BI_RGB;    /* RGB */
+  bmih.biSizeImage = rowsize * (unsigned int) bmih.biHeight;  /* RGB */
+  bmih.biXPelsPerMeter = 2925;
+  bmih.biYPelsPerMeter = 2925;
+  bmih.biClrUsed = 0;
+  bmih.biClrImportant = 0;
+  DWordWriteLE(bmih.biSize, fp);
+  LongWriteLE(bmih.biWidth, fp);
+  LongWriteLE(bmih.biHeight, fp);
+  WordWriteLE(bmih.biPlanes, fp);
+  WordWriteLE(bmih.biBitCount, fp);
+  DWordWriteLE(bmih.biCompression, fp);
+  DWordWriteLE(bmih.biSizeImage, fp);
+  LongWriteLE(bmih.biXPelsPerMeter, fp);
+  LongWriteLE(bmih.biYPelsPerMeter, fp);
+  DWordWriteLE(bmih.biClrUsed, fp);
+  DWordWriteLE(bmih.biClrImportant, fp);
+
+  // Write pixels in strips (BMP rows are bottom-up and bgr, padded to 4 bytes)
+  if (!WriteSampleRows(fp, R2ImageView(*this), rowsize, 3, 1)) {
+    fprintf(stderr, "Error while writing BMP file\n");
+    return 0;
   }
+  trace.SetImage(width, height, ftell(fp) + PixelBytes(npixels));
+
+  // Return success
+  return 1;  
 }
 
 
+
 ////////////////////////////////////////////////////////////////////////
-// I/O Functions
+// PPM I/O
 ////////////////////////////////////////////////////////////////////////
 
 int R2Image::
-Read(const char *filename)
+ReadPPM(const char *filename)
 {
-  // Initialize everything
-  if (pixels) { delete [] pixels; pixels = NULL; }
-  npixels = width = height = 0;
-
-  // Parse input filename extension
-  char *input_extension;
-  if (!(input_extension = (char*)strrchr(filename, '.'))) {
-    fprintf(stderr, "Input file has no extension (e.g., .jpg).\n");
+  // Open file
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
     return 0;
   }
-  
-  // Read file of appropriate type
-  if (!strncmp(input_extension, ".bmp", 4)) return ReadBMP(filename);
-  else if (!strncmp(input_extension, ".ppm", 4)) return ReadPPM(filename);
-  else if (!strncmp(input_extension, ".jpg", 4)) return ReadJPEG(filename);
-  else if (!strncmp(input_extension, ".jpeg", 5)) return ReadJPEG(filename);
-  else if (!strncmp(input_extension, ".txt", 4)) return ReadTXT(filename);
-  
-  // Should never get here
-  fprintf(stderr, "Unrecognized image file extension");
-  return 0;
+
+  // Read image
+  int status = ReadPPM(fp);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+static int
+ReadPNMInteger(FILE *fp, int *value)
+{
+  // Read a header integer of a PPM/PGM file, skipping whitespace and comments
+  int c = getc(fp);
+  while (isspace(c) || (c == '#')) {
+    if (c == '#') { while ((c != '\n') && (c != EOF)) c = getc(fp); }
+    c = getc(fp);
+  }
+  if (!isdigit(c)) return 0;
+  *value = 0;
+  while (isdigit(c)) {
+    if (*value > (INT_MAX - (c - '0')) / 10) return 0;
+    *value = 10 * *value + (c - '0'); 
+    c = getc(fp); 
+  }
+
+  // Leave the single whitespace character after the integer consumed
+  if ((c != EOF) && !isspace(c)) ungetc(c, fp);
+  return 1;
 }
 
 
 
 int R2Image::
-Write(const char *filename) const
+ReadPPM(FILE *fp)
 {
-  // Parse input filename extension
-  char *input_extension;
-  if (!(input_extension = (char*)strrchr(filename, '.'))) {
-    fprintf(stderr, "Input file has no extension (e.g., .jpg).\n");
+  R2TraceScope trace("codec", "ReadPPM");
+
+  // Read magic identifier (P2/P5 for PGM and P3/P6 for PPM, ascii/raw)
+  int c0 = getc(fp);
+  int c1 = getc(fp);
+  if ((c0 != 'P') || ((c1 != '2') && (c1 != '3') && (c1 != '5') && (c1 != '6'))) {
+    fprintf(stderr, "Unable to read magic id in PPM file\n");
     return 0;
   }
-  
-  // Write file of appropriate type
-  if (!strncmp(input_extension, ".bmp", 4)) return WriteBMP(filename);
-  else if (!strncmp(input_extension, ".ppm", 4)) return WritePPM(filename, 1);
-  else if (!strncmp(input_extension, ".jpg", 4)) return WriteJPEG(filename);
-  else if (!strncmp(input_extension, ".jpeg", 5)) return WriteJPEG(filename);
-  else if (!strncmp(input_extension, ".txt", 4)) return WriteTXT(filename);
+  int ncomponents = ((c1 == '2') || (c1 == '5')) ? 1 : 3;
+  int raw = ((c1 == '5') || (c1 == '6'));
 
-  // Should never get here
-  fprintf(stderr, "Unrecognized image file extension");
-  return 0;
-}
+  // Read width, height, and max value
+  int width, height, max_value;
+  if (!ReadPNMInteger(fp, &width) || !ReadPNMInteger(fp, &height)) {
+    fprintf(stderr, "Unable to read width and height in PPM file\n");
+    return 0;
+  }
+  if (!ReadPNMInteger(fp, &max_value) || (max_value < 1) || (max_value > 65535)) {
+    fprintf(stderr, "Unable to read max_value in PPM file\n");
+    return 0;
+  }
 
+  // Check size before allocating
+  if (!ValidImageSize(width, height)) {
+    fprintf(stderr, "Invalid image size (%dx%d) in PPM file\n", width, height);
+    return 0;
+  }
+	
+  // Allocate image pixels
+  if (!Resize(width, height)) return 0;
 
+  // Check if raw or ascii file
+  if (raw) {
+    // Build table mapping every possible sample to [0,1]
+    int sample_bytes = (max_value > 255) ? 2 : 1;
+    std::vector<double> table((sample_bytes == 2) ? 65536 : 256);
+    for (unsigned int i = 0; i < table.size(); i++) table[i] = (double) i / max_value;
+
+    // Read raw image data in strips
+    // First ppm pixel is top-left, so read rows downwards from the top one
+    int rowsize = width * ncomponents * sample_bytes;
+    if (!ReadSampleRows(fp, &pixels[(height - 1) * rowstride], -rowstride, width, height, rowsize, ncomponents, sample_bytes, 0, &table[0])) {
+      fprintf(stderr, "Unable to read data in PPM file\n");
+      return 0;
+    }
+  }
+  else {
+    // Read asci image data 
+    // First ppm pixel is top-left, so read in opposite scan-line order
+    for (int j = height-1; j >= 0; j--) {
+      R2Pixel *row = &pixels[j*rowstride];
+      for (int i = 0; i < width; i++) {
+        // Read pixel values
+        int c[3];
+        for (int k = 0; k < ncomponents; k++) {
+          if (fscanf(fp, "%d", &c[k]) != 1) {
+            fprintf(stderr, "Unable to read data at (%d,%d) in PPM file\n", i, j);
+            return 0;
+          }
+        }
+        if (ncomponents == 1) c[1] = c[2] = c[0];
 
-////////////////////////////////////////////////////////////////////////
-// BMP I/O
-////////////////////////////////////////////////////////////////////////
+        // Assign pixel values
+        double r = (double) c[0] / max_value;
+        double g = (double) c[1] / max_value;
+        double b = (double) c[2] / max_value;
+        row[i].Reset(r, g, b, 1);
+      }
+    }
+  }
+  trace.SetImage(width, height, ftell(fp) + PixelBytes(npixels));
 
-#if !defined(_WIN32)
+  // Return success
+  return 1;
+}
 
-typedef struct tagBITMAPFILEHEADER {
-  unsigned short int bfType;
-  unsigned int bfSize;
-  unsigned short int bfReserved1;
-  unsigned short int bfReserved2;
-  unsigned int bfOffBits;
-} BITMAPFILEHEADER;
 
-typedef struct tagBITMAPINFOHEADER {
-  unsigned int biSize;
-  int biWidth;
-  int biHeight;
-  unsigned short int biPlanes;
-  unsigned short int biBitCount;
-  unsigned int biCompression;
-  unsigned int biSizeImage;
-  int biXPelsPerMeter;
-  int biYPelsPerMeter;
-  unsigned int biClrUsed;
-  unsigned int biClrImportant;
-} BITMAPINFOHEADER;
 
-typedef struct tagRGBTRIPLE {
-  unsigned char rgbtBlue;
-  unsigned char rgbtGreen;
-  unsigned char rgbtRed;
-} RGBTRIPLE;
+int R2Image::
+WritePPM(const char *filename, int ascii) const
+{
+  // Open file
+  FILE *fp = fopen(filename, (ascii) ? "w" : "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
 
-typedef struct tagRGBQUAD {
-  unsigned char rgbBlue;
-  unsigned char rgbGreen;
-  unsigned char rgbRed;
-  unsigned char rgbReserved;
-} RGBQUAD;
+  // Write image
+  int status = WritePNM(fp, 3, ascii);
 
-#endif
+  // Close file
+  fclose(fp);
 
-#define BI_RGB        0L
-#define BI_RLE8       1L
-#define BI_RLE4       2L
-#define BI_BITFIELDS  3L
+  // Return status
+  return status;
+}
 
-#define BMP_BF_TYPE 0x4D42 /* word BM */
-#define BMP_BF_OFF_BITS 54 /* 14 for file header + 40 for info header (not sizeof(), but packed size) */
-#define BMP_BI_SIZE 40 /* packed size of info header */
 
 
-static unsigned short int WordReadLE(FILE *fp)
+int R2Image::
+WritePGM(const char *filename, int ascii) const
 {
-  // Read a unsigned short int from a file in little endian format 
-  unsigned short int lsb, msb;
-  lsb = getc(fp);
-  msb = getc(fp);
-  return (msb << 8) | lsb;
+  // Open file
+  FILE *fp = fopen(filename, (ascii) ? "w" : "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Write luminance image
+  int status = WritePNM(fp, 1, ascii);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
 }
 
 
 
-static void WordWriteLE(unsigned short int x, FILE *fp)
+int R2Image::
+WritePNM(FILE *fp, int ncomponents, int ascii) const
 {
-  // Write a unsigned short int to a file in little endian format
-  unsigned char lsb = (unsigned char) (x & 0x00FF); putc(lsb, fp); 
-  unsigned char msb = (unsigned char) (x >> 8); putc(msb, fp);
+  R2TraceScope trace("codec", (ncomponents == 1) ? "WritePGM" : "WritePPM");
+
+  // Read gamma encoded pixels through a view
+  R2ImageView view(*this);
+  if (ascii) {
+    // Print PPM (or PGM) image file 
+    // First ppm pixel is top-left, so write in opposite scan-line order
+    fprintf(fp, (ncomponents == 1) ? "P2\n" : "P3\n");
+    fprintf(fp, "%d %d\n", width, height);
+    fprintf(fp, "255\n");
+    for (int j = height-1; j >= 0 ; j--) {
+      const R2Pixel *row = view[j];
+      for (int i = 0; i < width; i++) {
+        const R2Pixel& p = row[i];
+        if (ncomponents == 1) {
+          fprintf(fp, "%-3d ", (int) (255 * p.Luminance()));
+          if (((i+1) % 12) == 0) fprintf(fp, "\n");
+          continue;
+        }
+        int r = (int) (255 * p.Red());
+        int g = (int) (255 * p.Green());
+        int b = (int) (255 * p.Blue());
+        fprintf(fp, "%-3d %-3d %-3d  ", r, g, b);
+        if (((i+1) % 4) == 0) fprintf(fp, "\n");
+      }
+      if ((width % ((ncomponents == 1) ? 12 : 4)) != 0) fprintf(fp, "\n");
+    }
+    fprintf(fp, "\n");
+  }
+  else {
+    // Print raw PPM (or PGM) image file in strips
+    // First ppm pixel is top-left, so write in opposite scan-line order
+    fprintf(fp, (ncomponents == 1) ? "P5\n" : "P6\n");
+    fprintf(fp, "%d %d\n", width, height);
+    fprintf(fp, "255\n");
+    if ((width > 0) && (height > 0) &&
+        !WriteSampleRows(fp, view.FlipVertical(), ncomponents * width, ncomponents, 0)) {
+      fprintf(stderr, "Error while writing PPM file\n");
+      return 0;
+    }
+  }
+  trace.SetImage(width, height, ftell(fp) + PixelBytes(npixels));
+
+  // Return success
+  return 1;  
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// JPEG I/O
+////////////////////////////////////////////////////////////////////////
+
+
+extern "C" { 
+#   define XMD_H // Otherwise, a conflict with INT32
+#   undef FAR // Otherwise, a conflict with windows.h
+#   include "jpeg/jpeglib.h"
+};
+
+
+
+// libjpeg reports errors through error_exit, which exits the process by
+// default.  JPEGErrorExit instead jumps back to the jmp_buf in client_data,
+// which the wrappers below set around each libjpeg call that can fail.
+// The wrappers have no objects with destructors, so nothing is skipped by
+// the jump, and they return 0 after an error (the caller then destroys
+// the libjpeg struct).  Outside the wrappers client_data is NULL, and
+// errors exit as before.
+
+static void
+JPEGErrorExit(j_common_ptr cinfo)
+{
+  // Print message and return to the libjpeg call in progress
+  (*cinfo->err->output_message)(cinfo);
+  if (!cinfo->client_data) exit(EXIT_FAILURE);
+  longjmp(*(jmp_buf *) cinfo->client_data, 1);
 }
 
 
 
-static unsigned int DWordReadLE(FILE *fp)
+static struct jpeg_error_mgr *
+JPEGErrorManager(struct jpeg_error_mgr *jerr)
 {
-  // Read a unsigned int word from a file in little endian format 
-  unsigned int b1 = getc(fp);
-  unsigned int b2 = getc(fp);
-  unsigned int b3 = getc(fp);
-  unsigned int b4 = getc(fp);
-  return (b4 << 24) | (b3 << 16) | (b2 << 8) | b1;
+  // Initialize error manager that returns from the wrappers below
+  jpeg_std_error(jerr);
+  jerr->error_exit = JPEGErrorExit;
+  return jerr;
 }
 
 
 
-static void DWordWriteLE(unsigned int x, FILE *fp)
+static int
+JPEGReadHeader(j_decompress_ptr cinfo)
 {
-  // Write a unsigned int to a file in little endian format 
-  unsigned char b1 = (x & 0x000000FF); putc(b1, fp);
-  unsigned char b2 = ((x >> 8) & 0x000000FF); putc(b2, fp);
-  unsigned char b3 = ((x >> 16) & 0x000000FF); putc(b3, fp);
-  unsigned char b4 = ((x >> 24) & 0x000000FF); putc(b4, fp);
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_read_header(cinfo, TRUE);
+    status = 1;
+  }
+  cinfo->client_data = NULL;
+  return status;
 }
 
 
 
-static int LongReadLE(FILE *fp)
+static int
+JPEGStartDecompress(j_decompress_ptr cinfo)
 {
-  // Read a int word from a file in little endian format 
-  int b1 = getc(fp);
-  int b2 = getc(fp);
-  int b3 = getc(fp);
-  int b4 = getc(fp);
-  return (b4 << 24) | (b3 << 16) | (b2 << 8) | b1;
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_start_decompress(cinfo);
+    status = 1;
+  }
+  cinfo->client_data = NULL;
+  return status;
 }
 
 
 
-static void LongWriteLE(int x, FILE *fp)
+static int
+JPEGReadScanlines(j_decompress_ptr cinfo, JSAMPARRAY rows, int nrows)
 {
-  // Write a int to a file in little endian format 
-  char b1 = (x & 0x000000FF); putc(b1, fp);
-  char b2 = ((x >> 8) & 0x000000FF); putc(b2, fp);
-  char b3 = ((x >> 16) & 0x000000FF); putc(b3, fp);
-  char b4 = ((x >> 24) & 0x000000FF); putc(b4, fp);
+  // Return the number of rows read, or -1 on error
+  jmp_buf error_return;
+  volatile int n = -1;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) n = jpeg_read_scanlines(cinfo, rows, nrows);
+  cinfo->client_data = NULL;
+  return n;
 }
 
 
 
-int R2Image::
-ReadBMP(const char *filename)
+static int
+JPEGFinishDecompress(j_decompress_ptr cinfo)
 {
-  // Open file
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    fprintf(stderr, "Unable to open image file: %s\n", filename);
-    return 0;
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_finish_decompress(cinfo);
+    status = 1;
   }
+  cinfo->client_data = NULL;
+  return status;
+}
 
-  /* Read file header */
-  BITMAPFILEHEADER bmfh;
-  bmfh.bfType = WordReadLE(fp);
-  bmfh.bfSize = DWordReadLE(fp);
-  bmfh.bfReserved1 = WordReadLE(fp);
-  bmfh.bfReserved2 = WordReadLE(fp);
-  bmfh.bfOffBits = DWordReadLE(fp);
-  
-  /* Check file header */
-  assert(bmfh.bfType == BMP_BF_TYPE);
-  /* ignore bmfh.bfSize */
-  /* ignore bmfh.bfReserved1 */
-  /* ignore bmfh.bfReserved2 */
-  assert(bmfh.bfOffBits == BMP_BF_OFF_BITS);
-  
-  /* Read info header */
-  BITMAPINFOHEADER bmih;
-  bmih.biSize = DWordReadLE(fp);
-  bmih.biWidth = LongReadLE(fp);
-  bmih.biHeight = LongReadLE(fp);
-  bmih.biPlanes = WordReadLE(fp);
-  bmih.biBitCount = WordReadLE(fp);
-  bmih.biCompression = DWordReadLE(fp);
-  bmih.biSizeImage = DWordReadLE(fp);
-  bmih.biXPelsPerMeter = LongReadLE(fp);
-  bmih.biYPelsPerMeter = LongReadLE(fp);
-  bmih.biClrUsed = DWordReadLE(fp);
-  bmih.biClrImportant = DWordReadLE(fp);
-  
-  // Check info header 
-  assert(bmih.biSize == BMP_BI_SIZE);
-  assert(bmih.biWidth > 0);
-  assert(bmih.biHeight > 0);
-  assert(bmih.biPlanes == 1);
-  assert(bmih.biBitCount == 24);  /* RGB */
-  assert(bmih.biCompression == BI_RGB);   /* RGB */
-  int lineLength = bmih.biWidth * 3;  /* RGB */
-  if ((lineLength % 4) != 0) lineLength = (lineLength / 4 + 1) * 4;
-  assert(bmih.biSizeImage == (unsigned int) lineLength * (unsigned int) bmih.biHeight);
 
-  // Assign width, height, and number of pixels
-  width = bmih.biWidth;
-  height = bmih.biHeight;
-  npixels = width * height;
 
-  // Allocate unsigned char buffer for reading pixels
-  int rowsize = 3 * width;
-  if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-  int nbytes = bmih.biSizeImage;
-  unsigned char *buffer = new unsigned char [nbytes];
-  if (!buffer) {
-    fprintf(stderr, "Unable to allocate temporary memory for BMP file");
-    fclose(fp);
-    return 0;
+static int
+JPEGStartCompress(j_compress_ptr cinfo)
+{
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_start_compress(cinfo, TRUE);
+    status = 1;
   }
+  cinfo->client_data = NULL;
+  return status;
+}
 
-  // Read buffer 
-  fseek(fp, (long) bmfh.bfOffBits, SEEK_SET);
-  if (fread(buffer, 1, bmih.biSizeImage, fp) != bmih.biSizeImage) {
-    fprintf(stderr, "Error while reading BMP file %s", filename);
-    return 0;
-  }
 
-  // Close file
-  fclose(fp);
 
-  // Allocate pixels for image
-  pixels = new R2Pixel [ width * height ];
-  if (!pixels) {
-    fprintf(stderr, "Unable to allocate memory for BMP file");
-    fclose(fp);
-    return 0;
+static int
+JPEGWriteScanlines(j_compress_ptr cinfo, JSAMPARRAY rows, int nrows)
+{
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_write_scanlines(cinfo, rows, nrows);
+    status = 1;
   }
+  cinfo->client_data = NULL;
+  return status;
+}
 
-  // Assign pixels
-  for (int j = 0; j < height; j++) {
-    unsigned char *p = &buffer[j * rowsize];
-    for (int i = 0; i < width; i++) {
-      double b = (double) *(p++) / 255;
-      double g = (double) *(p++) / 255;
-      double r = (double) *(p++) / 255;
-      R2Pixel pixel(r, g, b, 1);
-      SetPixel(i, j, pixel);
-    }
-  }
 
-  // Free unsigned char buffer for reading pixels
-  delete [] buffer;
 
-  // Return success
-  return 1;
+static int
+JPEGFinishCompress(j_compress_ptr cinfo)
+{
+  jmp_buf error_return;
+  volatile int status = 0;
+  cinfo->client_data = &error_return;
+  if (!setjmp(error_return)) {
+    jpeg_finish_compress(cinfo);
+    status = 1;
+  }
+  cinfo->client_data = NULL;
+  return status;
 }
 
 
 
 int R2Image::
-WriteBMP(const char *filename) const
+ReadJPEG(const char *filename, double sx, double sy, int sampling_method)
 {
   // Open file
-  FILE *fp = fopen(filename, "wb");
+  FILE *fp = fopen(filename, "rb");
   if (!fp) {
     fprintf(stderr, "Unable to open image file: %s\n", filename);
     return 0;
   }
 
-  // Compute number of bytes in row
-  int rowsize = 3 * width;
-  if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-
-  // Write file header 
-  BITMAPFILEHEADER bmfh;
-  bmfh.bfType = BMP_BF_TYPE;
-  bmfh.bfSize = BMP_BF_OFF_BITS + rowsize * height;
-  bmfh.bfReserved1 = 0;
-  bmfh.bfReserved2 = 0;
-  bmfh.bfOffBits = BMP_BF_OFF_BITS;
-  WordWriteLE(bmfh.bfType, fp);
-  DWordWriteLE(bmfh.bfSize, fp);
-  WordWriteLE(bmfh.bfReserved1, fp);
-  WordWriteLE(bmfh.bfReserved2, fp);
-  DWordWriteLE(bmfh.bfOffBits, fp);
+  // Initialize decompression info
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = JPEGErrorManager(&jerr);
+  cinfo.client_data = NULL;
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
 
-  // Write info header 
-  BITMAPINFOHEADER bmih;
-  bmih.biSize = BMP_BI_SIZE;
-  bmih.biWidth = width;
-  bmih.biHeight = height;
-  bmih.biPlanes = 1;
-  bmih.biBitCount = 24;       /* RGB */
-  bmih.biCompression = BI_RGB;    /* RGB */
-  bmih.biSizeImage = rowsize * (unsigned int) bmih.biHeight;  /* RGB */
-  bmih.biXPelsPerMeter = 2925;
-  bmih.biYPelsPerMeter = 2925;
-  bmih.biClrUsed = 0;
-  bmih.biClrImportant = 0;
-  DWordWriteLE(bmih.biSize, fp);
-  LongWriteLE(bmih.biWidth, fp);
-  LongWriteLE(bmih.biHeight, fp);
-  WordWriteLE(bmih.biPlanes, fp);
-  WordWriteLE(bmih.biBitCount, fp);
-  DWordWriteLE(bmih.biCompression, fp);
-  DWordWriteLE(bmih.biSizeImage, fp);
-  LongWriteLE(bmih.biXPelsPerMeter, fp);
-  LongWriteLE(bmih.biYPelsPerMeter, fp);
-  DWordWriteLE(bmih.biClrUsed, fp);
-  DWordWriteLE(bmih.biClrImportant, fp);
+  // Read image
+  int status = ReadJPEG(&cinfo, sx, sy, sampling_method);
 
-  // Write image, swapping blue and red in each pixel
-  int pad = rowsize - width * 3;
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      const R2Pixel& pixel = (*this)[i][j];
-      double r = 255.0 * pixel.Red();
-      double g = 255.0 * pixel.Green();
-      double b = 255.0 * pixel.Blue();
-      if (r >= 255) r = 255;
-      if (g >= 255) g = 255;
-      if (b >= 255) b = 255;
-      fputc((unsigned char) b, fp);
-      fputc((unsigned char) g, fp);
-      fputc((unsigned char) r, fp);
-    }
+  // Free everything
+  jpeg_destroy_decompress(&cinfo);
 
-    // Pad row
-    for (int i = 0; i < pad; i++) fputc(0, fp);
-  }
-  
   // Close file
   fclose(fp);
 
-  // Return success
-  return 1;  
+  // Return status
+  return status;
 }
 
 
 
-////////////////////////////////////////////////////////////////////////
-// PPM I/O
-////////////////////////////////////////////////////////////////////////
-
 int R2Image::
-ReadPPM(const char *filename)
+ReadJPEG(struct jpeg_decompress_struct *cinfo, double sx, double sy, int sampling_method)
 {
-  // Open file
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    fprintf(stderr, "Unable to open image file: %s\n", filename);
-    return 0;
+  // Read header (the data source is already set)
+  R2TraceScope trace("codec", "ReadJPEG");
+  {
+    R2TraceScope phase("jpeg", "jpeg_read_header");
+    if (!JPEGReadHeader(cinfo)) return 0;
   }
 
-  // Read PPM file magic identifier
-  char buffer[128];
-  if (!fgets(buffer, 128, fp)) {
-    fprintf(stderr, "Unable to read magic id in PPM file");
-    fclose(fp);
-    return 0;
+  // Let the IDCT do as much of a downscale as it can (by 1/2, 1/4, or 1/8),
+  // as long as it does not go below the final size.  Only for sampling
+  // methods that filter: point and bilinear sampling pick input pixels, so
+  // they read the full image and give the same result as Scale.
+  int scaled = ((sx != 1) || (sy != 1));
+  int filtered = (sampling_method != R2_IMAGE_POINT_SAMPLING) && (sampling_method != R2_IMAGE_BILINEAR_SAMPLING);
+  int new_width = lround(sx * cinfo->image_width);
+  int new_height = lround(sy * cinfo->image_height);
+  int reduction = 1;
+  if (scaled && filtered && (new_width > 0) && (new_height > 0)) {
+    for (int denom = 8; denom > 1; denom /= 2) {
+      int reduced_width = (cinfo->image_width + denom - 1) / denom;
+      int reduced_height = (cinfo->image_height + denom - 1) / denom;
+      if ((reduced_width >= new_width) && (reduced_height >= new_height)) {
+        reduction = denom;
+        break;
+      }
+    }
   }
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = reduction;
 
-  // skip comments
-  int c = getc(fp);
-  while (c == '#') {
-    while (c != '\n') c = getc(fp);
-    c = getc(fp);
+  // Start decompression
+  {
+    R2TraceScope phase("jpeg", "jpeg_start_decompress");
+    if (!JPEGStartDecompress(cinfo)) return 0;
   }
-  ungetc(c, fp);
 
-  // Read width and height
-  if (fscanf(fp, "%d%d", &width, &height) != 2) {
-    fprintf(stderr, "Unable to read width and height in PPM file");
-    fclose(fp);
+  // Check number of components
+  int ncomponents = cinfo->output_components;
+  if ((ncomponents != 1) && (ncomponents != 3) && (ncomponents != 4)) {
+    fprintf(stderr, "Unrecognized number of components in jpeg image: %d\n", ncomponents);
     return 0;
   }
 
-  npixels = width * height;
-	
-  // Read max value
-  double max_value;
-  if (fscanf(fp, "%lf", &max_value) != 1) {
-    fprintf(stderr, "Unable to read max_value in PPM file");
-    fclose(fp);
-    return 0;
-  }
-	
-  // Allocate image pixels
-  pixels = new R2Pixel [ width * height ];
-  if (!pixels) {
-    fprintf(stderr, "Unable to allocate memory for PPM file");
-    fclose(fp);
+  // Allocate pixels for image
+  if (!ValidImageSize(cinfo->output_width, cinfo->output_height)) {
+    fprintf(stderr, "Invalid image size (%ux%u) in JPEG image\n", 
+      (unsigned int) cinfo->output_width, (unsigned int) cinfo->output_height);
     return 0;
   }
+  if (!Resize(cinfo->output_width, cinfo->output_height)) return 0;
 
-  // Check if raw or ascii file
-  if (!strcmp(buffer, "P6\n")) {
-    // Read up to one character of whitespace (\n) after max_value
-    int c = getc(fp);
-    if (!isspace(c)) putc(c, fp);
-
-    // Read raw image data 
-    // First ppm pixel is top-left, so read in opposite scan-line order
-    for (int j = height-1; j >= 0; j--) {
-      for (int i = 0; i < width; i++) {
-        double r = (double) getc(fp) / max_value;
-        double g = (double) getc(fp) / max_value;
-        double b = (double) getc(fp) / max_value;
-        R2Pixel pixel(r, g, b, 1);
-        SetPixel(i, j, pixel);
+  // Allocate unsigned char buffer for one batch of scan lines
+  int rowsize = ncomponents * width;
+  int nrows = (cinfo->rec_outbuf_height > 0) ? cinfo->rec_outbuf_height : 1;
+  std::vector<unsigned char> buffer(rowsize * nrows);
+  std::vector<JSAMPROW> row_pointers(nrows);
+  for (int k = 0; k < nrows; k++) row_pointers[k] = &buffer[k * rowsize];
+
+  // Read scan lines and convert each batch into pixels as it arrives
+  // First jpeg pixel is top-left, so assign rows downwards from the top one
+  const double *unit = ByteToUnitTable();
+  R2Pixel *top = &pixels[(height - 1) * rowstride];
+  {
+    R2TraceScope phase("jpeg", "jpeg_read_scanlines", width, height, PixelBytes(npixels));
+    while (cinfo->output_scanline < cinfo->output_height) {
+      int scanline = cinfo->output_scanline;
+      int n = JPEGReadScanlines(cinfo, &row_pointers[0], nrows);
+      if (n < 0) return 0;
+      for (int k = 0; k < n; k++) {
+        UnpackRow(row_pointers[k], ncomponents, 1, 0, unit, &top[(ptrdiff_t) -(scanline + k) * rowstride], width);
       }
     }
   }
-  else {
-    // Read asci image data 
-    // First ppm pixel is top-left, so read in opposite scan-line order
-    for (int j = height-1; j >= 0; j--) {
-      for (int i = 0; i < width; i++) {
-	// Read pixel values
-	int red, green, blue;
-	if (fscanf(fp, "%d%d%d", &red, &green, &blue) != 3) {
-	  fprintf(stderr, "Unable to read data at (%d,%d) in PPM file", i, j);
-	  fclose(fp);
-	  return 0;
-	}
-
-	// Assign pixel values
-	double r = (double) red / max_value;
-	double g = (double) green / max_value;
-	double b = (double) blue / max_value;
-        R2Pixel pixel(r, g, b, 1);
-        SetPixel(i, j, pixel);
-      }
-    }
+
+  // Finish decompression
+  {
+    R2TraceScope phase("jpeg", "jpeg_finish_decompress");
+    if (!JPEGFinishDecompress(cinfo)) return 0;
   }
+  trace.SetImage(width, height, PixelBytes(npixels));
 
-  // Close file
-  fclose(fp);
+  // Finish the scale with the regular resampler
+  if (scaled) {
+    if (reduction == 1) Scale(sx, sy, sampling_method);
+    else if ((width != new_width) || (height != new_height)) {
+      Scale((double) new_width / width, (double) new_height / height, sampling_method);
+    }
+  }
 
   // Return success
   return 1;
@@ -975,264 +3477,290 @@ ReadPPM(const char *filename)
 
 
 int R2Image::
-WritePPM(const char *filename, int ascii) const
+WriteJPEG(const char *filename, int quality) const
 {
-  // Check type
-  if (ascii) {
-    // Open file
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-      fprintf(stderr, "Unable to open image file: %s\n", filename);
-      return 0;
-    }
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
 
-    // Print PPM image file 
-    // First ppm pixel is top-left, so write in opposite scan-line order
-    fprintf(fp, "P3\n");
-    fprintf(fp, "%d %d\n", width, height);
-    fprintf(fp, "255\n");
-    for (int j = height-1; j >= 0 ; j--) {
-      for (int i = 0; i < width; i++) {
-        const R2Pixel& p = (*this)[i][j];
-        int r = (int) (255 * p.Red());
-        int g = (int) (255 * p.Green());
-        int b = (int) (255 * p.Blue());
-        fprintf(fp, "%-3d %-3d %-3d  ", r, g, b);
-        if (((i+1) % 4) == 0) fprintf(fp, "\n");
-      }
-      if ((width % 4) != 0) fprintf(fp, "\n");
-    }
-    fprintf(fp, "\n");
+  // Initialize compression info
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = JPEGErrorManager(&jerr);
+  cinfo.client_data = NULL;
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, fp);
 
-    // Close file
-    fclose(fp);
+  // Write image
+  int status = WriteJPEG(&cinfo, quality);
+
+  // Free everything
+  jpeg_destroy_compress(&cinfo);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+int R2Image::
+WriteJPEG(struct jpeg_compress_struct *cinfo, int quality) const
+{
+  // Set compression parameters (the data destination is already set)
+  R2TraceScope trace("codec", "WriteJPEG", width, height, PixelBytes(npixels));
+  cinfo->image_width = width; 	/* image width and height, in pixels */
+  cinfo->image_height = height;
+  cinfo->input_components = 3;		/* # of color components per pixel */
+  cinfo->in_color_space = JCS_RGB; 	/* colorspace of input image */
+  cinfo->dct_method = JDCT_ISLOW;
+  jpeg_set_defaults(cinfo);
+  cinfo->optimize_coding = TRUE;
+  jpeg_set_quality(cinfo, quality, TRUE);
+  {
+    R2TraceScope phase("jpeg", "jpeg_start_compress");
+    if (!JPEGStartCompress(cinfo)) return 0;
   }
-  else {
-    // Open file
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-      fprintf(stderr, "Unable to open image file: %s\n", filename);
-      return 0;
-    }
-    
-    // Print PPM image file 
-    // First ppm pixel is top-left, so write in opposite scan-line order
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n", width, height);
-    fprintf(fp, "255\n");
-    for (int j = height-1; j >= 0 ; j--) {
-      for (int i = 0; i < width; i++) {
-        const R2Pixel& p = (*this)[i][j];
-        int r = (int) (255 * p.Red());
-        int g = (int) (255 * p.Green());
-        int b = (int) (255 * p.Blue());
-        fprintf(fp, "%c%c%c", r, g, b);
-      }
+	
+  // Allocate unsigned char buffer for a strip of about 1MB of scan lines
+  int rowsize = 3 * width;
+  int nrows = (rowsize > 0) ? (1 << 20) / rowsize : 1;
+  if (nrows < 1) nrows = 1;
+  if (nrows > height) nrows = height;
+  std::vector<unsigned char> buffer((size_t) nrows * rowsize);
+  std::vector<JSAMPROW> row_pointers(nrows);
+  for (int k = 0; k < nrows; k++) row_pointers[k] = &buffer[(size_t) k * rowsize];
+
+  // Output scan lines, packing each strip in parallel
+  // First jpeg pixel is top-left, so write rows of a flipped view
+  R2ImageView view = R2ImageView(*this).FlipVertical();
+  {
+    R2TraceScope phase("jpeg", "jpeg_write_scanlines", width, height, PixelBytes(npixels));
+    while (cinfo->next_scanline < cinfo->image_height) {
+      int y0 = cinfo->next_scanline;
+      int n = (height - y0 < nrows) ? height - y0 : nrows;
+      R2ParallelFor(n, RowGrain(width), [&](int begin, int end) {
+        for (int k = begin; k < end; k++) 
+          PackRow(view[y0 + k], width, 3, 0, row_pointers[k]);
+      });
+      if (!JPEGWriteScanlines(cinfo, &row_pointers[0], n)) return 0;
     }
-    
-    // Close file
-    fclose(fp);
+  }
+
+  // Finish compression (with optimize_coding, this runs the Huffman
+  // statistics pass and then entropy codes the buffered coefficients)
+  {
+    R2TraceScope phase("jpeg", "jpeg_finish_compress");
+    if (!JPEGFinishCompress(cinfo)) return 0;
   }
 
   // Return success
-  return 1;  
+  return 1;
 }
 
 
 
 ////////////////////////////////////////////////////////////////////////
-// JPEG I/O
+// In-memory I/O
 ////////////////////////////////////////////////////////////////////////
 
+static FILE *
+OpenMemoryStream(const void *data, size_t size)
+{
+  // Open a stream that reads size bytes of data
+#if defined(_WIN32)
+  // No fmemopen, so go through a temporary file
+  FILE *fp = tmpfile();
+  if (!fp) return NULL;
+  if (fwrite(data, 1, size, fp) != size) { fclose(fp); return NULL; }
+  rewind(fp);
+  return fp;
+#else
+  if (size == 0) return NULL;
+  return fmemopen((void *) data, size, "rb");
+#endif
+}
 
-extern "C" { 
-#   define XMD_H // Otherwise, a conflict with INT32
-#   undef FAR // Otherwise, a conflict with windows.h
-#   include "jpeg/jpeglib.h"
-};
+
+
+static FILE *
+CreateMemoryStream(char **buffer, size_t *size)
+{
+  // Open a stream whose output is collected in memory
+#if defined(_WIN32)
+  *buffer = NULL;
+  *size = 0;
+  return tmpfile();
+#else
+  return open_memstream(buffer, size);
+#endif
+}
+
+
+
+static int
+CloseMemoryStream(FILE *fp, char **buffer, size_t *size, std::vector<uint8_t>& data)
+{
+  // Close stream from CreateMemoryStream and copy its output into data
+#if defined(_WIN32)
+  fflush(fp);
+  long n = ftell(fp);
+  rewind(fp);
+  data.resize((n > 0) ? n : 0);
+  int status = (n >= 0) && (fread(data.data(), 1, data.size(), fp) == data.size());
+  fclose(fp);
+  return status;
+#else
+  int status = (fclose(fp) == 0);
+  if (status) data.assign((uint8_t *) *buffer, (uint8_t *) *buffer + *size);
+  free(*buffer);
+  return status;
+#endif
+}
 
 
 
 int R2Image::
-ReadJPEG(const char *filename)
+ReadBMPFromMemory(const void *data, size_t size)
 {
-  // Open file
-  FILE *fp = fopen(filename, "rb");
+  // Open stream on data
+  FILE *fp = OpenMemoryStream(data, size);
   if (!fp) {
-    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    fprintf(stderr, "Unable to open BMP data in memory\n");
     return 0;
   }
 
-  // Initialize decompression info
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
-  jpeg_stdio_src(&cinfo, fp);
-  jpeg_read_header(&cinfo, TRUE);
-  jpeg_start_decompress(&cinfo);
+  // Read image
+  int status = ReadBMP(fp);
 
-  // Remember image attributes
-  width = cinfo.output_width;
-  height = cinfo.output_height;
-  npixels = width * height;
-  int ncomponents = cinfo.output_components;
+  // Close stream
+  fclose(fp);
 
-  // Allocate pixels for image
-  pixels = new R2Pixel [ npixels ];
-  if (!pixels) {
-    fprintf(stderr, "Unable to allocate memory for BMP file");
-    fclose(fp);
-    return 0;
-  }
+  // Return status
+  return status;
+}
 
-  // Allocate unsigned char buffer for reading image
-  int rowsize = ncomponents * width;
-  if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-  int nbytes = rowsize * height;
-  unsigned char *buffer = new unsigned char [nbytes];
-  if (!buffer) {
-    fprintf(stderr, "Unable to allocate temporary memory for JPEG file");
-    fclose(fp);
+
+
+int R2Image::
+ReadPPMFromMemory(const void *data, size_t size)
+{
+  // Open stream on data
+  FILE *fp = OpenMemoryStream(data, size);
+  if (!fp) {
+    fprintf(stderr, "Unable to open PPM data in memory\n");
     return 0;
   }
 
-  // Read scan lines 
-  // First jpeg pixel is top-left, so read pixels in opposite scan-line order
-  while (cinfo.output_scanline < cinfo.output_height) {
-    int scanline = cinfo.output_height - cinfo.output_scanline - 1;
-    unsigned char *row_pointer = &buffer[scanline * rowsize];
-    jpeg_read_scanlines(&cinfo, &row_pointer, 1);
-  }
+  // Read image
+  int status = ReadPPM(fp);
+
+  // Close stream
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+int R2Image::
+ReadJPEGFromMemory(const void *data, size_t size, double sx, double sy, int sampling_method)
+{
+  // Initialize decompression info
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = JPEGErrorManager(&jerr);
+  cinfo.client_data = NULL;
+  jpeg_create_decompress(&cinfo);
+  jpeg_memory_src(&cinfo, (const JOCTET *) data, size);
+
+  // Read image
+  int status = ReadJPEG(&cinfo, sx, sy, sampling_method);
 
   // Free everything
-  jpeg_finish_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
 
-  // Close file
-  fclose(fp);
+  // Return status
+  return status;
+}
 
-  // Assign pixels
-  for (int j = 0; j < height; j++) {
-    unsigned char *p = &buffer[j * rowsize];
-    for (int i = 0; i < width; i++) {
-      double r, g, b, a;
-      if (ncomponents == 1) {
-        r = g = b = (double) *(p++) / 255;
-        a = 1;
-      }
-      else if (ncomponents == 1) {
-        r = g = b = (double) *(p++) / 255;
-        a = 1;
-        p++;
-      }
-      else if (ncomponents == 3) {
-        r = (double) *(p++) / 255;
-        g = (double) *(p++) / 255;
-        b = (double) *(p++) / 255;
-        a = 1;
-      }
-      else if (ncomponents == 4) {
-        r = (double) *(p++) / 255;
-        g = (double) *(p++) / 255;
-        b = (double) *(p++) / 255;
-        a = (double) *(p++) / 255;
-      }
-      else {
-        fprintf(stderr, "Unrecognized number of components in jpeg image: %d\n", ncomponents);
-        return 0;
-      }
-      R2Pixel pixel(r, g, b, a);
-      SetPixel(i, j, pixel);
-    }
+
+
+int R2Image::
+WriteBMPToMemory(std::vector<uint8_t>& data) const
+{
+  // Open stream collecting output
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *fp = CreateMemoryStream(&buffer, &size);
+  if (!fp) {
+    fprintf(stderr, "Unable to open memory stream for BMP data\n");
+    return 0;
   }
 
-  // Free unsigned char buffer for reading pixels
-  delete [] buffer;
+  // Write image
+  int status = WriteBMP(fp);
 
-  // Return success
-  return 1;
+  // Close stream and return status
+  if (!CloseMemoryStream(fp, &buffer, &size, data)) return 0;
+  return status;
 }
 
 
-	
 
 int R2Image::
-WriteJPEG(const char *filename) const
+WritePPMToMemory(std::vector<uint8_t>& data, int ascii) const
 {
-  // Open file
-  FILE *fp = fopen(filename, "wb");
+  // Open stream collecting output
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *fp = CreateMemoryStream(&buffer, &size);
   if (!fp) {
-    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    fprintf(stderr, "Unable to open memory stream for PPM data\n");
     return 0;
   }
 
+  // Write image
+  int status = WritePNM(fp, 3, ascii);
+
+  // Close stream and return status
+  if (!CloseMemoryStream(fp, &buffer, &size, data)) return 0;
+  return status;
+}
+
+
+
+int R2Image::
+WriteJPEGToMemory(std::vector<uint8_t>& data, int quality) const
+{
   // Initialize compression info
   struct jpeg_compress_struct cinfo;
   struct jpeg_error_mgr jerr;
-  cinfo.err = jpeg_std_error(&jerr);
+  cinfo.err = JPEGErrorManager(&jerr);
+  cinfo.client_data = NULL;
   jpeg_create_compress(&cinfo);
-  jpeg_stdio_dest(&cinfo, fp);
-  cinfo.image_width = width; 	/* image width and height, in pixels */
-  cinfo.image_height = height;
-  cinfo.input_components = 3;		/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
-  cinfo.dct_method = JDCT_ISLOW;
-  jpeg_set_defaults(&cinfo);
-  cinfo.optimize_coding = TRUE;
-  jpeg_set_quality(&cinfo, 75, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
-	
-  // Allocate unsigned char buffer for reading image
-  int rowsize = 3 * width;
-  if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-  int nbytes = rowsize * height;
-  unsigned char *buffer = new unsigned char [nbytes];
-  if (!buffer) {
-    fprintf(stderr, "Unable to allocate temporary memory for JPEG file");
-    fclose(fp);
-    return 0;
-  }
-
-  // Fill buffer with pixels
-  for (int j = 0; j < height; j++) {
-    unsigned char *p = &buffer[j * rowsize];
-    for (int i = 0; i < width; i++) {
-      const R2Pixel& pixel = (*this)[i][j];
-      int r = (int) (255 * pixel.Red());
-      int g = (int) (255 * pixel.Green());
-      int b = (int) (255 * pixel.Blue());
-      if (r > 255) r = 255;
-      if (g > 255) g = 255;
-      if (b > 255) b = 255;
-      *(p++) = r;
-      *(p++) = g;
-      *(p++) = b;
-    }
-  }
-
-
+  JOCTET *buffer = NULL;
+  size_t size = 0;
+  jpeg_memory_dest(&cinfo, &buffer, &size);
 
-  // Output scan lines
-  // First jpeg pixel is top-left, so write in opposite scan-line order
-  while (cinfo.next_scanline < cinfo.image_height) {
-    int scanline = cinfo.image_height - cinfo.next_scanline - 1;
-    unsigned char *row_pointer = &buffer[scanline * rowsize];
-    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
-  }
+  // Write image
+  int status = WriteJPEG(&cinfo, quality);
 
   // Free everything
-  jpeg_finish_compress(&cinfo);
   jpeg_destroy_compress(&cinfo);
 
-  // Close file
-  fclose(fp);
-
-  // Free unsigned char buffer for reading pixels
-  delete [] buffer;
+  // Copy compressed data (the buffer is freed also after an error)
+  if (status) data.assign(buffer, buffer + size);
+  free(buffer);
 
-  // Return number of bytes written
-  return 1;
+  // Return status
+  return status;
 }
 
 
@@ -1252,7 +3780,7 @@ ReadTXT(const char *filename)
   }
 
   // Read width, height, and nchannels
-  int nchannels;
+  int width, height, nchannels;
   if (fscanf(fp, "%d%d%d", &width, &height, &nchannels) != 3) {
     fprintf(stderr, "Unable to read width and height and nchannels in TXT file");
     fclose(fp);
@@ -1266,13 +3794,9 @@ ReadTXT(const char *filename)
     return 0;
   }
     
-  // Compute number of pixels
-  npixels = width * height;
-	
   // Allocate image pixels
-  pixels = new R2Pixel [ width * height ];
-  if (!pixels) {
-    fprintf(stderr, "Unable to allocate memory for TXT file");
+  if (!ValidImageSize(width, height) || !Resize(width, height)) {
+    fprintf(stderr, "Invalid image size (%dx%d) in TXT image %s\n", width, height, filename);
     fclose(fp);
     return 0;
   }
@@ -1323,11 +3847,13 @@ WriteTXT(const char *filename) const
   // Print width, height, and nchannels
   fprintf(fp, "%d %d %d\n", width, height, 4);
 
-  // Print pixel values
+  // Print pixel values (gamma encoded, read through a view)
   // First pixel is top-left, so write in opposite scan-line order
+  R2ImageView view(*this);
   for (int j = height-1; j >= 0 ; j--) {
+    const R2Pixel *row = view[j];
     for (int i = 0; i < width; i++) {
-      R2Pixel pixel = Pixel(i, j);
+      const R2Pixel& pixel = row[i];
       fprintf(fp, "%g %g %g %g\n", pixel[0], pixel[1], pixel[2], pixel[3]);
     }
   }
@@ -1336,4 +3862,308 @@ WriteTXT(const char *filename) const
   fclose(fp);
 
   // Return success
-  return 1;  }
\ No newline at end of file
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// R2IMG I/O
+////////////////////////////////////////////////////////////////////////
+
+// A .r2img file is this header, zero padding up to data_offset (a
+// multiple of the page size), and then the pixels or planes exactly as
+// R2Image stores them in memory (native byte order, including the row
+// padding), so that it can be mapped and used without copying.
+
+#define R2_IMAGE_FILE_MAGIC "R2IMG01"
+#define R2_IMAGE_FILE_BYTE_ORDER 0x01020304
+#define R2_IMAGE_FILE_ALIGNMENT 4096
+
+struct R2ImageFileHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels;
+  uint32_t sample_bytes;
+  uint32_t storage;
+  uint32_t transfer;
+  uint32_t rowstride;
+  uint64_t data_offset;
+  uint64_t data_size;
+  char reserved[8];
+};
+
+
+
+int R2Image::
+ReadR2IMG(const char *filename)
+{
+  // Open file (the image is left unchanged unless the whole read succeeds)
+  R2TraceScope trace("codec", "ReadR2IMG");
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Read header
+  R2ImageFileHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1) {
+    fprintf(stderr, "Unable to read header of R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+
+  // Check header
+  int planar = (header.storage == R2_IMAGE_PLANAR_STORAGE);
+  uint64_t nsamples = (uint64_t) header.rowstride * header.height;
+  uint64_t nbytes = nsamples * R2_IMAGE_NUM_CHANNELS * header.sample_bytes;
+  if (memcmp(header.magic, R2_IMAGE_FILE_MAGIC, sizeof(header.magic)) ||
+      (header.byte_order != R2_IMAGE_FILE_BYTE_ORDER) ||
+      (header.channels != R2_IMAGE_NUM_CHANNELS) ||
+      (header.sample_bytes != ((planar) ? sizeof(float) : sizeof(double))) ||
+      ((header.storage != R2_IMAGE_PIXEL_STORAGE) && !planar) ||
+      ((header.transfer != R2_IMAGE_GAMMA_TRANSFER) && (header.transfer != R2_IMAGE_LINEAR_TRANSFER)) ||
+      (header.rowstride > (uint32_t) INT_MAX) || (header.height > (uint32_t) INT_MAX) ||
+      ((header.width > 0) && (header.height > 0) && !ValidImageSize(header.rowstride, header.height)) ||
+      (header.rowstride < header.width) || ((int) header.rowstride != DefaultRowStride(header.rowstride)) ||
+      ((header.data_offset % R2_IMAGE_PLANE_ALIGNMENT) != 0) || (header.data_size != nbytes)) {
+    fprintf(stderr, "Invalid header in R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+
+#if defined(_WIN32)
+  // Read pixels or planes into memory
+  void *data = (planar) ? (void *) AllocatePlanes(nsamples, 0) : (void *) AllocatePixels(nsamples, 0);
+  if (!data) {
+    fprintf(stderr, "Unable to allocate data of R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+  std::shared_ptr<void> data_owner = OwnAligned(data);
+  if ((_fseeki64(fp, (__int64) header.data_offset, SEEK_SET) != 0) || 
+      (fread(data, 1, (size_t) nbytes, fp) != nbytes)) {
+    fprintf(stderr, "Unable to read data of R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+#else
+  // Map the file privately, so pages are shared with other readers
+  // until the image changes them
+  struct stat st;
+  size_t size = (size_t) (header.data_offset + nbytes);
+  if ((fstat(fileno(fp), &st) != 0) || ((uint64_t) st.st_size < header.data_offset + nbytes)) {
+    fprintf(stderr, "R2IMG file %s is truncated\n", filename);
+    fclose(fp);
+    return 0;
+  }
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+  fclose(fp);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map R2IMG file %s\n", filename);
+    return 0;
+  }
+  std::shared_ptr<void> data_owner(base, [size](void *base) { munmap(base, size); });
+  void *data = (char *) base + header.data_offset;
+#endif
+
+  // Use mapped (or read) pixels or planes as the image storage
+  FreeStorage();
+  width = header.width;
+  height = header.height;
+  npixels = width * height;
+  rowstride = header.rowstride;
+  storage = header.storage;
+  transfer = header.transfer;
+  if (planar) planes = (float *) data;
+  else pixels = (R2Pixel *) data;
+  owner = data_owner;
+  trace.SetImage(width, height, (double) nbytes);
+
+  // Return success
+  return 1;
+}
+
+
+
+int R2Image::
+WriteR2IMG(const char *filename) const
+{
+  // Open file
+  R2TraceScope trace("codec", "WriteR2IMG", width, height);
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Write header for storage and transfer as they are
+  int planar = (storage == R2_IMAGE_PLANAR_STORAGE);
+  R2ImageFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, R2_IMAGE_FILE_MAGIC, sizeof(header.magic));
+  header.byte_order = R2_IMAGE_FILE_BYTE_ORDER;
+  header.width = width;
+  header.height = height;
+  header.channels = R2_IMAGE_NUM_CHANNELS;
+  header.sample_bytes = (planar) ? sizeof(float) : sizeof(double);
+  header.storage = storage;
+  header.transfer = transfer;
+  header.rowstride = rowstride;
+  header.data_offset = R2_IMAGE_FILE_ALIGNMENT;
+  header.data_size = (uint64_t) rowstride * height * R2_IMAGE_NUM_CHANNELS * header.sample_bytes;
+  std::vector<char> padding(R2_IMAGE_FILE_ALIGNMENT - sizeof(header), 0);
+  if ((fwrite(&header, sizeof(header), 1, fp) != 1) ||
+      (fwrite(&padding[0], padding.size(), 1, fp) != 1)) {
+    fprintf(stderr, "Unable to write header of R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+
+  // Write pixels or planes in one block
+  const void *data = (planar) ? (const void *) planes : (const void *) pixels;
+  trace.SetImage(width, height, 2 * (double) header.data_size);
+  if ((header.data_size > 0) && (fwrite(data, (size_t) header.data_size, 1, fp) != 1)) {
+    fprintf(stderr, "Unable to write data of R2IMG file %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Image sizes
+////////////////////////////////////////////////////////////////////////
+
+int R2Image::
+ReadSize(const char *filename, int *width, int *height)
+{
+  // Parse filename extension
+  const char *extension = strrchr(filename, '.');
+  if (!extension) {
+    fprintf(stderr, "Input file has no extension (e.g., .jpg).\n");
+    return 0;
+  }
+
+  // Open file
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return 0;
+  }
+
+  // Read width and height from the header, without reading pixels
+  int status = 0;
+  *width = *height = 0;
+  if (!strncmp(extension, ".bmp", 4)) {
+    // Info header follows the 14 byte file header and its own size
+    if (fseek(fp, 18, SEEK_SET) == 0) {
+      *width = LongReadLE(fp);
+      *height = LongReadLE(fp);
+      status = !feof(fp);
+    }
+  }
+  else if (!strncmp(extension, ".ppm", 4) || !strncmp(extension, ".pgm", 4)) {
+    // Magic identifier, then width and height
+    if ((getc(fp) == 'P') && isdigit(getc(fp))) 
+      status = ReadPNMInteger(fp, width) && ReadPNMInteger(fp, height);
+  }
+  else if (!strncmp(extension, ".jpg", 4) || !strncmp(extension, ".jpeg", 5)) {
+    // Let libjpeg parse markers up to the frame header
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = JPEGErrorManager(&jerr);
+    cinfo.client_data = NULL;
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    if (JPEGReadHeader(&cinfo)) {
+      *width = cinfo.image_width;
+      *height = cinfo.image_height;
+      status = 1;
+    }
+    jpeg_destroy_decompress(&cinfo);
+  }
+  else if (!strncmp(extension, ".r2img", 6)) {
+    // Fixed header
+    R2ImageFileHeader header;
+    if ((fread(&header, sizeof(header), 1, fp) == 1) && !memcmp(header.magic, R2_IMAGE_FILE_MAGIC, sizeof(header.magic))) {
+      *width = header.width;
+      *height = header.height;
+      status = 1;
+    }
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Check size
+  if (!status || (*width <= 0) || (*height <= 0)) {
+    *width = *height = 0;
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+int R2Image::
+ReadSizeFromMemory(const void *data, size_t size, int *width, int *height)
+{
+  // Read width and height from the header of encoded data, 
+  // recognizing the format by its magic bytes
+  const unsigned char *bytes = (const unsigned char *) data;
+  int status = 0;
+  *width = *height = 0;
+  if ((size >= 26) && (bytes[0] == 'B') && (bytes[1] == 'M')) {
+    // Info header follows the 14 byte file header and its own size
+    *width = bytes[18] | (bytes[19] << 8) | (bytes[20] << 16) | ((unsigned int) bytes[21] << 24);
+    *height = bytes[22] | (bytes[23] << 8) | (bytes[24] << 16) | ((unsigned int) bytes[25] << 24);
+    status = 1;
+  }
+  else if ((size >= 2) && (bytes[0] == 'P') && isdigit(bytes[1])) {
+    // Magic identifier, then width and height
+    FILE *fp = OpenMemoryStream(data, size);
+    if (fp) {
+      fseek(fp, 2, SEEK_SET);
+      status = ReadPNMInteger(fp, width) && ReadPNMInteger(fp, height);
+      fclose(fp);
+    }
+  }
+  else if ((size >= 2) && (bytes[0] == 0xFF) && (bytes[1] == 0xD8)) {
+    // Let libjpeg parse markers up to the frame header
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = JPEGErrorManager(&jerr);
+    cinfo.client_data = NULL;
+    jpeg_create_decompress(&cinfo);
+    jpeg_memory_src(&cinfo, (const JOCTET *) data, size);
+    if (JPEGReadHeader(&cinfo)) {
+      *width = cinfo.image_width;
+      *height = cinfo.image_height;
+      status = 1;
+    }
+    jpeg_destroy_decompress(&cinfo);
+  }
+
+  // Check size
+  if (!status || (*width <= 0) || (*height <= 0)) {
+    *width = *height = 0;
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
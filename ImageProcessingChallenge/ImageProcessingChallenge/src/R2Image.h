@@ -2,6 +2,12 @@
 #ifndef R2_IMAGE_INCLUDED
 #define R2_IMAGE_INCLUDED
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <atomic>
 #include "R2Pixel.h"
 
 // Constant definitions
@@ -18,6 +24,8 @@ typedef enum {
   R2_IMAGE_POINT_SAMPLING,
   R2_IMAGE_BILINEAR_SAMPLING,
   R2_IMAGE_GAUSSIAN_SAMPLING,
+  R2_IMAGE_BICUBIC_SAMPLING,
+  R2_IMAGE_LANCZOS_SAMPLING,
   R2_IMAGE_NUM_SAMPLING_METHODS
 } R2ImageSamplingMethod;
 
@@ -29,6 +37,88 @@ typedef enum {
   R2_IMAGE_XOR_COMPOSITION,
 } R2ImageCompositeOperation;
 
+typedef enum {
+  R2_IMAGE_BRIGHTNESS_OPERATION,
+  R2_IMAGE_CONTRAST_OPERATION,
+  R2_IMAGE_SATURATION_OPERATION,
+  R2_IMAGE_NOISE_OPERATION,
+  R2_IMAGE_GAMMA_OPERATION,
+  R2_IMAGE_WHITEBALANCE_OPERATION,
+  R2_IMAGE_QUANTIZE_OPERATION,
+  R2_IMAGE_BLACKANDWHITE_OPERATION,
+  R2_IMAGE_EXTRACT_OPERATION,
+  R2_IMAGE_NUM_POINT_OPERATIONS
+} R2ImagePointOperationType;
+
+typedef enum {
+  R2_IMAGE_PIXEL_STORAGE,
+  R2_IMAGE_PLANAR_STORAGE,
+  R2_IMAGE_NUM_STORAGE_MODES
+} R2ImageStorage;
+
+typedef enum {
+  R2_IMAGE_GAMMA_TRANSFER,
+  R2_IMAGE_LINEAR_TRANSFER,
+  R2_IMAGE_NUM_TRANSFERS
+} R2ImageTransfer;
+
+// Exponent relating gamma encoded values to linear light
+#define R2_IMAGE_GAMMA 2.2
+
+// Blur switches to the recursive (constant time) filter at this sigma
+#define R2_IMAGE_IIR_BLUR_THRESHOLD 6.0
+
+// The recursive filter clamps sigma to this (its coefficients lose precision)
+#define R2_IMAGE_IIR_BLUR_MAX_SIGMA 1.0E5
+
+// Rows are padded to a multiple of this many samples (64 bytes of floats)
+#define R2_IMAGE_ROW_ALIGNMENT 16
+
+
+
+// Per-pixel operation with up to three parameters, e.g.,
+// { R2_IMAGE_WHITEBALANCE_OPERATION, { red, green, blue } }
+
+struct R2ImagePointOperation {
+  int type;
+  double parameters[3];
+};
+
+
+
+// Image buffer pool
+// (pixels, planes and filter temporaries are allocated from a pool that
+//  keeps freed buffers and hands them out again, without zeroing them,
+//  for requests of about the same size)
+
+struct R2ImagePoolStatistics {
+  size_t used_bytes;        // in buffers handed out and not yet freed
+  size_t high_water_bytes;  // most used_bytes at any time
+  size_t idle_bytes;        // in freed buffers kept for reuse
+  size_t nhits;             // requests served by a kept buffer
+  size_t nmisses;           // requests that allocated a new buffer
+};
+
+// Keep as many bytes as the high water mark (the default)
+#define R2_IMAGE_POOL_AUTOMATIC_LIMIT ((size_t) -1)
+
+R2ImagePoolStatistics R2GetImagePoolStatistics(void);
+void R2SetImagePoolLimit(size_t nbytes);
+void R2TrimImagePool(void);
+
+
+
+// JPEG library structures (used by private I/O functions)
+
+struct jpeg_compress_struct;
+struct jpeg_decompress_struct;
+
+
+
+// Views of image pixels (defined below)
+
+class R2ImageView;
+
 
 
 // Class definition
@@ -41,14 +131,23 @@ class R2Image {
   R2Image(int width, int height);
   R2Image(int width, int height, const R2Pixel *pixels);
   R2Image(const R2Image& image);
+  R2Image(R2Image&& image) noexcept;
+  R2Image(const R2ImageView& view);
   ~R2Image(void);
 
   // Image properties
   int NPixels(void) const;
   int Width(void) const;
   int Height(void) const;
+  int RowStride(void) const;
 
   // Pixel access/update
+  // (the writable accessors convert to gamma encoded R2Pixel storage and 
+  //  copy a buffer shared with copies of the image or views, so pointers 
+  //  they return are valid until the image is copied, changed or destroyed;
+  //  the const accessors never change the image, so they can be called
+  //  from several threads, and read an image in another form through a
+  //  gamma encoded copy made on first use and kept until the image changes)
   R2Pixel& Pixel(int x, int y);
   const R2Pixel& Pixel(int x, int y) const;
   R2Pixel *Pixels(void);
@@ -57,48 +156,159 @@ class R2Image {
   const R2Pixel *operator[](int row) const;
   void SetPixel(int x, int y,  const R2Pixel& pixel);
 
+  // Storage access/update
+  // (planar storage keeps one aligned float plane per channel,
+  //  the writable R2Pixel accessors above convert back to pixel storage,
+  //  and const Channel reads an image in pixel storage through a copy)
+  int Storage(void) const;
+  void SetStorage(int storage);
+  void SetRowStride(int rowstride);
+  float *Channel(int channel);
+  const float *Channel(int channel) const;
+
+  // Transfer function access/update
+  // (filters work in linear light and leave the image there, the writable
+  //  accessors convert back to gamma encoding, and the const accessors read
+  //  gamma encoded values, so SetTransfer(R2_IMAGE_GAMMA_TRANSFER) before
+  //  reading much of an image through them saves making a copy)
+  int Transfer(void) const;
+  void SetTransfer(int transfer);
+
   // Image processing
+  // (copies share the buffer until either image changes its pixels,
+  //  and moves and Swap exchange buffers)
   R2Image& operator=(const R2Image& image);
+  R2Image& operator=(R2Image&& image) noexcept;
+  void Swap(R2Image& image) noexcept;
   //additional function used in R2Image.cpp
   void ApplyGamma(double exponent);
+  // (sigma is the Gaussian's standard deviation, or the stretch of the bicubic/Lanczos kernels)
   R2Pixel Sample(double x0, double y0, int sampling_method, double sigma_x, double sigma_y);
 
   // Luminance operations
   void AddNoise(double magnitude);
   void Brighten(double factor);
   void ChangeContrast(double factor);
+  void ChangeSaturation(double factor);
+  void WhiteBalance(double red, double green, double blue);
+  void Quantize(int nbits);
+  void BlackAndWhite(void);
+
+  // Point operations, applied in as few passes over the pixels as possible
+  void ApplyPointOperations(const R2ImagePointOperation *operations, int noperations);
 
   // Linear filtering operations
   void Blur(double sigma);
+  void BlurIIR(double sigma);
   void Sharpen(void);
   void EdgeDetect(void);
 
   // Resampling operations
   void Scale(double sx, double sy, int sampling_method);
+  void Crop(int x, int y, int width, int height);
 
   // Composite operations
   void Composite(const R2Image& top, int operation);
+  void Composite(const R2ImageView& top, int operation);
 
   void ExtractChannel(int channel);
   void CopyChannel(const R2Image& from_image, int from_channel, int to_channel);
 
   // File reading/writing
+  // (ascii selects text or raw PPM/PGM files in Write)
   int Read(const char *filename);
+  int Read(const char *filename, double sx, double sy, int sampling_method);
   int ReadBMP(const char *filename);
   int ReadPPM(const char *filename);
-  int ReadJPEG(const char *filename);
+  int ReadJPEG(const char *filename, double sx = 1, double sy = 1, int sampling_method = R2_IMAGE_POINT_SAMPLING);
+  int ReadR2IMG(const char *filename);
   int ReadTXT(const char *filename);
-  int Write(const char *filename) const;
+  int Write(const char *filename, int ascii = 1) const;
   int WriteBMP(const char *filename) const;
   int WritePPM(const char *filename, int ascii = 0) const;
-  int WriteJPEG(const char *filename) const;
+  int WritePGM(const char *filename, int ascii = 0) const;
+  int WriteJPEG(const char *filename, int quality = 75) const;
+  int WriteR2IMG(const char *filename) const;
   int WriteTXT(const char *filename) const;
 
+  // Reading the width and height from an image file's header
+  static int ReadSize(const char *filename, int *width, int *height);
+  static int ReadSizeFromMemory(const void *data, size_t size, int *width, int *height);
+
+  // Reading/writing encoded images in memory
+  int ReadBMPFromMemory(const void *data, size_t size);
+  int ReadPPMFromMemory(const void *data, size_t size);
+  int ReadJPEGFromMemory(const void *data, size_t size, double sx = 1, double sy = 1, int sampling_method = R2_IMAGE_POINT_SAMPLING);
+  int WriteBMPToMemory(std::vector<uint8_t>& data) const;
+  int WritePPMToMemory(std::vector<uint8_t>& data, int ascii = 0) const;
+  int WriteJPEGToMemory(std::vector<uint8_t>& data, int quality = 75) const;
+
+ private:
+  friend class R2Pipeline;
+  friend class R2ImageView;
+  int Resize(int width, int height);
+  void FreeStorage(void);
+  int NeedsDetach(void) const;
+  void Detach(void);
+  void ConvertStorage(int storage);
+  void ConvertTransfer(int transfer);
+  const R2Image& Converted(int storage, R2Image& copy) const;
+  const R2Image& ConvertedCopy(int storage) const;
+  void ClearConverted(void);
+  int ReadBMP(FILE *fp);
+  int ReadPPM(FILE *fp);
+  int ReadJPEG(struct jpeg_decompress_struct *cinfo, double sx, double sy, int sampling_method);
+  int WriteBMP(FILE *fp) const;
+  int WritePNM(FILE *fp, int ncomponents, int ascii) const;
+  int WriteJPEG(struct jpeg_compress_struct *cinfo, int quality) const;
+
  private:
   R2Pixel *pixels;
+  float *planes;
+  int storage;
+  int transfer;
+  std::shared_ptr<void> owner;
   int npixels;
   int width;
   int height;
+  int rowstride;
+  mutable std::atomic<R2Image *> converted_pixels;
+  mutable std::atomic<R2Image *> converted_planes;
+};
+
+
+
+// A view of a rectangle of an image's pixels, which shares the image's
+// buffer (keeping it alive) instead of copying it.  Rows are RowStride()
+// pixels apart, and a negative stride flips the view vertically.
+// Views read gamma encoded pixels, and keep the values they had when the
+// view was made (the image copies a shared buffer before changing it).
+
+class R2ImageView {
+ public:
+  // Constructors
+  R2ImageView(void);
+  R2ImageView(const R2Image& image);
+
+  // View properties
+  int Width(void) const;
+  int Height(void) const;
+  int RowStride(void) const;
+
+  // Pixel access
+  const R2Pixel& Pixel(int x, int y) const;
+  const R2Pixel *operator[](int row) const;
+
+  // Views of part of this view (without copying pixels)
+  R2ImageView Crop(int x, int y, int width, int height) const;
+  R2ImageView FlipVertical(void) const;
+
+ private:
+  std::shared_ptr<void> owner;
+  const R2Pixel *origin;
+  int width;
+  int height;
+  int rowstride;
 };
 
 
@@ -132,12 +342,52 @@ Height(void) const
 
 
 
+inline int R2Image::
+RowStride(void) const
+{
+  // Return number of samples between the starts of consecutive rows
+  return rowstride;
+}
+
+
+
+inline int R2Image::
+Storage(void) const
+{
+  // Return storage mode
+  return storage;
+}
+
+
+
+inline int R2Image::
+Transfer(void) const
+{
+  // Return transfer function
+  return transfer;
+}
+
+
+
+inline int R2Image::
+NeedsDetach(void) const
+{
+  // Return whether the buffer is shared or copies were made for the const
+  // accessors, which Detach has to handle before pixels change
+  return (owner.use_count() > 1) || 
+    converted_pixels.load(std::memory_order_relaxed) || converted_planes.load(std::memory_order_relaxed);
+}
+
+
+
 inline const R2Pixel& R2Image::
 Pixel(int x, int y) const
 {
   // Return pixel value at (x,y)
   // (pixels start at lower-left and go in row-major order)
-  return pixels[x*height + y];
+  if ((storage != R2_IMAGE_PIXEL_STORAGE) || (transfer != R2_IMAGE_GAMMA_TRANSFER)) 
+    return ConvertedCopy(R2_IMAGE_PIXEL_STORAGE).pixels[y*rowstride + x];
+  return pixels[y*rowstride + x];
 }
 
 inline R2Pixel& R2Image::
@@ -145,7 +395,10 @@ Pixel(int x, int y)
 {
   // Return pixel value at (x,y)
   // (pixels start at lower-left and go in row-major order)
-  return pixels[x*height + y];
+  if (storage != R2_IMAGE_PIXEL_STORAGE) ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  if (NeedsDetach()) Detach();
+  return pixels[y*rowstride + x];
 }
 
 
@@ -154,37 +407,46 @@ inline R2Pixel *R2Image::
 Pixels(void)
 {
   // Return pointer to pixels for whole image 
-  // (pixels start at lower-left and go in row-major order)
+  // (pixels start at lower-left and go in row-major order,
+  //  with rows RowStride() pixels apart)
+  if (storage != R2_IMAGE_PIXEL_STORAGE) ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  if (NeedsDetach()) Detach();
   return pixels;
 }
 
 
 
 inline R2Pixel *R2Image::
-Pixels(int x)
+Pixels(int y)
 {
-  // Return pixels pointer for row at x
+  // Return pixels pointer for row at y
   // (pixels start at lower-left and go in row-major order)
-  return &pixels[x*height];
+  if (storage != R2_IMAGE_PIXEL_STORAGE) ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  if (NeedsDetach()) Detach();
+  return &pixels[y*rowstride];
 }
 
 
 
 inline R2Pixel *R2Image::
-operator[](int x) 
+operator[](int y) 
 {
-  // Return pixels pointer for row at x
-  return Pixels(x);
+  // Return pixels pointer for row at y
+  return Pixels(y);
 }
 
 
 
 inline const R2Pixel *R2Image::
-operator[](int x) const
+operator[](int y) const
 {
-  // Return pixels pointer for row at x
+  // Return pixels pointer for row at y
   // (pixels start at lower-left and go in row-major order)
-  return &pixels[x*height];
+  if ((storage != R2_IMAGE_PIXEL_STORAGE) || (transfer != R2_IMAGE_GAMMA_TRANSFER)) 
+    return &ConvertedCopy(R2_IMAGE_PIXEL_STORAGE).pixels[y*rowstride];
+  return &pixels[y*rowstride];
 }
 
 
@@ -193,7 +455,81 @@ inline void R2Image::
 SetPixel(int x, int y, const R2Pixel& pixel)
 {
   // Set pixel
-  pixels[x*height + y] = pixel;
+  if (storage != R2_IMAGE_PIXEL_STORAGE) ConvertStorage(R2_IMAGE_PIXEL_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  if (NeedsDetach()) Detach();
+  pixels[y*rowstride + x] = pixel;
+}
+
+
+
+inline float *R2Image::
+Channel(int channel)
+{
+  // Return plane of floats for channel
+  // (indexed like Pixels(), i.e., y*RowStride() + x)
+  assert((channel >= 0) && (channel < R2_IMAGE_NUM_CHANNELS));
+  if (storage != R2_IMAGE_PLANAR_STORAGE) ConvertStorage(R2_IMAGE_PLANAR_STORAGE);
+  if (transfer != R2_IMAGE_GAMMA_TRANSFER) ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  if (NeedsDetach()) Detach();
+  return &planes[channel*rowstride*height];
+}
+
+
+
+inline const float *R2Image::
+Channel(int channel) const
+{
+  // Return plane of floats for channel
+  assert((channel >= 0) && (channel < R2_IMAGE_NUM_CHANNELS));
+  if ((storage != R2_IMAGE_PLANAR_STORAGE) || (transfer != R2_IMAGE_GAMMA_TRANSFER)) 
+    return &ConvertedCopy(R2_IMAGE_PLANAR_STORAGE).planes[channel*rowstride*height];
+  return &planes[channel*rowstride*height];
+}
+
+
+
+inline int R2ImageView::
+Width(void) const
+{
+  // Return width
+  return width;
+}
+
+
+
+inline int R2ImageView::
+Height(void) const
+{
+  // Return height
+  return height;
+}
+
+
+
+inline int R2ImageView::
+RowStride(void) const
+{
+  // Return number of pixels from the start of a row to the next one up
+  return rowstride;
+}
+
+
+
+inline const R2Pixel& R2ImageView::
+Pixel(int x, int y) const
+{
+  // Return pixel value at (x,y)
+  return origin[(ptrdiff_t) y*rowstride + x];
+}
+
+
+
+inline const R2Pixel *R2ImageView::
+operator[](int y) const
+{
+  // Return pixels pointer for row at y
+  return &origin[(ptrdiff_t) y*rowstride];
 }
 
 
@@ -0,0 +1,77 @@
+// Include file for row kernels shared by R2Image and R2Pipeline
+#ifndef R2_IMAGE_KERNELS_INCLUDED
+#define R2_IMAGE_KERNELS_INCLUDED
+
+#include <vector>
+#include "R2Pixel.h"
+#include "R2Image.h"
+
+// These compute one output row of an image operation from rows of its
+// input.  The R2Image functions call them on whole images and R2Pipeline
+// calls them on strips of rows, so both give bit-identical results.
+// Pixels are R2Pixels with the transfer function the operation expects.
+
+
+
+// Type definitions
+
+// Taps of a 1-D resampling filter.  Output position i reads the ntaps input
+// positions index[i*ntaps + t] with weights weight[i*ntaps + t], and copies
+// alpha from input position alpha[i] (or sets it to 1 if that is negative).
+
+struct R2ResampleFilter {
+  int ntaps;
+  std::vector<int> index;
+  std::vector<double> weight;
+  std::vector<int> alpha;
+};
+
+
+
+// Function declarations
+
+// Clip the rectangle with lower-left corner (x,y) to an image
+// (leaving width or height 0 if they do not overlap)
+void R2CropRectangle(int image_width, int image_height, int& x, int& y, int& width, int& height);
+
+// Apply one point operation to n pixels
+// (average is the luminance used by contrast changes)
+void R2PointOperationRow(R2Pixel *row, int n, const R2ImagePointOperation& operation, double average);
+
+// Fill kernel[0..size] with 1-D Gaussian weights and scale[0..n-1] with
+// the reciprocals of the weights that fall inside [0,n) around each position
+void R2BlurWeights(double sigma, int size, int n, std::vector<double>& kernel, std::vector<double>& scale);
+
+// Blur the colors of one row horizontally into 3*width doubles (rgb)
+void R2BlurRowHorizontal(const R2Pixel *src, double *dst, int width, int size,
+  const double *kernel, const double *xscale);
+
+// Blur rows [ylow, yhigh) of horizontally blurred doubles vertically
+// into the colors of row y0 (rows[k] is row ylow+k, sum holds 3*width doubles)
+void R2BlurRowVertical(const double *const *rows, int ylow, int yhigh, int y0, int width,
+  const double *kernel, double yscale, double *sum, R2Pixel *dst);
+
+// Edge detect row y0 from rows[0..2] = rows y0-1, y0, y0+1 (NULL outside the image)
+void R2EdgeDetectRow(const R2Pixel *const *rows, int width, R2Pixel *dst);
+
+// Sharpen a row in place by extrapolating away from its blurred version
+void R2SharpenRow(const R2Pixel *blurred, R2Pixel *row, int width, double factor);
+
+// Check that scale factors are positive and that scaling a width x height
+// image by them gives a size that fits in an int (printing why if not)
+int R2CheckScale(int width, int height, double sx, double sy);
+
+// Compute taps for resampling n positions to m, like R2Image::Scale
+// (scale is the factor applied, i.e., about m/n)
+void R2ResampleWeights(int n, int m, double scale, int sampling_method, R2ResampleFilter& filter);
+
+// Resample one row horizontally into width output pixels
+void R2ResampleRowHorizontal(const R2Pixel *src, R2Pixel *dst, int width, const R2ResampleFilter& filter);
+
+// Weigh rows[0..ntaps-1] into dst, copying alpha from alpha_row (or 1 if NULL)
+void R2ResampleRowVertical(const R2Pixel *const *rows, const double *weights, int ntaps,
+  const R2Pixel *alpha_row, int width, R2Pixel *dst);
+
+
+
+#endif
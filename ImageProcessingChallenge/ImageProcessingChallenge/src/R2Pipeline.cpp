@@ -0,0 +1,1024 @@
+// Source file for lazily evaluated chains of image operations
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <vector>
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2ImageKernels.h"
+#include "R2Pipeline.h"
+#include "R2Threads.h"
+#include "R2Trace.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Stages
+////////////////////////////////////////////////////////////////////////
+
+// A stage computes the rows of one intermediate image in order, keeping
+// only the last NSlots() of them in a ring buffer.  Before the first
+// Require, each consumer calls Reserve with the most rows it reads at once
+// (its strip plus halo), and the stage reserves what it needs from its
+// own inputs in turn.  Consumers then Require rows in increasing order.
+
+class R2PipelineStage {
+ public:
+  R2PipelineStage(int width, int height, int transfer);
+  virtual ~R2PipelineStage(void);
+  virtual const char *Name(void) const = 0;
+  int Width(void) const { return width; }
+  int Height(void) const { return height; }
+  int Transfer(void) const { return transfer; }
+  void SetTransfer(int transfer) { this->transfer = transfer; }
+  void Reserve(int nrows);
+  void Require(int begin, int end);
+  const R2Pixel *Row(int y) const;
+  const R2Pixel *Slots(void) const { return slots; }
+  int Stride(void) const { return stride; }
+  int NSlots(void) const { return nslots; }
+
+ protected:
+  virtual void ReserveInputs(int nrows) = 0;
+  virtual void Produce(int begin, int end) = 0;
+  R2Pixel *Slot(int y) { return slots + (y % nslots) * stride; }
+
+ protected:
+  int width, height, transfer;
+  std::vector<R2Pixel> buffer;
+  R2Pixel *slots;
+  int stride;
+  int nslots;
+  int produced;
+};
+
+
+
+R2PipelineStage::
+R2PipelineStage(int width, int height, int transfer)
+  : width(width),
+    height(height),
+    transfer(transfer),
+    slots(NULL),
+    stride(width),
+    nslots(0),
+    produced(0)
+{
+}
+
+
+
+R2PipelineStage::
+~R2PipelineStage(void)
+{
+}
+
+
+
+void R2PipelineStage::
+Reserve(int nrows)
+{
+  // Grow ring buffer to hold nrows rows (never more than the whole image)
+  if (nrows > height) nrows = height;
+  if (nrows <= nslots) return;
+  assert(!slots);
+  nslots = nrows;
+  ReserveInputs(nslots);
+}
+
+
+
+void R2PipelineStage::
+Require(int begin, int end)
+{
+  // Allocate ring buffer on first use
+  if (begin < 0) begin = 0;
+  if (end > height) end = height;
+  assert(end - begin <= nslots);
+  if (!slots) {
+    buffer.resize(nslots * width);
+    slots = &buffer[0];
+  }
+
+  // Compute rows up to end, at most one ring buffer full at a time
+  while (produced < end) {
+    int stop = (produced + nslots < end) ? produced + nslots : end;
+    R2TraceScope trace("pipeline", Name(), width, stop - produced, (double) (stop - produced) * width * sizeof(R2Pixel));
+    Produce(produced, stop);
+    produced = stop;
+  }
+}
+
+
+
+const R2Pixel *R2PipelineStage::
+Row(int y) const
+{
+  // Return row y, which must still be in the ring buffer
+  assert((y >= 0) && (y < produced) && (y >= produced - nslots));
+  return slots + (y % nslots) * stride;
+}
+
+
+
+// Rows of an existing image (in pixel storage)
+
+class R2PipelineSourceStage : public R2PipelineStage {
+ public:
+  R2PipelineSourceStage(R2Pixel *pixels, int width, int height, int rowstride, int transfer);
+  virtual const char *Name(void) const { return NULL; }
+
+ protected:
+  virtual void ReserveInputs(int nrows) {}
+  virtual void Produce(int begin, int end) {}
+};
+
+
+
+R2PipelineSourceStage::
+R2PipelineSourceStage(R2Pixel *pixels, int width, int height, int rowstride, int transfer)
+  : R2PipelineStage(width, height, transfer)
+{
+  // All rows are available in the image
+  slots = pixels;
+  stride = rowstride;
+  nslots = height;
+  produced = height;
+}
+
+
+
+// Rectangle of the input rows.  Rows of an input that holds all of
+// them (e.g., the source image) are used in place, without copying.
+
+class R2PipelineCropStage : public R2PipelineStage {
+ public:
+  R2PipelineCropStage(R2PipelineStage *input, int x, int y, int width, int height);
+  virtual const char *Name(void) const { return "crop"; }
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  R2PipelineStage *input;
+  int x0, y0;
+};
+
+
+
+R2PipelineCropStage::
+R2PipelineCropStage(R2PipelineStage *input, int x, int y, int width, int height)
+  : R2PipelineStage(0, 0, input->Transfer()),
+    input(input),
+    x0(0),
+    y0(0)
+{
+  // Clip rectangle to the input
+  R2CropRectangle(input->Width(), input->Height(), x, y, width, height);
+  this->width = width;
+  this->height = height;
+  this->stride = width;
+  x0 = x;
+  y0 = y;
+
+  // Point into the input if all of its rows are available
+  if (input->Slots() && (input->NSlots() == input->Height()) && (width > 0) && (height > 0)) {
+    slots = (R2Pixel *) input->Row(y0) + x0;
+    stride = input->Stride();
+    nslots = height;
+    produced = height;
+  }
+}
+
+
+
+void R2PipelineCropStage::
+ReserveInputs(int nrows)
+{
+  // Each output row reads one input row
+  input->Reserve(nrows);
+}
+
+
+
+void R2PipelineCropStage::
+Produce(int begin, int end)
+{
+  // Copy the rectangle's part of the input rows
+  input->Require(begin + y0, end + y0);
+  for (int y = begin; y < end; y++) 
+    memcpy((void *) Slot(y), input->Row(y + y0) + x0, width * sizeof(R2Pixel));
+}
+
+
+
+// Fused per-pixel operations
+
+class R2PipelinePointStage : public R2PipelineStage {
+ public:
+  R2PipelinePointStage(R2PipelineStage *input);
+  virtual const char *Name(void) const { return "point operations"; }
+  void AddOperation(const R2ImagePointOperation& operation, double average);
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  R2PipelineStage *input;
+  std::vector<R2ImagePointOperation> operations;
+  std::vector<double> averages;
+  bool serial;
+};
+
+
+
+R2PipelinePointStage::
+R2PipelinePointStage(R2PipelineStage *input)
+  : R2PipelineStage(input->Width(), input->Height(), input->Transfer()),
+    input(input),
+    serial(false)
+{
+}
+
+
+
+void R2PipelinePointStage::
+AddOperation(const R2ImagePointOperation& operation, double average)
+{
+  // Append operation (noise is drawn serially, in row order)
+  operations.push_back(operation);
+  averages.push_back(average);
+  if (operation.type == R2_IMAGE_NOISE_OPERATION) serial = true;
+}
+
+
+
+void R2PipelinePointStage::
+ReserveInputs(int nrows)
+{
+  // Each output row reads the same input row
+  input->Reserve(nrows);
+}
+
+
+
+void R2PipelinePointStage::
+Produce(int begin, int end)
+{
+  // Copy input rows and apply operations to them
+  input->Require(begin, end);
+  R2ParallelFunction rows = [&](int first, int last) {
+    for (int y = begin + first; y < begin + last; y++) {
+      const R2Pixel *src = input->Row(y);
+      R2Pixel *dst = Slot(y);
+      for (int x = 0; x < width; x++) dst[x] = src[x];
+      for (unsigned int k = 0; k < operations.size(); k++)
+        R2PointOperationRow(dst, width, operations[k], averages[k]);
+    }
+  };
+  if (serial) rows(0, end - begin);
+  else R2ParallelFor(end - begin, 1, rows);
+}
+
+
+
+// Separable Gaussian blur (FIR) of linear pixels.  Horizontally blurred
+// rows are kept in a second ring buffer, so the halo rows shared by
+// consecutive strips are computed once.
+
+class R2PipelineBlurStage : public R2PipelineStage {
+ public:
+  R2PipelineBlurStage(R2PipelineStage *input, double sigma);
+  virtual const char *Name(void) const { return "blur"; }
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  R2PipelineStage *input;
+  int size;
+  std::vector<double> kernel, xscale, yscale;
+  std::vector<double> horizontal;
+  int nhorizontal;
+  int hproduced;
+};
+
+
+
+R2PipelineBlurStage::
+R2PipelineBlurStage(R2PipelineStage *input, double sigma)
+  : R2PipelineStage(input->Width(), input->Height(), R2_IMAGE_LINEAR_TRANSFER),
+    input(input),
+    size(0),
+    nhorizontal(0),
+    hproduced(0)
+{
+  // Compute weights like R2Image::Blur
+  assert(input->Transfer() == R2_IMAGE_LINEAR_TRANSFER);
+  size = 3*sigma;
+  if (size < 1) size = 1;
+  R2BlurWeights(sigma, size, width, kernel, xscale);
+  R2BlurWeights(sigma, size, height, kernel, yscale);
+}
+
+
+
+void R2PipelineBlurStage::
+ReserveInputs(int nrows)
+{
+  // Each output row reads input rows within size of it
+  nhorizontal = nrows + 2*size;
+  if (nhorizontal > height) nhorizontal = height;
+  input->Reserve(nrows + 2*size);
+}
+
+
+
+void R2PipelineBlurStage::
+Produce(int begin, int end)
+{
+  // Blur input rows horizontally that have not been yet
+  int ylow = (begin - size < 0) ? 0 : begin - size;
+  int yhigh = (end + size > height) ? height : end + size;
+  int first = (hproduced > ylow) ? hproduced : ylow;
+  if (horizontal.empty()) horizontal.resize(3 * width * nhorizontal);
+  if (first < yhigh) {
+    input->Require(first, yhigh);
+    R2ParallelFor(yhigh - first, 1, [&](int b, int e) {
+      for (int y = first + b; y < first + e; y++)
+        R2BlurRowHorizontal(input->Row(y), &horizontal[3*width*(y % nhorizontal)], width, size, &kernel[0], &xscale[0]);
+    });
+    hproduced = yhigh;
+  }
+
+  // Blur vertically into output rows (alpha comes from the input)
+  R2ParallelFor(end - begin, 1, [&](int b, int e) {
+    double *sum = (double *) R2ThreadScratch(0, 3 * width * sizeof(double));
+    std::vector<const double *> rows(2*size + 1);
+    for (int y0 = begin + b; y0 < begin + e; y0++) {
+      int y0low = (y0 - size < 0) ? 0 : y0 - size;
+      int y0high = (y0 + size + 1 > height) ? height : y0 + size + 1;
+      for (int y = y0low; y < y0high; y++) rows[y - y0low] = &horizontal[3*width*(y % nhorizontal)];
+      const R2Pixel *src = input->Row(y0);
+      R2Pixel *dst = Slot(y0);
+      for (int x = 0; x < width; x++) dst[x] = src[x];
+      R2BlurRowVertical(&rows[0], y0low, y0high, y0, width, &kernel[0], yscale[y0], sum, dst);
+    }
+  });
+}
+
+
+
+// 3x3 edge detection of linear pixels
+
+class R2PipelineEdgeStage : public R2PipelineStage {
+ public:
+  R2PipelineEdgeStage(R2PipelineStage *input);
+  virtual const char *Name(void) const { return "edge"; }
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  R2PipelineStage *input;
+};
+
+
+
+R2PipelineEdgeStage::
+R2PipelineEdgeStage(R2PipelineStage *input)
+  : R2PipelineStage(input->Width(), input->Height(), R2_IMAGE_LINEAR_TRANSFER),
+    input(input)
+{
+  assert(input->Transfer() == R2_IMAGE_LINEAR_TRANSFER);
+}
+
+
+
+void R2PipelineEdgeStage::
+ReserveInputs(int nrows)
+{
+  // Each output row reads the input rows above and below it
+  input->Reserve(nrows + 2);
+}
+
+
+
+void R2PipelineEdgeStage::
+Produce(int begin, int end)
+{
+  // Detect edges from input rows around each output row
+  input->Require(begin - 1, end + 1);
+  R2ParallelFor(end - begin, 1, [&](int b, int e) {
+    for (int y0 = begin + b; y0 < begin + e; y0++) {
+      const R2Pixel *rows[3];
+      for (int k = 0; k < 3; k++) {
+        int y = y0 - 1 + k;
+        rows[k] = ((y < 0) || (y >= height)) ? NULL : input->Row(y);
+      }
+      R2EdgeDetectRow(rows, width, Slot(y0));
+    }
+  });
+}
+
+
+
+// Unsharp masking like R2Image::Sharpen, which blurs a gamma encoded copy
+// in linear light and extrapolates the gamma encoded input away from it
+
+class R2PipelineSharpenStage : public R2PipelineStage {
+ public:
+  R2PipelineSharpenStage(R2PipelineStage *input);
+  virtual const char *Name(void) const { return "sharpen"; }
+  virtual ~R2PipelineSharpenStage(void);
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  R2PipelineStage *encoded;
+  R2PipelineStage *blurred;
+  std::vector<R2PipelineStage *> stages;
+};
+
+
+
+R2PipelineSharpenStage::
+R2PipelineSharpenStage(R2PipelineStage *input)
+  : R2PipelineStage(input->Width(), input->Height(), R2_IMAGE_GAMMA_TRANSFER),
+    encoded(input),
+    blurred(NULL)
+{
+  // Convert input to linear light for the blur, or to gamma for the extrapolation
+  R2PipelineStage *linear = input;
+  R2ImagePointOperation to_linear = { R2_IMAGE_GAMMA_OPERATION, { R2_IMAGE_GAMMA, 0, 0 } };
+  R2ImagePointOperation to_gamma = { R2_IMAGE_GAMMA_OPERATION, { 1.0 / R2_IMAGE_GAMMA, 0, 0 } };
+  if (input->Transfer() == R2_IMAGE_GAMMA_TRANSFER) {
+    R2PipelinePointStage *stage = new R2PipelinePointStage(input);
+    stage->AddOperation(to_linear, 0);
+    stage->SetTransfer(R2_IMAGE_LINEAR_TRANSFER);
+    stages.push_back(stage);
+    linear = stage;
+  }
+  else {
+    R2PipelinePointStage *stage = new R2PipelinePointStage(input);
+    stage->AddOperation(to_gamma, 0);
+    stage->SetTransfer(R2_IMAGE_GAMMA_TRANSFER);
+    stages.push_back(stage);
+    encoded = stage;
+  }
+
+  // Blur and convert back to gamma
+  R2PipelineBlurStage *blur = new R2PipelineBlurStage(linear, 2.0);
+  stages.push_back(blur);
+  R2PipelinePointStage *stage = new R2PipelinePointStage(blur);
+  stage->AddOperation(to_gamma, 0);
+  stage->SetTransfer(R2_IMAGE_GAMMA_TRANSFER);
+  stages.push_back(stage);
+  blurred = stage;
+}
+
+
+
+R2PipelineSharpenStage::
+~R2PipelineSharpenStage(void)
+{
+  // Delete internal stages
+  for (unsigned int i = 0; i < stages.size(); i++) delete stages[i];
+}
+
+
+
+void R2PipelineSharpenStage::
+ReserveInputs(int nrows)
+{
+  // Each output row reads the same row of both branches
+  blurred->Reserve(nrows);
+  encoded->Reserve(nrows);
+}
+
+
+
+void R2PipelineSharpenStage::
+Produce(int begin, int end)
+{
+  // Extrapolate encoded rows away from blurred rows
+  blurred->Require(begin, end);
+  encoded->Require(begin, end);
+  R2ParallelFor(end - begin, 1, [&](int b, int e) {
+    for (int y = begin + b; y < begin + e; y++) {
+      const R2Pixel *src = encoded->Row(y);
+      R2Pixel *dst = Slot(y);
+      for (int x = 0; x < width; x++) dst[x] = src[x];
+      R2SharpenRow(blurred->Row(y), dst, width, 2.0);
+    }
+  });
+}
+
+
+
+// Resampling of gamma encoded pixels like R2Image::Scale.  Input rows
+// are resampled horizontally into a second ring buffer as they arrive,
+// and output rows weigh the rows there.
+
+class R2PipelineScaleStage : public R2PipelineStage {
+ public:
+  R2PipelineScaleStage(R2PipelineStage *input, double sx, double sy, int sampling_method);
+  virtual const char *Name(void) const { return "scale"; }
+
+ protected:
+  virtual void ReserveInputs(int nrows);
+  virtual void Produce(int begin, int end);
+
+ private:
+  void InputRows(int begin, int end, int *low, int *high) const;
+
+ private:
+  R2PipelineStage *input;
+  R2ResampleFilter xfilter, yfilter;
+  std::vector<char> used;
+  std::vector<R2Pixel> horizontal;
+  int nhorizontal;
+  int hproduced;
+};
+
+
+
+R2PipelineScaleStage::
+R2PipelineScaleStage(R2PipelineStage *input, double sx, double sy, int sampling_method)
+  : R2PipelineStage(lround(sx*input->Width()), lround(sy*input->Height()), R2_IMAGE_GAMMA_TRANSFER),
+    input(input),
+    used(input->Height(), 0),
+    nhorizontal(0),
+    hproduced(0)
+{
+  // Compute filter taps and find input rows that are read
+  assert(input->Transfer() == R2_IMAGE_GAMMA_TRANSFER);
+  R2ResampleWeights(input->Width(), width, sx, sampling_method, xfilter);
+  R2ResampleWeights(input->Height(), height, sy, sampling_method, yfilter);
+  for (unsigned int i = 0; i < yfilter.index.size(); i++) used[yfilter.index[i]] = 1;
+  for (int y = 0; y < height; y++) 
+    if (yfilter.alpha[y] >= 0) used[yfilter.alpha[y]] = 1;
+}
+
+
+
+void R2PipelineScaleStage::
+InputRows(int begin, int end, int *low, int *high) const
+{
+  // Return the range of input rows read by output rows [begin, end)
+  *low = input->Height();
+  *high = 0;
+  for (int y = begin; y < end; y++) {
+    for (int t = 0; t < yfilter.ntaps; t++) {
+      int i = yfilter.index[y*yfilter.ntaps + t];
+      if (i < *low) *low = i;
+      if (i + 1 > *high) *high = i + 1;
+    }
+    int i = yfilter.alpha[y];
+    if ((i >= 0) && (i < *low)) *low = i;
+    if ((i >= 0) && (i + 1 > *high)) *high = i + 1;
+  }
+}
+
+
+
+void R2PipelineScaleStage::
+ReserveInputs(int nrows)
+{
+  // Find the most input rows that nrows consecutive output rows read
+  nhorizontal = 0;
+  for (int y = 0; y + nrows <= height; y++) {
+    int low, high;
+    InputRows(y, y + nrows, &low, &high);
+    if (high - low > nhorizontal) nhorizontal = high - low;
+  }
+  input->Reserve(nhorizontal);
+}
+
+
+
+void R2PipelineScaleStage::
+Produce(int begin, int end)
+{
+  // Resample input rows horizontally that have not been yet
+  int low, high;
+  InputRows(begin, end, &low, &high);
+  int first = (hproduced > low) ? hproduced : low;
+  if (horizontal.empty()) horizontal.resize((size_t) width * nhorizontal);
+  if (first < high) {
+    input->Require(first, high);
+    R2ParallelFor(high - first, 1, [&](int b, int e) {
+      for (int y = first + b; y < first + e; y++) {
+        if (!used[y]) continue;
+        R2ResampleRowHorizontal(input->Row(y), &horizontal[(size_t) width*(y % nhorizontal)], width, xfilter);
+      }
+    });
+    hproduced = high;
+  }
+
+  // Weigh horizontally resampled rows into output rows
+  int ntaps = yfilter.ntaps;
+  R2ParallelFor(end - begin, 1, [&](int b, int e) {
+    std::vector<const R2Pixel *> rows(ntaps);
+    for (int y = begin + b; y < begin + e; y++) {
+      for (int t = 0; t < ntaps; t++) rows[t] = &horizontal[(size_t) width*(yfilter.index[y*ntaps + t] % nhorizontal)];
+      int a = yfilter.alpha[y];
+      const R2Pixel *alpha_row = (a < 0) ? NULL : &horizontal[(size_t) width*(a % nhorizontal)];
+      R2ResampleRowVertical(&rows[0], &yfilter.weight[y*ntaps], ntaps, alpha_row, width, Slot(y));
+    }
+  });
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Stage graph construction
+////////////////////////////////////////////////////////////////////////
+
+static R2PipelineStage *
+ConvertStage(std::vector<R2PipelineStage *>& stages, R2PipelineStage *tail,
+  R2PipelinePointStage *& point, int transfer)
+{
+  // Return tail encoded with transfer, appending the conversion to the
+  // point stage at the tail of the chain if there is one
+  if (tail->Transfer() == transfer) return tail;
+  double exponent = (transfer == R2_IMAGE_LINEAR_TRANSFER) ? R2_IMAGE_GAMMA : 1.0 / R2_IMAGE_GAMMA;
+  R2ImagePointOperation operation = { R2_IMAGE_GAMMA_OPERATION, { exponent, 0, 0 } };
+  if (!point) {
+    point = new R2PipelinePointStage(tail);
+    stages.push_back(point);
+  }
+  point->AddOperation(operation, 0);
+  point->SetTransfer(transfer);
+  return point;
+}
+
+
+
+static int
+StripRows(int width)
+{
+  // Return number of rows per strip (at least one per thread)
+  int nrows = R2_PIPELINE_STRIP_BYTES / (width * sizeof(R2Pixel));
+  if (nrows < R2NumThreads()) nrows = R2NumThreads();
+  if (nrows < 1) nrows = 1;
+  return nrows;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors/Destructors
+////////////////////////////////////////////////////////////////////////
+
+R2Pipeline::
+R2Pipeline(void)
+{
+}
+
+
+
+R2Pipeline::
+~R2Pipeline(void)
+{
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Operations
+////////////////////////////////////////////////////////////////////////
+
+void R2Pipeline::
+AddNode(const R2PipelineNode& node)
+{
+  // Append node
+  nodes.push_back(node);
+}
+
+
+
+void R2Pipeline::
+AddPointOperation(const R2ImagePointOperation& operation)
+{
+  // Per-pixel operation (contrast changes also need the average luminance)
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_POINT_NODE;
+  node.footprint = (operation.type == R2_IMAGE_CONTRAST_OPERATION) ?
+    R2_PIPELINE_REDUCTION_FOOTPRINT : R2_PIPELINE_POINT_FOOTPRINT;
+  node.operation = operation;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+Blur(double sigma)
+{
+  // Gaussian blur, choosing the filter like R2Image::Blur
+  if (sigma == 0) return;
+  if (sigma >= R2_IMAGE_IIR_BLUR_THRESHOLD) {
+    BlurIIR(sigma);
+    return;
+  }
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_BLUR_NODE;
+  node.footprint = R2_PIPELINE_STENCIL_FOOTPRINT;
+  node.radius = (3*sigma < 1) ? 1 : (int) (3*sigma);
+  node.parameters[0] = sigma;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+BlurIIR(double sigma)
+{
+  // Recursive blur runs over whole columns, so it is applied to a whole image
+  if (sigma < 0.5) {
+    Blur(sigma);
+    return;
+  }
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_BLUR_IIR_NODE;
+  node.footprint = R2_PIPELINE_REDUCTION_FOOTPRINT;
+  node.parameters[0] = sigma;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+Sharpen(void)
+{
+  // Unsharp masking with a blur of sigma 2
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_SHARPEN_NODE;
+  node.footprint = R2_PIPELINE_STENCIL_FOOTPRINT;
+  node.radius = 6;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+EdgeDetect(void)
+{
+  // 3x3 edge detection
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_EDGE_NODE;
+  node.footprint = R2_PIPELINE_STENCIL_FOOTPRINT;
+  node.radius = 1;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+Scale(double sx, double sy, int sampling_method)
+{
+  // Resampling by sx and sy (checked again for the image's size when run)
+  if (!R2CheckScale(0, 0, sx, sy)) return;
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_SCALE_NODE;
+  node.footprint = R2_PIPELINE_RESAMPLE_FOOTPRINT;
+  node.parameters[0] = sx;
+  node.parameters[1] = sy;
+  node.sampling_method = sampling_method;
+  AddNode(node);
+}
+
+
+
+void R2Pipeline::
+Crop(int x, int y, int width, int height)
+{
+  // Rectangle with lower-left corner (x,y), clipped to the image
+  R2PipelineNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = R2_PIPELINE_CROP_NODE;
+  node.footprint = R2_PIPELINE_RESAMPLE_FOOTPRINT;
+  node.parameters[0] = x;
+  node.parameters[1] = y;
+  node.parameters[2] = width;
+  node.parameters[3] = height;
+  AddNode(node);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Execution
+////////////////////////////////////////////////////////////////////////
+
+void R2Pipeline::
+Execute(R2Image *image)
+{
+  // Apply nodes in runs that stream through strips of rows.  A run ends
+  // before a contrast change, whose average luminance is summed while its
+  // input is written, and around a recursive blur, which is applied to the
+  // whole image.  A second noise operation also ends a run, so random
+  // numbers are drawn in the same order as by separate AddNoise calls.
+  // Images in planar storage keep the whole-image (float plane) filters.
+  double average = 0;
+  bool averaged = false;
+  int k = 0;
+  while (k < (int) nodes.size()) {
+    const R2PipelineNode& node = nodes[k];
+    if ((image->storage == R2_IMAGE_PLANAR_STORAGE) || (image->npixels == 0) ||
+        (node.type == R2_PIPELINE_BLUR_IIR_NODE)) {
+      // Apply node (or run of point operations) to whole image
+      k = ExecuteNodes(image, k);
+      averaged = false;
+    }
+    else {
+      // Sum luminance for a contrast change at the start of the run if needed
+      if ((node.operation.type == R2_IMAGE_CONTRAST_OPERATION) &&
+          (node.type == R2_PIPELINE_POINT_NODE) && !averaged) {
+        image->ConvertTransfer(R2_IMAGE_GAMMA_TRANSFER);
+        std::vector<double> row_sums(image->height, 0.0);
+        R2ParallelFor(image->height, 1, [&](int begin, int end) {
+          for (int j = begin; j < end; j++) {
+            const R2Pixel *row = &image->pixels[j*image->rowstride];
+            double sum = 0;
+            for (int i = 0; i < image->width; i++) sum += row[i].Luminance();
+            row_sums[j] = sum;
+          }
+        });
+        average = 0;
+        for (int j = 0; j < image->height; j++) average += row_sums[j];
+        average /= image->npixels;
+      }
+
+      // Stream run
+      k = ExecuteSegment(image, k, &average);
+      averaged = true;
+    }
+  }
+
+  // Remove applied nodes
+  nodes.clear();
+}
+
+
+
+int R2Pipeline::
+ExecuteNodes(R2Image *image, int start)
+{
+  // Apply a run of point operations together
+  if (nodes[start].type == R2_PIPELINE_POINT_NODE) {
+    std::vector<R2ImagePointOperation> operations;
+    int k = start;
+    while ((k < (int) nodes.size()) && (nodes[k].type == R2_PIPELINE_POINT_NODE)) 
+      operations.push_back(nodes[k++].operation);
+    image->ApplyPointOperations(&operations[0], operations.size());
+    return k;
+  }
+
+  // Apply one node to the whole image
+  const R2PipelineNode& node = nodes[start];
+  switch (node.type) {
+  case R2_PIPELINE_BLUR_NODE: image->Blur(node.parameters[0]); break;
+  case R2_PIPELINE_BLUR_IIR_NODE: image->BlurIIR(node.parameters[0]); break;
+  case R2_PIPELINE_SHARPEN_NODE: image->Sharpen(); break;
+  case R2_PIPELINE_EDGE_NODE: image->EdgeDetect(); break;
+  case R2_PIPELINE_SCALE_NODE: image->Scale(node.parameters[0], node.parameters[1], node.sampling_method); break;
+  case R2_PIPELINE_CROP_NODE: image->Crop(node.parameters[0], node.parameters[1], node.parameters[2], node.parameters[3]); break;
+  }
+  return start + 1;
+}
+
+
+
+int R2Pipeline::
+ExecuteSegment(R2Image *image, int start, double *average)
+{
+  // Build stages for the run of nodes starting at start
+  std::vector<R2PipelineStage *> stages;
+  R2PipelineStage *tail = new R2PipelineSourceStage(image->pixels, image->width, image->height, image->rowstride, image->transfer);
+  stages.push_back(tail);
+  R2PipelinePointStage *point = NULL;
+  int k = start, nnoise = 0;
+  while (k < (int) nodes.size()) {
+    const R2PipelineNode& node = nodes[k];
+    if (node.type == R2_PIPELINE_BLUR_IIR_NODE) break;
+    if ((k > start) && (node.footprint == R2_PIPELINE_REDUCTION_FOOTPRINT)) break;
+    if ((node.type == R2_PIPELINE_POINT_NODE) && (node.operation.type == R2_IMAGE_NOISE_OPERATION) && (nnoise++ > 0)) break;
+    switch (node.type) {
+    case R2_PIPELINE_POINT_NODE:
+      // Point operations work on gamma encoded pixels
+      tail = ConvertStage(stages, tail, point, R2_IMAGE_GAMMA_TRANSFER);
+      if (!point) {
+        point = new R2PipelinePointStage(tail);
+        stages.push_back(point);
+        tail = point;
+      }
+      point->AddOperation(node.operation, (k == start) ? *average : 0);
+      break;
+
+    case R2_PIPELINE_BLUR_NODE:
+      tail = ConvertStage(stages, tail, point, R2_IMAGE_LINEAR_TRANSFER);
+      tail = new R2PipelineBlurStage(tail, node.parameters[0]);
+      stages.push_back(tail);
+      point = NULL;
+      break;
+
+    case R2_PIPELINE_EDGE_NODE:
+      tail = ConvertStage(stages, tail, point, R2_IMAGE_LINEAR_TRANSFER);
+      tail = new R2PipelineEdgeStage(tail);
+      stages.push_back(tail);
+      point = NULL;
+      break;
+
+    case R2_PIPELINE_SHARPEN_NODE:
+      tail = new R2PipelineSharpenStage(tail);
+      stages.push_back(tail);
+      point = NULL;
+      break;
+
+    case R2_PIPELINE_SCALE_NODE:
+      if (!R2CheckScale(tail->Width(), tail->Height(), node.parameters[0], node.parameters[1])) break;
+      tail = ConvertStage(stages, tail, point, R2_IMAGE_GAMMA_TRANSFER);
+      tail = new R2PipelineScaleStage(tail, node.parameters[0], node.parameters[1], node.sampling_method);
+      stages.push_back(tail);
+      point = NULL;
+      break;
+
+    case R2_PIPELINE_CROP_NODE:
+      tail = new R2PipelineCropStage(tail, node.parameters[0], node.parameters[1], node.parameters[2], node.parameters[3]);
+      stages.push_back(tail);
+      point = NULL;
+      break;
+    }
+    k++;
+  }
+
+  // A contrast change after the run needs the gamma encoded average
+  bool reduce = (k < (int) nodes.size()) && (nodes[k].type == R2_PIPELINE_POINT_NODE) &&
+    (nodes[k].operation.type == R2_IMAGE_CONTRAST_OPERATION);
+  if (reduce) tail = ConvertStage(stages, tail, point, R2_IMAGE_GAMMA_TRANSFER);
+
+  // Pull strips of rows through the stages into the result
+  // (stages are traced as they produce rows, except the source, which has none to produce)
+  R2Image result(tail->Width(), tail->Height());
+  int width = result.width, height = result.height;
+  R2TraceScope trace("pipeline", "ExecuteSegment", width, height,
+    (double) (image->npixels + result.npixels) * sizeof(R2Pixel));
+  std::vector<double> row_sums(height, 0.0);
+  if (width > 0) {
+    int nrows = StripRows(width);
+    tail->Reserve(nrows);
+    for (int begin = 0; begin < height; begin += nrows) {
+      int end = (begin + nrows < height) ? begin + nrows : height;
+      tail->Require(begin, end);
+      R2ParallelFor(end - begin, 1, [&](int b, int e) {
+        for (int y = begin + b; y < begin + e; y++) {
+          const R2Pixel *src = tail->Row(y);
+          R2Pixel *dst = &result.pixels[y*result.rowstride];
+          for (int x = 0; x < width; x++) dst[x] = src[x];
+          if (reduce) {
+            double sum = 0;
+            for (int x = 0; x < width; x++) sum += dst[x].Luminance();
+            row_sums[y] = sum;
+          }
+        }
+      });
+    }
+  }
+  result.transfer = tail->Transfer();
+
+  // Compute average luminance for the contrast change
+  if (reduce) {
+    double avg = 0;
+    for (int j = 0; j < height; j++) avg += row_sums[j];
+    *average = avg / result.npixels;
+  }
+
+  // Delete stages
+  for (unsigned int i = 0; i < stages.size(); i++) delete stages[i];
+
+  // Replace image with result
+  image->Swap(result);
+
+  // Return next node
+  return k;
+}
@@ -0,0 +1,107 @@
+// Include file for lazily evaluated chains of image operations
+#ifndef R2_PIPELINE_INCLUDED
+#define R2_PIPELINE_INCLUDED
+
+#include <vector>
+#include "R2Image.h"
+
+// Constant definitions
+
+typedef enum {
+  R2_PIPELINE_POINT_FOOTPRINT,
+  R2_PIPELINE_STENCIL_FOOTPRINT,
+  R2_PIPELINE_RESAMPLE_FOOTPRINT,
+  R2_PIPELINE_REDUCTION_FOOTPRINT,
+  R2_PIPELINE_NUM_FOOTPRINTS
+} R2PipelineFootprint;
+
+typedef enum {
+  R2_PIPELINE_POINT_NODE,
+  R2_PIPELINE_BLUR_NODE,
+  R2_PIPELINE_BLUR_IIR_NODE,
+  R2_PIPELINE_SHARPEN_NODE,
+  R2_PIPELINE_EDGE_NODE,
+  R2_PIPELINE_SCALE_NODE,
+  R2_PIPELINE_CROP_NODE,
+  R2_PIPELINE_NUM_NODE_TYPES
+} R2PipelineNodeType;
+
+// Each stage computes its output in strips of about this many bytes
+// (so a strip and the halo rows around it stay in a 1-2 MB L2 cache)
+#define R2_PIPELINE_STRIP_BYTES (256 * 1024)
+
+
+
+// One operation of a pipeline, with the input rows it reads for each
+// output row: the same row (point), rows within radius (stencil),
+// rows found through a coordinate map (resample), or all rows (reduction)
+
+struct R2PipelineNode {
+  int type;
+  int footprint;
+  int radius;
+  R2ImagePointOperation operation;
+  double parameters[4];
+  int sampling_method;
+};
+
+
+
+// Class definition
+
+class R2Pipeline {
+ public:
+  // Constructors/destructor
+  R2Pipeline(void);
+  ~R2Pipeline(void);
+
+  // Pipeline properties
+  int NNodes(void) const;
+  const R2PipelineNode& Node(int k) const;
+
+  // Operations, recorded in order and applied by Execute
+  void AddPointOperation(const R2ImagePointOperation& operation);
+  void Blur(double sigma);
+  void BlurIIR(double sigma);
+  void Sharpen(void);
+  void EdgeDetect(void);
+  void Scale(double sx, double sy, int sampling_method);
+  void Crop(int x, int y, int width, int height);
+
+  // Apply the recorded operations to image and remove them from the pipeline.
+  // Runs of operations without reductions stream through strips of rows,
+  // so only the result of each run is allocated at full size.
+  void Execute(R2Image *image);
+
+ private:
+  void AddNode(const R2PipelineNode& node);
+  int ExecuteNodes(R2Image *image, int start);
+  int ExecuteSegment(R2Image *image, int start, double *average);
+
+ private:
+  std::vector<R2PipelineNode> nodes;
+};
+
+
+
+// Inline functions
+
+inline int R2Pipeline::
+NNodes(void) const
+{
+  // Return number of operations not yet applied
+  return nodes.size();
+}
+
+
+
+inline const R2PipelineNode& R2Pipeline::
+Node(int k) const
+{
+  // Return kth operation
+  return nodes[k];
+}
+
+
+
+#endif
@@ -0,0 +1,276 @@
+// Source file for thread pool and parallel loops
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "R2Threads.h"
+#include "R2Trace.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Thread pool
+////////////////////////////////////////////////////////////////////////
+
+// Tiles not yet started by one thread, [head, tail).
+// The owner takes tiles from the head, thieves take them from the tail.
+struct R2ThreadQueue {
+  std::mutex mutex;
+  int head, tail;
+  char padding[64];
+};
+
+
+
+class R2ThreadPool {
+ public:
+  R2ThreadPool(int nthreads);
+  ~R2ThreadPool(void);
+  void Run(int n, int grain, const R2ParallelFunction& function);
+
+ private:
+  void Work(int thread);
+  void Execute(int thread);
+  int NextTile(int thread);
+
+ private:
+  int nthreads;
+  std::vector<std::thread> threads;
+  R2ThreadQueue *queues;
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  unsigned long generation;
+  int nbusy;
+  bool quit;
+  const R2ParallelFunction *function;
+  int n, grain;
+};
+
+
+
+// Set while a thread is running tiles, so nested loops run serially
+static thread_local bool in_parallel = false;
+
+
+
+R2ThreadPool::
+R2ThreadPool(int nthreads)
+  : nthreads(nthreads),
+    queues(new R2ThreadQueue [ nthreads ]),
+    generation(0),
+    nbusy(0),
+    quit(false),
+    function(NULL),
+    n(0),
+    grain(1)
+{
+  // Start worker threads (the calling thread is thread 0)
+  for (int i = 0; i < nthreads; i++) queues[i].head = queues[i].tail = 0;
+  for (int i = 1; i < nthreads; i++)
+    threads.push_back(std::thread(&R2ThreadPool::Work, this, i));
+}
+
+
+
+R2ThreadPool::
+~R2ThreadPool(void)
+{
+  // Stop worker threads
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  start.notify_all();
+  for (unsigned int i = 0; i < threads.size(); i++) threads[i].join();
+  delete [] queues;
+}
+
+
+
+void R2ThreadPool::
+Run(int n, int grain, const R2ParallelFunction& function)
+{
+  // Deal out contiguous runs of tiles to the threads' queues
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->function = &function;
+    this->n = n;
+    this->grain = grain;
+    int ntiles = (n + grain - 1) / grain;
+    for (int i = 0; i < nthreads; i++) {
+      std::lock_guard<std::mutex> queue_lock(queues[i].mutex);
+      queues[i].head = (int) ((long long) i * ntiles / nthreads);
+      queues[i].tail = (int) ((long long) (i+1) * ntiles / nthreads);
+    }
+    nbusy = nthreads - 1;
+    generation++;
+  }
+  start.notify_all();
+
+  // Work along with the pool
+  Execute(0);
+
+  // Wait for the other threads to finish
+  std::unique_lock<std::mutex> lock(mutex);
+  while (nbusy > 0) done.wait(lock);
+  this->function = NULL;
+}
+
+
+
+void R2ThreadPool::
+Work(int thread)
+{
+  // Run tiles of each new loop until the pool is deleted
+  in_parallel = true;
+  unsigned long last_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!quit && (generation == last_generation)) start.wait(lock);
+      if (quit) return;
+      last_generation = generation;
+    }
+    Execute(thread);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--nbusy == 0) done.notify_one();
+    }
+  }
+}
+
+
+
+void R2ThreadPool::
+Execute(int thread)
+{
+  // Run tiles until all queues are empty
+  R2TraceScope trace("threads", "R2ParallelFor tiles");
+  int tile;
+  while ((tile = NextTile(thread)) >= 0) {
+    int begin = tile * grain;
+    int end = (begin + grain < n) ? begin + grain : n;
+    (*function)(begin, end);
+  }
+}
+
+
+
+int R2ThreadPool::
+NextTile(int thread)
+{
+  // Take the next tile from this thread's queue
+  {
+    R2ThreadQueue& queue = queues[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.head < queue.tail) return queue.head++;
+  }
+
+  // Steal the last tile of some other thread's queue
+  for (int i = 1; i < nthreads; i++) {
+    R2ThreadQueue& queue = queues[(thread + i) % nthreads];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.head < queue.tail) return --queue.tail;
+  }
+
+  // Nothing left
+  return -1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Parallel loops
+////////////////////////////////////////////////////////////////////////
+
+static std::mutex pool_mutex;
+static std::mutex num_threads_mutex;
+static R2ThreadPool *pool = NULL;
+static int num_threads = 0;
+
+
+
+int
+R2NumThreads(void)
+{
+  // Initialize number of threads from environment or hardware
+  std::lock_guard<std::mutex> lock(num_threads_mutex);
+  if (num_threads == 0) {
+    const char *value = getenv(R2_THREADS_ENVIRONMENT_VARIABLE);
+    if (value) num_threads = atoi(value);
+    if (num_threads <= 0) num_threads = (int) std::thread::hardware_concurrency();
+    if (num_threads <= 0) num_threads = 1;
+  }
+
+  // Return number of threads
+  return num_threads;
+}
+
+
+
+void
+R2SetNumThreads(int nthreads)
+{
+  // Check number of threads
+  if (nthreads < 1) {
+    fprintf(stderr, "Invalid number of threads (%d)\n", nthreads);
+    return;
+  }
+
+  // Replace pool (a new one is started by the next loop)
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (pool) { delete pool; pool = NULL; }
+  std::lock_guard<std::mutex> num_threads_lock(num_threads_mutex);
+  num_threads = nthreads;
+}
+
+
+
+void
+R2ParallelFor(int n, int grain, const R2ParallelFunction& function)
+{
+  // Check arguments
+  if (n <= 0) return;
+  if (grain < 1) grain = 1;
+
+  // Run serially if nested, small, or single threaded
+  int nthreads = R2NumThreads();
+  if (in_parallel || (n <= grain) || (nthreads == 1)) {
+    function(0, n);
+    return;
+  }
+
+  // Run serially if another thread has the pool
+  std::unique_lock<std::mutex> lock(pool_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    function(0, n);
+    return;
+  }
+
+  // Run tiles on pool
+  if (!pool) pool = new R2ThreadPool(nthreads);
+  in_parallel = true;
+  pool->Run(n, grain, function);
+  in_parallel = false;
+}
+
+
+
+void *
+R2ThreadScratch(int buffer, size_t nbytes)
+{
+  // Grow the calling thread's buffer if needed
+  static thread_local std::vector<double> scratch[R2_THREAD_NUM_SCRATCH_BUFFERS];
+  std::vector<double>& v = scratch[buffer];
+  size_t n = (nbytes + sizeof(double) - 1) / sizeof(double);
+  if (v.size() < n) v.resize(n);
+  return v.empty() ? NULL : &v[0];
+}
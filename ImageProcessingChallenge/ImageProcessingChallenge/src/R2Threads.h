@@ -0,0 +1,46 @@
+// Include file for thread pool and parallel loops
+#ifndef R2_THREADS_INCLUDED
+#define R2_THREADS_INCLUDED
+
+#include <stddef.h>
+#include <functional>
+
+// Constant definitions
+
+// Number of scratch buffers each thread keeps (see R2ThreadScratch)
+#define R2_THREAD_NUM_SCRATCH_BUFFERS 4
+
+// Environment variable with the default number of threads
+#define R2_THREADS_ENVIRONMENT_VARIABLE "R2_NUM_THREADS"
+
+
+
+// Type definitions
+
+// Called for the items [begin, end) of one tile
+typedef std::function<void (int begin, int end)> R2ParallelFunction;
+
+
+
+// Function declarations
+
+// Number of threads used by R2ParallelFor
+// (defaults to $R2_NUM_THREADS, or else the number of cores)
+int R2NumThreads(void);
+void R2SetNumThreads(int nthreads);
+
+// Call function for tiles of grain items covering [0, n).
+// Tiles are dealt out to per-thread queues and idle threads steal
+// from the others, so function must not depend on which thread runs
+// a tile or in what order.  Nested calls (and calls made while another
+// thread is using the pool) run serially on the calling thread.
+void R2ParallelFor(int n, int grain, const R2ParallelFunction& function);
+
+// Return a buffer of at least nbytes owned by the calling thread.
+// Buffers are kept (and grown) between calls, so tiles can use them
+// for temporaries without allocating.  The contents are undefined.
+void *R2ThreadScratch(int buffer, size_t nbytes);
+
+
+
+#endif
@@ -0,0 +1,385 @@
+// Source file for tracing operations
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include "R2Trace.h"
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Recorded events
+////////////////////////////////////////////////////////////////////////
+
+struct R2TraceEvent {
+  const char *category;
+  const char *name;
+  double start, duration;
+  int thread;
+  int width, height;
+  double nbytes;
+};
+
+
+
+std::atomic<bool> r2_trace_enabled(false);
+static std::atomic<bool> trace_recording(false);
+static std::atomic<bool> trace_counting(false);
+static std::mutex trace_mutex;
+static std::vector<R2TraceEvent> trace_events;
+static std::chrono::steady_clock::time_point trace_origin = std::chrono::steady_clock::now();
+static std::atomic<int> trace_nthreads(0);
+
+
+
+static double
+TraceTime(void)
+{
+  // Return microseconds since the program started
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_origin).count();
+}
+
+
+
+static int
+TraceThread(void)
+{
+  // Return small number for the calling thread, in order of first event
+  static thread_local int thread = -1;
+  if (thread < 0) thread = trace_nthreads++;
+  return thread;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Performance counters
+////////////////////////////////////////////////////////////////////////
+
+// Counters read around each scope
+enum {
+  R2_TRACE_CYCLES_COUNTER,
+  R2_TRACE_INSTRUCTIONS_COUNTER,
+  R2_TRACE_CACHE_MISSES_COUNTER,
+  R2_TRACE_NUM_COUNTERS
+};
+
+// Bytes moved from memory by each last level cache miss
+#define R2_TRACE_CACHE_LINE_BYTES 64
+
+
+
+// Counts at the start of an open scope, and the totals of the scopes
+// nested in it (which are subtracted, so each scope reports its own work)
+struct R2TraceFrame {
+  double start;
+  double counts[R2_TRACE_NUM_COUNTERS];
+  double child_time;
+  double child_counts[R2_TRACE_NUM_COUNTERS];
+};
+
+
+
+// Totals for all scopes with one category and name
+struct R2TraceTotals {
+  std::string category, name;
+  int ncalls;
+  double npixels;
+  double seconds;
+  double counts[R2_TRACE_NUM_COUNTERS];
+};
+
+
+
+static int counter_fds[R2_TRACE_NUM_COUNTERS] = { -1, -1, -1 };
+static std::map<std::pair<std::string, std::string>, R2TraceTotals> counter_totals;
+static thread_local std::vector<R2TraceFrame> counter_frames;
+
+
+
+static int
+OpenCounter(int counter)
+{
+#if defined(__linux__)
+  // Count user-space events of this process and the threads it starts
+  // (the generic cache miss event is the last level cache's on most CPUs)
+  static const int configs[R2_TRACE_NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = configs[counter];
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  // No perf_event_open
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+
+static void
+ReadCounters(double counts[R2_TRACE_NUM_COUNTERS])
+{
+  // Read counters, scaled up for the time they were multiplexed out
+  for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) {
+    counts[i] = 0;
+#if defined(__linux__)
+    unsigned long long values[3];
+    if ((counter_fds[i] >= 0) && (read(counter_fds[i], values, sizeof(values)) == sizeof(values)) && (values[2] > 0))
+      counts[i] = (double) values[0] * values[1] / values[2];
+#endif
+  }
+}
+
+
+
+static void
+BeginCounters(void)
+{
+  // Open a frame for a scope on the calling thread
+  R2TraceFrame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.start = TraceTime();
+  ReadCounters(frame.counts);
+  counter_frames.push_back(frame);
+}
+
+
+
+static void
+EndCounters(const char *category, const char *name, int width, int height)
+{
+  // Compute totals for the scope
+  if (counter_frames.empty()) return;
+  R2TraceFrame frame = counter_frames.back();
+  counter_frames.pop_back();
+  double counts[R2_TRACE_NUM_COUNTERS];
+  ReadCounters(counts);
+  double time = TraceTime() - frame.start;
+  for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) counts[i] -= frame.counts[i];
+
+  // Add them to the enclosing scope's nested totals
+  if (!counter_frames.empty()) {
+    R2TraceFrame& parent = counter_frames.back();
+    parent.child_time += time;
+    for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) parent.child_counts[i] += counts[i];
+  }
+
+  // Add the scope's own share to the totals for its name
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  R2TraceTotals& totals = counter_totals[std::make_pair(std::string(category), std::string(name))];
+  if (totals.ncalls++ == 0) {
+    totals.category = category;
+    totals.name = name;
+  }
+  totals.npixels += (double) width * height;
+  totals.seconds += 1.0E-6 * (time - frame.child_time);
+  for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) totals.counts[i] += counts[i] - frame.child_counts[i];
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Scopes
+////////////////////////////////////////////////////////////////////////
+
+void R2TraceScope::
+Begin(void)
+{
+  // Remember start time, and counts unless this marks a thread's tiles
+  start = TraceTime();
+  counted = trace_counting && strcmp(category, "threads");
+  if (counted) BeginCounters();
+}
+
+
+
+void R2TraceScope::
+End(void)
+{
+  // Add counts
+  if (counted) EndCounters(category, name, width, height);
+
+  // Add event
+  if (!trace_recording) return;
+  R2TraceEvent event;
+  event.category = category;
+  event.name = name;
+  event.start = start;
+  event.duration = TraceTime() - start;
+  event.thread = TraceThread();
+  event.width = width;
+  event.height = height;
+  event.nbytes = nbytes;
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events.push_back(event);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Trace files
+////////////////////////////////////////////////////////////////////////
+
+void
+R2StartTrace(void)
+{
+  // Clear events and start recording
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events.clear();
+  trace_recording = true;
+  r2_trace_enabled = true;
+}
+
+
+
+int
+R2WriteTrace(const char *filename)
+{
+  // Stop recording
+  trace_recording = false;
+  r2_trace_enabled = (bool) trace_counting;
+  std::lock_guard<std::mutex> lock(trace_mutex);
+
+  // Open file
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open trace file %s\n", filename);
+    return 0;
+  }
+
+  // Write thread names, then one complete ("X") event per scope
+  // (the first thread to record an event is normally the main thread)
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  const char *separator = "\n";
+  int nthreads = trace_nthreads;
+  for (int i = 0; i < nthreads; i++) {
+    char thread_name[64];
+    if (i == 0) sprintf(thread_name, "main");
+    else sprintf(thread_name, "thread %d", i);
+    fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+      separator, i, thread_name);
+    separator = ",\n";
+  }
+  for (unsigned int i = 0; i < trace_events.size(); i++) {
+    const R2TraceEvent& event = trace_events[i];
+    fprintf(fp, "%s{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+      "\"args\":{\"width\":%d,\"height\":%d,\"bytes\":%.0f}}",
+      separator, event.category, event.name, event.thread, event.start, event.duration,
+      event.width, event.height, event.nbytes);
+    separator = ",\n";
+  }
+  fprintf(fp, "\n]}\n");
+  trace_events.clear();
+
+  // Close file
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Unable to write trace file %s\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Counter reports
+////////////////////////////////////////////////////////////////////////
+
+int
+R2StartPerfCounters(void)
+{
+  // Open counters
+  static const char *names[R2_TRACE_NUM_COUNTERS] = { "cycles", "instructions", "LLC misses" };
+  int ncounters = 0;
+  for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) {
+    counter_fds[i] = OpenCounter(i);
+    if (counter_fds[i] >= 0) ncounters++;
+    else fprintf(stderr, "Performance counter for %s unavailable (%s), not reported\n", names[i], strerror(errno));
+  }
+
+  // Start counting (times are reported even without counters)
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  counter_totals.clear();
+  trace_counting = true;
+  r2_trace_enabled = true;
+
+  // Return number of counters
+  return ncounters;
+}
+
+
+
+int
+R2WritePerfCounters(FILE *fp)
+{
+  // Stop counting
+  trace_counting = false;
+  r2_trace_enabled = (bool) trace_recording;
+  std::lock_guard<std::mutex> lock(trace_mutex);
+
+  // Sort operations by their own time, most first
+  std::vector<R2TraceTotals> totals;
+  for (auto it = counter_totals.begin(); it != counter_totals.end(); ++it) totals.push_back(it->second);
+  std::sort(totals.begin(), totals.end(), [](const R2TraceTotals& a, const R2TraceTotals& b) {
+    return a.seconds > b.seconds;
+  });
+
+  // Write CSV (fields of unavailable counters, and per pixel fields of
+  // operations without an image size, are left empty)
+  fprintf(fp, "category,operation,calls,pixels,seconds,cycles,instructions,llc_misses,ipc,bytes_per_pixel\n");
+  for (unsigned int i = 0; i < totals.size(); i++) {
+    const R2TraceTotals& t = totals[i];
+    fprintf(fp, "%s,%s,%d,%.0f,%.6f", t.category.c_str(), t.name.c_str(), t.ncalls, t.npixels, t.seconds);
+    for (int k = 0; k < R2_TRACE_NUM_COUNTERS; k++) {
+      if (counter_fds[k] >= 0) fprintf(fp, ",%.0f", t.counts[k]);
+      else fprintf(fp, ",");
+    }
+    if ((counter_fds[R2_TRACE_CYCLES_COUNTER] >= 0) && (counter_fds[R2_TRACE_INSTRUCTIONS_COUNTER] >= 0) &&
+        (t.counts[R2_TRACE_CYCLES_COUNTER] > 0))
+      fprintf(fp, ",%.3f", t.counts[R2_TRACE_INSTRUCTIONS_COUNTER] / t.counts[R2_TRACE_CYCLES_COUNTER]);
+    else fprintf(fp, ",");
+    if ((counter_fds[R2_TRACE_CACHE_MISSES_COUNTER] >= 0) && (t.npixels > 0))
+      fprintf(fp, ",%.3f", R2_TRACE_CACHE_LINE_BYTES * t.counts[R2_TRACE_CACHE_MISSES_COUNTER] / t.npixels);
+    else fprintf(fp, ",");
+    fprintf(fp, "\n");
+  }
+  fflush(fp);
+
+  // Close counters
+  for (int i = 0; i < R2_TRACE_NUM_COUNTERS; i++) {
+#if defined(__linux__)
+    if (counter_fds[i] >= 0) close(counter_fds[i]);
+#endif
+    counter_fds[i] = -1;
+  }
+  counter_totals.clear();
+
+  // Return success
+  return 1;
+}
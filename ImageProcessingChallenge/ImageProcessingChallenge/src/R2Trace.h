@@ -0,0 +1,103 @@
+// Include file for tracing operations
+#ifndef R2_TRACE_INCLUDED
+#define R2_TRACE_INCLUDED
+
+#include <stdio.h>
+#include <atomic>
+
+
+
+// Function declarations
+
+// Start recording trace events.  Until then, R2TraceScope only tests a flag.
+void R2StartTrace(void);
+
+// Stop recording and write the events as Chrome trace-event JSON
+// (which chrome://tracing and ui.perfetto.dev display)
+int R2WriteTrace(const char *filename);
+
+// Start counting cycles, instructions and last level cache misses with
+// perf_event_open around each scope.  Call it before the first parallel
+// loop, so the pool threads inherit the counters.  The counts are for
+// the whole process, and each scope is charged its own share (without
+// the scopes nested in it).  Returns the number of counters opened:
+// times are still reported where counters are unavailable.
+int R2StartPerfCounters(void);
+
+// Stop counting and write a CSV line of totals for each operation
+int R2WritePerfCounters(FILE *fp);
+
+// Set while trace events are recorded or counters are read
+extern std::atomic<bool> r2_trace_enabled;
+
+
+
+// Class definition
+
+// Records one event covering the lifetime of the scope on the calling
+// thread, with the image dimensions and the bytes it touches (category
+// and name must be string constants, and a NULL name records nothing).
+// Scopes in the "threads" category mark a thread's tiles and are not counted.
+class R2TraceScope {
+ public:
+  R2TraceScope(const char *category, const char *name, int width = 0, int height = 0, double nbytes = 0);
+  ~R2TraceScope(void);
+  void SetImage(int width, int height, double nbytes);
+
+ private:
+  void Begin(void);
+  void End(void);
+
+ private:
+  const char *category;
+  const char *name;
+  int width, height;
+  double nbytes;
+  double start;
+  bool counted;
+};
+
+
+
+// Inline functions
+
+inline R2TraceScope::
+R2TraceScope(const char *category, const char *name, int width, int height, double nbytes)
+  : category(category),
+    name(NULL),
+    width(width),
+    height(height),
+    nbytes(nbytes),
+    start(0),
+    counted(false)
+{
+  // Record nothing unless tracing
+  if (r2_trace_enabled.load(std::memory_order_relaxed)) {
+    this->name = name;
+    Begin();
+  }
+}
+
+
+
+inline R2TraceScope::
+~R2TraceScope(void)
+{
+  // Record event if it was started
+  if (name) End();
+}
+
+
+
+inline void R2TraceScope::
+SetImage(int width, int height, double nbytes)
+{
+  // Set arguments known only at the end (e.g., after reading an image)
+  this->width = width;
+  this->height = height;
+  this->nbytes = nbytes;
+}
+
+
+
+#endif
@@ -0,0 +1,428 @@
+// Source file for the image benchmark program
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "R2/R2.h"
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2Threads.h"
+
+
+
+// Program arguments
+
+static char usage[] =
+"Usage: imgbench [-option ...] [input_image ...]\n"
+"  -runs <int:n>                      time each operation n times (default 5)\n"
+"  -sizes <real:megapixels>[,...]     also run on synthetic images of these sizes\n"
+"  -json <file:results>               write results as JSON\n"
+"  -csv <file:results>                write results as CSV\n"
+"  -tmpdir <directory>                where codec files are written (default /tmp)\n"
+"  -threads <int:nthreads>\n";
+
+static int nruns = 5;
+static std::vector<double> sizes;
+static const char *json_name = NULL;
+static const char *csv_name = NULL;
+static const char *tmpdir = "/tmp";
+
+
+
+// Results of one benchmark: seconds over the runs, and the pixels and
+// bytes that one run touches (R2Pixels read and written once, plus the
+// encoded file for codecs, so GB/s is a lower bound on the traffic)
+
+struct BenchmarkResult {
+  std::string image;
+  int width, height;
+  std::string operation;
+  int nruns;
+  double min, median, max;
+  double npixels;
+  double nbytes;
+};
+
+static std::vector<BenchmarkResult> results;
+
+
+
+// Timing utilities
+
+static double
+CurrentTime(void)
+{
+  // Return seconds since some fixed point in time
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+
+static void
+Report(const BenchmarkResult& result)
+{
+  // Print median, min and max milliseconds, nanoseconds per pixel and GB/s
+  printf("%-28s %-24s %9.2f %9.2f %9.2f ms %9.2f ns/pixel %7.2f GB/s\n",
+    result.image.c_str(), result.operation.c_str(),
+    1.0E3 * result.median, 1.0E3 * result.min, 1.0E3 * result.max,
+    1.0E9 * result.median / result.npixels, 1.0E-9 * result.nbytes / result.median);
+  fflush(stdout);
+}
+
+
+
+static void
+Benchmark(const char *image_name, const R2Image& image, const char *operation,
+  const std::function<double (R2Image& work)>& function)
+{
+  // Time function on a fresh copy of image nruns times
+  // (function applies the operation and returns the bytes it touches)
+  std::vector<double> seconds;
+  double nbytes = 0;
+  for (int run = 0; run < nruns; run++) {
+    // Copy image outside the timed region (the writable accessor gives
+    // the copy its own pixels, so copy-on-write is not timed either)
+    R2Image work(image);
+    work.Pixels();
+
+    // Time operation
+    double t = CurrentTime();
+    nbytes = function(work);
+    seconds.push_back(CurrentTime() - t);
+  }
+
+  // Remember result
+  std::sort(seconds.begin(), seconds.end());
+  BenchmarkResult result;
+  result.image = image_name;
+  result.width = image.Width();
+  result.height = image.Height();
+  result.operation = operation;
+  result.nruns = nruns;
+  result.min = seconds.front();
+  result.median = (seconds[(nruns - 1) / 2] + seconds[nruns / 2]) / 2;
+  result.max = seconds.back();
+  result.npixels = (double) image.Width() * (double) image.Height();
+  result.nbytes = nbytes;
+  results.push_back(result);
+  Report(result);
+}
+
+
+
+// Benchmarks
+
+static double
+SweepScanlines(const R2Image *image)
+{
+  // Visit pixels along rows (the order they are stored in)
+  double sum = 0;
+  for (int j = 0; j < image->Height(); j++)
+    for (int i = 0; i < image->Width(); i++)
+      sum += image->Pixel(i, j).Luminance();
+  return sum;
+}
+
+
+
+static double
+SweepColumns(const R2Image *image)
+{
+  // Visit pixels down columns (against the storage order)
+  double sum = 0;
+  for (int i = 0; i < image->Width(); i++)
+    for (int j = 0; j < image->Height(); j++)
+      sum += image->Pixel(i, j).Luminance();
+  return sum;
+}
+
+
+
+static double
+FileSize(const char *filename)
+{
+  // Return size of file in bytes
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return 0;
+  fseek(fp, 0, SEEK_END);
+  double size = (double) ftell(fp);
+  fclose(fp);
+  return size;
+}
+
+
+
+static void
+BenchmarkImage(const char *image_name, const R2Image& image)
+{
+  // Time every operation on image
+  printf("%s: %dx%d (%.1f MP)\n", image_name, image.Width(), image.Height(),
+    1.0E-6 * image.Width() * image.Height());
+  double pixel_bytes = (double) image.Width() * image.Height() * sizeof(R2Pixel);
+
+  // Pixel traversal
+  Benchmark(image_name, image, "sweep scanlines", [&](R2Image& work) {
+    volatile double sum = SweepScanlines(&work); (void) sum;
+    return pixel_bytes;
+  });
+  Benchmark(image_name, image, "sweep columns", [&](R2Image& work) {
+    volatile double sum = SweepColumns(&work); (void) sum;
+    return pixel_bytes;
+  });
+
+  // Point operations
+  Benchmark(image_name, image, "brighten 0.9", [&](R2Image& work) {
+    work.Brighten(0.9);
+    return 2 * pixel_bytes;
+  });
+  Benchmark(image_name, image, "contrast 1.5", [&](R2Image& work) {
+    work.ChangeContrast(1.5);
+    return 2 * pixel_bytes;
+  });
+
+  // Linear filters
+  const double sigmas[] = { 0.125, 2, 8 };
+  for (int k = 0; k < 3; k++) {
+    char name[64];
+    sprintf(name, "blur %g", sigmas[k]);
+    Benchmark(image_name, image, name, [&](R2Image& work) {
+      work.Blur(sigmas[k]);
+      return 2 * pixel_bytes;
+    });
+  }
+  Benchmark(image_name, image, "sharpen", [&](R2Image& work) {
+    work.Sharpen();
+    return 2 * pixel_bytes;
+  });
+  Benchmark(image_name, image, "edge", [&](R2Image& work) {
+    work.EdgeDetect();
+    return 2 * pixel_bytes;
+  });
+
+  // Resampling
+  const char *sampling_names[] = { "point", "bilinear", "gaussian", "bicubic", "lanczos" };
+  for (int method = 0; method < R2_IMAGE_NUM_SAMPLING_METHODS; method++) {
+    char name[64];
+    sprintf(name, "scale 0.5 %s", sampling_names[method]);
+    Benchmark(image_name, image, name, [&](R2Image& work) {
+      work.Scale(0.5, 0.5, method);
+      return 1.25 * pixel_bytes;
+    });
+  }
+
+  // Compositing (over a flipped copy, so the two layers differ)
+  R2Image top(R2ImageView(image).FlipVertical());
+  Benchmark(image_name, image, "composite", [&](R2Image& work) {
+    work.Composite(top, R2_IMAGE_OVER_COMPOSITION);
+    return 3 * pixel_bytes;
+  });
+
+  // Codecs
+  const char *extensions[] = { "jpg", "bmp", "ppm", "r2img" };
+  for (int k = 0; k < 4; k++) {
+    char filename[1024], name[64];
+    sprintf(filename, "%s/imgbench.%s", tmpdir, extensions[k]);
+    sprintf(name, "write %s", extensions[k]);
+    Benchmark(image_name, image, name, [&](R2Image& work) {
+      if (!work.Write(filename, 0)) {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        exit(-1);
+      }
+      return pixel_bytes + FileSize(filename);
+    });
+    sprintf(name, "read %s", extensions[k]);
+    Benchmark(image_name, image, name, [&](R2Image& work) {
+      if (!work.Read(filename)) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        exit(-1);
+      }
+
+      // Touch mapped pixels, so paging them in is timed too
+      if (!strcmp(extensions[k], "r2img")) { volatile double sum = SweepScanlines(&work); (void) sum; }
+      return pixel_bytes + FileSize(filename);
+    });
+    remove(filename);
+  }
+}
+
+
+
+static void
+SyntheticImage(R2Image *image, double megapixels)
+{
+  // Fill a 4:3 image of about megapixels with smooth gradients,
+  // edges and fine texture (so codecs and filters do typical work)
+  int height = (int) (sqrt(1.0E6 * megapixels * 3 / 4) + 0.5);
+  int width = (int) (1.0E6 * megapixels / height + 0.5);
+  *image = R2Image(width, height);
+  R2Pixel *pixels = image->Pixels();
+  int rowstride = image->RowStride();
+  R2ParallelFor(height, 1, [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      R2Pixel *row = &pixels[j*rowstride];
+      for (int i = 0; i < width; i++) {
+        unsigned int hash = (unsigned int) (i * 73856093) ^ (unsigned int) (j * 19349663);
+        hash = (hash ^ (hash >> 13)) * 0x5bd1e995;
+        double noise = ((hash >> 8) & 255) / 255.0;
+        double r = 0.5 + 0.4 * sin(0.01 * i) * cos(0.013 * j);
+        double g = (((i / 64) + (j / 64)) & 1) ? 0.8 : 0.2;
+        double b = 0.7 * ((double) j / height) + 0.3 * noise;
+        row[i].Reset(r, g, b, 1);
+      }
+    }
+  });
+}
+
+
+
+// Result files
+
+static std::string
+JSONString(const std::string& s)
+{
+  // Return s as a quoted JSON string
+  std::string quoted = "\"";
+  for (unsigned int i = 0; i < s.size(); i++) {
+    char c = s[i];
+    if ((c == '"') || (c == '\\')) { quoted += '\\'; quoted += c; }
+    else if ((unsigned char) c < 0x20) { char code[8]; sprintf(code, "\\u%04x", c); quoted += code; }
+    else quoted += c;
+  }
+  return quoted + "\"";
+}
+
+
+
+static int
+WriteJSON(const char *filename)
+{
+  // Open file
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open JSON file %s\n", filename);
+    return 0;
+  }
+
+  // Write build and host settings, then one object per result
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"compiler\": %s,\n", JSONString(__VERSION__).c_str());
+  fprintf(fp, "  \"threads\": %d,\n", R2NumThreads());
+  fprintf(fp, "  \"runs\": %d,\n", nruns);
+  fprintf(fp, "  \"results\": [\n");
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const BenchmarkResult& r = results[i];
+    fprintf(fp, "    { \"image\": %s, \"width\": %d, \"height\": %d, \"operation\": %s, \"runs\": %d, "
+      "\"min_s\": %.9g, \"median_s\": %.9g, \"max_s\": %.9g, \"ns_per_pixel\": %.6g, \"gb_per_s\": %.6g }%s\n",
+      JSONString(r.image).c_str(), r.width, r.height, JSONString(r.operation).c_str(), r.nruns,
+      r.min, r.median, r.max, 1.0E9 * r.median / r.npixels, 1.0E-9 * r.nbytes / r.median,
+      (i + 1 < results.size()) ? "," : "");
+  }
+  fprintf(fp, "  ]\n");
+  fprintf(fp, "}\n");
+
+  // Close file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+WriteCSV(const char *filename)
+{
+  // Open file
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open CSV file %s\n", filename);
+    return 0;
+  }
+
+  // Write header and one line per result (image names are quoted)
+  fprintf(fp, "image,width,height,operation,runs,min_s,median_s,max_s,ns_per_pixel,gb_per_s\n");
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const BenchmarkResult& r = results[i];
+    std::string image = r.image;
+    for (size_t k = image.find('"'); k != std::string::npos; k = image.find('"', k + 2)) image.insert(k, "\"");
+    fprintf(fp, "\"%s\",%d,%d,%s,%d,%.9g,%.9g,%.9g,%.6g,%.6g\n",
+      image.c_str(), r.width, r.height, r.operation.c_str(), r.nruns,
+      r.min, r.median, r.max, 1.0E9 * r.median / r.npixels, 1.0E-9 * r.nbytes / r.median);
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+  // Parse arguments
+  std::vector<const char *> input_image_names;
+  for (argc--, argv++; argc > 0; argc--, argv++) {
+    if (!strcmp(*argv, "-help")) { printf("%s", usage); exit(EXIT_SUCCESS); }
+    else if (!strcmp(*argv, "-runs") && (argc > 1)) { argc--; argv++; nruns = atoi(*argv); }
+    else if (!strcmp(*argv, "-json") && (argc > 1)) { argc--; argv++; json_name = *argv; }
+    else if (!strcmp(*argv, "-csv") && (argc > 1)) { argc--; argv++; csv_name = *argv; }
+    else if (!strcmp(*argv, "-tmpdir") && (argc > 1)) { argc--; argv++; tmpdir = *argv; }
+    else if (!strcmp(*argv, "-threads") && (argc > 1)) { argc--; argv++; R2SetNumThreads(atoi(*argv)); }
+    else if (!strcmp(*argv, "-sizes") && (argc > 1)) {
+      argc--; argv++;
+      for (char *s = *argv; *s; ) {
+        double megapixels = strtod(s, &s);
+        if (megapixels > 0) sizes.push_back(megapixels);
+        if (*s) s++;
+      }
+    }
+    else if (**argv == '-') { fprintf(stderr, "Invalid option: %s\n%s", *argv, usage); exit(EXIT_FAILURE); }
+    else input_image_names.push_back(*argv);
+  }
+
+  // Check arguments
+  if ((nruns < 1) || (input_image_names.empty() && sizes.empty())) {
+    fprintf(stderr, "%s", usage);
+    exit(EXIT_FAILURE);
+  }
+
+  // Benchmark input images
+  for (unsigned int i = 0; i < input_image_names.size(); i++) {
+    R2Image image;
+    if (!image.Read(input_image_names[i])) {
+      fprintf(stderr, "Unable to read image from %s\n", input_image_names[i]);
+      exit(-1);
+    }
+    BenchmarkImage(input_image_names[i], image);
+  }
+
+  // Benchmark synthetic images
+  for (unsigned int i = 0; i < sizes.size(); i++) {
+    char name[64];
+    sprintf(name, "synthetic %g MP", sizes[i]);
+    R2Image image;
+    SyntheticImage(&image, sizes[i]);
+    BenchmarkImage(name, image);
+  }
+
+  // Write result files
+  if (json_name && !WriteJSON(json_name)) exit(-1);
+  if (csv_name && !WriteCSV(csv_name)) exit(-1);
+
+  // Return success
+  return EXIT_SUCCESS;
+}
@@ -9,10 +9,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <exception>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if !defined(_WIN32)
+#include <glob.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 #include "R2/R2.h"
 #include "R2Pixel.h"
 #include "R2Image.h"
+#include "R2Pipeline.h"
+#include "R2Threads.h"
+#include "R2Trace.h"
+#include "R2Cache.h"
 
 
 
@@ -22,9 +50,14 @@ static char options[] =
 "  -help\n"
 "\n"
 "  -bilateral <real:domain> <real:range>\n"
+"  -binary_ppm\n"
 "  -blackandwhite \n"
 "  -blur <real:sigma>\n"
+"  -blur_iir <real:sigma>\n"
 "  -brightness <real:factor>\n"
+"  -cache <file:directory>\n"
+"  -cache_size <real:MB>\n"
+"  -cache_statistics\n"
 "  -composite <file:bottom_mask> <file:top_image> <file:top_mask> <int:operation(0=over)>\n"
 "  -contrast <real:factor>\n"
 "  -convolve <file:filter>\n"
@@ -44,35 +77,103 @@ static char options[] =
 "  -point_sampling\n"
 "  -bilinear_sampling\n"
 "  -gaussian_sampling\n"
+"  -bicubic_sampling\n"
+"  -lanczos_sampling\n"
+"  -perfcounters\n"
+"  -pixel_storage\n"
+"  -planar_storage\n"
+"  -pool_statistics\n"
 "  -saturation <real:factor>\n"
 "  -scale <real:sx> <real:sy>\n"
 "  -seamcarve <int:width> <int:height>\n"
 "  -sharpen\n"
+"  -threads <int:nthreads>\n"
+"  -trace <file:trace.json>\n"
 "  -vignette <real:inner_radius> <real:outer_radius>\n"
 "  -whitebalance <read:red> <real:green> <real:blue>\n";
 
 
 
 static void 
-ShowUsage(void)
+PrintUsage(void)
 {
-  // Print usage message and exit
+  // Print usage message
   fprintf(stderr, "Usage: imgpro input_image output_image [  -option [arg ...] ...]\n");
+  fprintf(stderr, "       imgpro --batch <file:list or glob> --out-dir <directory> [--jobs <int:n>] [--memory <real:MB>] [  -option [arg ...] ...]\n");
+  fprintf(stderr, "       imgpro --serve <file:socket> [--jobs <int:n>] [--max-megapixels <real:n>]\n");
+  fprintf(stderr, "       imgpro --client <file:socket> [--send-path] input_image output_image [  -option [arg ...] ...]\n");
   fprintf(stderr, "%s", options);
-  exit(EXIT_FAILURE);
 }
 
 
 
 static void 
+ShowUsage(void)
+{
+  // Print usage message and exit
+  PrintUsage();
+  exit(EXIT_FAILURE);
+}
+
+
+
+static int 
 CheckOption(char *option, int argc, int minargc)
 {
   // Check if there are enough remaining arguments for option
   if (argc < minargc)  {
     fprintf(stderr, "Too few arguments for %s\n", option);
-    ShowUsage();
-    exit(-1);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+ValidScaleFactors(double sx, double sy)
+{
+  // Return whether scale factors are positive and finite (NaN is neither)
+  return (sx > 0) && (sy > 0) && isfinite(sx) && isfinite(sy);
+}
+
+
+
+static void
+AddPointOperation(R2Pipeline& pipeline, int type, 
+  double parameter0 = 0, double parameter1 = 0, double parameter2 = 0)
+{
+  // Queue a per-pixel operation (applied when the pipeline is executed)
+  R2ImagePointOperation operation = { type, { parameter0, parameter1, parameter2 } };
+  pipeline.AddPointOperation(operation);
+}
+
+
+
+static char **
+LeadingScale(int argc, char **argv, int *sampling_method)
+{
+  // Return the -scale option if it is the first operation
+  // (so that it can be applied while reading the input image)
+  *sampling_method = R2_IMAGE_POINT_SAMPLING;
+  while (argc > 0) {
+    if (!strcmp(*argv, "-point_sampling")) *sampling_method = R2_IMAGE_POINT_SAMPLING;
+    else if (!strcmp(*argv, "-bilinear_sampling")) *sampling_method = R2_IMAGE_BILINEAR_SAMPLING;
+    else if (!strcmp(*argv, "-gaussian_sampling")) *sampling_method = R2_IMAGE_GAUSSIAN_SAMPLING;
+    else if (!strcmp(*argv, "-bicubic_sampling")) *sampling_method = R2_IMAGE_BICUBIC_SAMPLING;
+    else if (!strcmp(*argv, "-lanczos_sampling")) *sampling_method = R2_IMAGE_LANCZOS_SAMPLING;
+    else if (!strcmp(*argv, "-threads") && (argc >= 2)) { argv++, argc--; }
+    else if (!strcmp(*argv, "-trace") && (argc >= 2)) { argv++, argc--; }
+    else if (!strcmp(*argv, "-cache") && (argc >= 2)) { argv++, argc--; }
+    else if (!strcmp(*argv, "-cache_size") && (argc >= 2)) { argv++, argc--; }
+    else if (!strcmp(*argv, "-scale") && (argc >= 3)) return (ValidScaleFactors(atof(argv[1]), atof(argv[2]))) ? argv : NULL;
+    else if (strcmp(*argv, "-binary_ppm") && strcmp(*argv, "-pool_statistics") && strcmp(*argv, "-perfcounters") &&
+             strcmp(*argv, "-cache_statistics")) return NULL;
+    argv++, argc--;
   }
+  return NULL;
 }
 
 
@@ -132,123 +233,511 @@ CheckOption(char *option, int argc, int minargc)
 
 
 
-int 
-main(int argc, char **argv)
+static int
+ApplyOperations(R2Image *image, int argc, char **argv, char **leading_scale)
 {
-  // Look for help
-  for (int i = 0; i < argc; i++) {
-    if (!strcmp(argv[i], "-help")) {
-      ShowUsage();
-    }
-  }
-
-  // Read input and output image filenames
-  if (argc < 3)  ShowUsage();
-  argv++, argc--; // First argument is program name
-  char *input_image_name = *argv; argv++, argc--; 
-  char *output_image_name = *argv; argv++, argc--; 
-
-  // Allocate image
-  R2Image *image = new R2Image();
-  if (!image) {
-    fprintf(stderr, "Unable to allocate image\n");
-    exit(-1);
-  }
-
-  // Read input image
-  if (!image->Read(input_image_name)) {
-    fprintf(stderr, "Unable to read image from %s\n", input_image_name);
-    exit(-1);
-  }
+  // Apply the operations in argv to image (leading_scale points at a
+  // -scale that was already applied while reading, if any), returning
+  // 0 for invalid operations instead of exiting
 
   // Initialize sampling method
   int sampling_method = R2_IMAGE_POINT_SAMPLING;
 
-  // Parse arguments and perform operations 
+  // Operations are queued and then streamed through the image together
+  // (only compositing and storage changes apply them immediately)
+  R2Pipeline pipeline;
+
+  // Parse arguments and queue operations 
   while (argc > 0) {
-    if (!strcmp(*argv, "-blur")) {
-      CheckOption(*argv, argc, 2);
-      double sigma = atof(argv[1]);
-      argv += 2; argc -= 2;
-      image->Blur(sigma);
+    // Queue operation
+    if (!strcmp(*argv, "-blackandwhite")) {
+      argv++, argc--;
+      AddPointOperation(pipeline, R2_IMAGE_BLACKANDWHITE_OPERATION);
     }
     else if (!strcmp(*argv, "-brightness")) {
-      CheckOption(*argv, argc, 2);
+      if (!CheckOption(*argv, argc, 2)) return 0;
       double factor = atof(argv[1]);
       argv += 2; argc -=2;
-      image->Brighten(factor);
-    }
-    else if (!strcmp(*argv, "-composite")) {
-      CheckOption(*argv, argc, 5);
-      R2Image *bottom_mask = new R2Image(argv[1]);
-      R2Image *top_image = new R2Image(argv[2]);
-      R2Image *top_mask = new R2Image(argv[3]);
-      int operation = atoi(argv[4]);
-      argv += 5; argc -= 5;
-      image->CopyChannel(*bottom_mask, R2_IMAGE_BLUE_CHANNEL, R2_IMAGE_ALPHA_CHANNEL);
-      top_image->CopyChannel(*top_mask, R2_IMAGE_BLUE_CHANNEL, R2_IMAGE_ALPHA_CHANNEL);
-      image->Composite(*top_image, operation);
-      delete top_image;
-      delete bottom_mask;
-      delete top_mask;
+      AddPointOperation(pipeline, R2_IMAGE_BRIGHTNESS_OPERATION, factor);
     }
     else if (!strcmp(*argv, "-contrast")) {
-      CheckOption(*argv, argc, 2);
+      if (!CheckOption(*argv, argc, 2)) return 0;
       double factor = atof(argv[1]);
       argv += 2; argc -= 2;
-      image->ChangeContrast(factor);
+      AddPointOperation(pipeline, R2_IMAGE_CONTRAST_OPERATION, factor);
     }
-    else if (!strcmp(*argv, "-edge")) {
-      argv++, argc--;
-      image->EdgeDetect();
-    } 
     else if (!strcmp(*argv, "-extract")) {
-      CheckOption(*argv, argc, 2);
+      if (!CheckOption(*argv, argc, 2)) return 0;
       int channel = atoi(argv[1]);
       argv += 2; argc -= 2;
-      image->ExtractChannel(channel);
+      AddPointOperation(pipeline, R2_IMAGE_EXTRACT_OPERATION, channel);
+    }
+    else if (!strcmp(*argv, "-gamma")) {
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      double exponent = atof(argv[1]);
+      argv += 2; argc -= 2;
+      if (exponent < 0) {
+        fprintf(stderr, "Gamma exponent (%f) negative\n", exponent);
+        return 0;
+      }
+      AddPointOperation(pipeline, R2_IMAGE_GAMMA_OPERATION, exponent);
     }
     else if (!strcmp(*argv, "-noise")) {
-      CheckOption(*argv, argc, 2);
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      double factor = atof(argv[1]);
+      argv += 2; argc -= 2;
+      AddPointOperation(pipeline, R2_IMAGE_NOISE_OPERATION, factor);
+    }
+    else if (!strcmp(*argv, "-quantize")) {
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      int nbits = atoi(argv[1]);
+      argv += 2; argc -= 2;
+      if ((nbits < 1) || (nbits > 16)) {
+        fprintf(stderr, "Invalid number of bits for quantization (%d)\n", nbits);
+        return 0;
+      }
+      AddPointOperation(pipeline, R2_IMAGE_QUANTIZE_OPERATION, nbits);
+    }
+    else if (!strcmp(*argv, "-saturation")) {
+      if (!CheckOption(*argv, argc, 2)) return 0;
       double factor = atof(argv[1]);
       argv += 2; argc -= 2;
-      image->AddNoise(factor);
+      AddPointOperation(pipeline, R2_IMAGE_SATURATION_OPERATION, factor);
+    }
+    else if (!strcmp(*argv, "-whitebalance")) {
+      if (!CheckOption(*argv, argc, 4)) return 0;
+      double red = atof(argv[1]);
+      double green = atof(argv[2]);
+      double blue = atof(argv[3]);
+      argv += 4; argc -= 4;
+      if ((red <= 0) || (green <= 0) || (blue <= 0)) {
+        fprintf(stderr, "Invalid white balance color (%g %g %g)\n", red, green, blue);
+        return 0;
+      }
+      AddPointOperation(pipeline, R2_IMAGE_WHITEBALANCE_OPERATION, red, green, blue);
+    }
+    else if (!strcmp(*argv, "-binary_ppm") || !strcmp(*argv, "-pool_statistics") || !strcmp(*argv, "-cache_statistics")) {
+      // Already set before reading the input image
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      argv += 1; argc -= 1;
+    }
+    else if (!strcmp(*argv, "-perfcounters")) {
+      // Already started before reading the input image
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      argv += 1; argc -= 1;
+    }
+    else if (!strcmp(*argv, "-threads")) {
+      // Already set before reading the input image
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      argv += 2; argc -= 2;
+    }
+    else if (!strcmp(*argv, "-trace")) {
+      // Already started before reading the input image
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      argv += 2; argc -= 2;
+    }
+    else if (!strcmp(*argv, "-cache") || !strcmp(*argv, "-cache_size")) {
+      // Already opened before reading the input image
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      argv += 2; argc -= 2;
     }
     else if (!strcmp(*argv, "-point_sampling")) {
-      CheckOption(*argv, argc, 1);
+      if (!CheckOption(*argv, argc, 1)) return 0;
       sampling_method = R2_IMAGE_POINT_SAMPLING;
       argv += 1; argc -= 1;
     }
     else if (!strcmp(*argv, "-bilinear_sampling")) {
-      CheckOption(*argv, argc, 1);
+      if (!CheckOption(*argv, argc, 1)) return 0;
       sampling_method = R2_IMAGE_BILINEAR_SAMPLING;
       argv += 1; argc -= 1;
     }
     else if (!strcmp(*argv, "-gaussian_sampling")) {
-      CheckOption(*argv, argc, 1);
+      if (!CheckOption(*argv, argc, 1)) return 0;
       sampling_method = R2_IMAGE_GAUSSIAN_SAMPLING;
       argv += 1; argc -= 1;
     }
+    else if (!strcmp(*argv, "-bicubic_sampling")) {
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      sampling_method = R2_IMAGE_BICUBIC_SAMPLING;
+      argv += 1; argc -= 1;
+    }
+    else if (!strcmp(*argv, "-lanczos_sampling")) {
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      sampling_method = R2_IMAGE_LANCZOS_SAMPLING;
+      argv += 1; argc -= 1;
+    }
+    else if (!strcmp(*argv, "-blur")) {
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      double sigma = atof(argv[1]);
+      argv += 2; argc -= 2;
+      if (!(sigma >= 0) || !isfinite(sigma)) {
+        fprintf(stderr, "Invalid blur sigma (%g)\n", sigma);
+        return 0;
+      }
+      pipeline.Blur(sigma);
+    }
+    else if (!strcmp(*argv, "-blur_iir")) {
+      // (large sigmas are clamped by BlurIIR, whose cost does not grow with them)
+      if (!CheckOption(*argv, argc, 2)) return 0;
+      double sigma = atof(argv[1]);
+      argv += 2; argc -= 2;
+      if (!(sigma >= 0) || !isfinite(sigma)) {
+        fprintf(stderr, "Invalid blur sigma (%g)\n", sigma);
+        return 0;
+      }
+      pipeline.BlurIIR(sigma);
+    }
+    else if (!strcmp(*argv, "-composite")) {
+      if (!CheckOption(*argv, argc, 5)) return 0;
+      R2Image *bottom_mask = new R2Image();
+      R2Image *top_image = new R2Image();
+      R2Image *top_mask = new R2Image();
+      int status = bottom_mask->Read(argv[1]) && top_image->Read(argv[2]) && top_mask->Read(argv[3]);
+      int operation = atoi(argv[4]);
+      argv += 5; argc -= 5;
+      pipeline.Execute(image);
+      if (!status) {
+        fprintf(stderr, "Unable to read composite images\n");
+      }
+      else if ((bottom_mask->Width() != image->Width()) || (bottom_mask->Height() != image->Height()) ||
+          (top_mask->Width() != top_image->Width()) || (top_mask->Height() != top_image->Height())) {
+        fprintf(stderr, "Composite masks do not match the size of their images\n");
+        status = 0;
+      }
+      if (status) {
+        image->CopyChannel(*bottom_mask, R2_IMAGE_BLUE_CHANNEL, R2_IMAGE_ALPHA_CHANNEL);
+        top_image->CopyChannel(*top_mask, R2_IMAGE_BLUE_CHANNEL, R2_IMAGE_ALPHA_CHANNEL);
+        image->Composite(*top_image, operation);
+      }
+      delete top_image;
+      delete bottom_mask;
+      delete top_mask;
+      if (!status) return 0;
+    }
+    else if (!strcmp(*argv, "-crop")) {
+      if (!CheckOption(*argv, argc, 5)) return 0;
+      int x = atoi(argv[1]);
+      int y = atoi(argv[2]);
+      int width = atoi(argv[3]);
+      int height = atoi(argv[4]);
+      argv += 5; argc -= 5;
+      pipeline.Crop(x, y, width, height);
+    }
+    else if (!strcmp(*argv, "-edge")) {
+      argv++, argc--;
+      pipeline.EdgeDetect();
+    } 
+    else if (!strcmp(*argv, "-pixel_storage")) {
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      pipeline.Execute(image);
+      image->SetStorage(R2_IMAGE_PIXEL_STORAGE);
+      argv += 1; argc -= 1;
+    }
+    else if (!strcmp(*argv, "-planar_storage")) {
+      if (!CheckOption(*argv, argc, 1)) return 0;
+      pipeline.Execute(image);
+      image->SetStorage(R2_IMAGE_PLANAR_STORAGE);
+      argv += 1; argc -= 1;
+    }
     else if (!strcmp(*argv, "-scale")) {
-      CheckOption(*argv, argc, 3);
+      if (!CheckOption(*argv, argc, 3)) return 0;
       double sx = atof(argv[1]);
       double sy = atof(argv[2]);
+      int applied = (argv == leading_scale);
       argv += 3; argc -= 3;
-      image->Scale(sx, sy, sampling_method);
+      if (!ValidScaleFactors(sx, sy)) {
+        fprintf(stderr, "Invalid scale factors (%g %g)\n", sx, sy);
+        return 0;
+      }
+      if (!applied) pipeline.Scale(sx, sy, sampling_method);
     }
     else if (!strcmp(*argv, "-sharpen")) {
       argv++, argc--;
-      image->Sharpen();
+      pipeline.Sharpen();
     }
     else {
       // Unrecognized program argument
       fprintf(stderr, "image: invalid option: %s\n", *argv);
-      ShowUsage();
+      PrintUsage();
+      return 0;
     }
   }
 
-  // Write output image
-  if (!image->Write(output_image_name)) {
+  // Apply queued operations
+  pipeline.Execute(image);
+
+  // Return success
+  return 1;
+}
+
+
+
+// Results
+// With -cache, encoded results are kept in an R2Cache keyed by the input
+// bytes and a canonical description of the operations and output format,
+// so that a repeated request skips decoding and processing.
+
+// Change when the output of any operation or encoder changes
+// (so that results from earlier versions are not found)
+#define CACHE_VERSION 1
+
+// Arguments of each operation that can be cached, in order: real numbers
+// (r), integers (i), files (f, described by their contents) or skipped (s).
+// Options that do not change the result have a NULL description, and
+// sampling methods are described with the scales they apply to.
+static const struct {
+  const char *name;
+  const char *arguments;
+  const char *description;
+} cached_operations[] = {
+  { "-blackandwhite", "", "blackandwhite" },
+  { "-brightness", "r", "brightness" },
+  { "-contrast", "r", "contrast" },
+  { "-extract", "i", "extract" },
+  { "-gamma", "r", "gamma" },
+  { "-quantize", "i", "quantize" },
+  { "-saturation", "r", "saturation" },
+  { "-whitebalance", "rrr", "whitebalance" },
+  { "-blur", "r", "blur" },
+  { "-blur_iir", "r", "blur_iir" },
+  { "-composite", "fffi", "composite" },
+  { "-crop", "iiii", "crop" },
+  { "-edge", "", "edge" },
+  { "-pixel_storage", "", "pixel_storage" },
+  { "-planar_storage", "", "planar_storage" },
+  { "-scale", "rr", "scale" },
+  { "-sharpen", "", "sharpen" },
+  { "-binary_ppm", "", NULL },
+  { "-cache", "s", NULL },
+  { "-cache_size", "s", NULL },
+  { "-cache_statistics", "", NULL },
+  { "-perfcounters", "", NULL },
+  { "-pool_statistics", "", NULL },
+  { "-threads", "s", NULL },
+  { "-trace", "s", NULL },
+};
+
+
+
+static const char *
+OutputFormat(const char *filename)
+{
+  // Return the format of an output filename that can be encoded in memory
+  const char *extension = strrchr(filename, '.');
+  if (!extension) return NULL;
+  if (!strcmp(extension, ".jpg") || !strcmp(extension, ".jpeg")) return "jpg";
+  if (!strcmp(extension, ".bmp")) return "bmp";
+  if (!strcmp(extension, ".ppm")) return "ppm";
+  return NULL;
+}
+
+
+
+static int
+ReadFileBytes(const char *filename, std::vector<uint8_t>& data)
+{
+  // Open file
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open file: %s\n", filename);
+    return 0;
+  }
+
+  // Read contents
+  data.clear();
+  unsigned char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) data.insert(data.end(), buffer, buffer + n);
+  int status = !ferror(fp);
+
+  // Close file
+  fclose(fp);
+
+  // Return status
+  return status;
+}
+
+
+
+static int
+WriteFileBytes(const char *filename, const std::vector<uint8_t>& data)
+{
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open file: %s\n", filename);
+    return 0;
+  }
+
+  // Write contents
+  int status = data.empty() || (fwrite(data.data(), 1, data.size(), fp) == data.size());
+
+  // Close file
+  if (fclose(fp) != 0) status = 0;
+
+  // Return status
+  return status;
+}
+
+
+
+static int
+EncodeImage(const R2Image& image, const char *format, int ascii_ppm, std::vector<uint8_t>& data)
+{
+  // Encode image in format (as returned by OutputFormat)
+  if (!format) return 0;
+  if (!strcmp(format, "jpg") || !strcmp(format, "jpeg")) return image.WriteJPEGToMemory(data);
+  if (!strcmp(format, "bmp")) return image.WriteBMPToMemory(data);
+  if (!strcmp(format, "ppm")) return image.WritePPMToMemory(data, ascii_ppm);
+  return 0;
+}
+
+
+
+static int
+DescribeOperations(int argc, char **argv, const char *format, int ascii_ppm, std::string& description)
+{
+  // Describe operations and output format in a canonical form, with
+  // numbers as they are parsed.  Returns 0 if the result cannot be cached
+  // (unknown or random operations, or unreadable files).
+  char buffer[128];
+  sprintf(buffer, "imgpro %d\n%s%s\n", CACHE_VERSION, format, 
+    (!strcmp(format, "ppm")) ? ((ascii_ppm) ? " ascii" : " binary") : "");
+  description = buffer;
+  const char *sampling_method = "point";
+  while (argc > 0) {
+    // Sampling methods apply to the scales that follow
+    if (!strcmp(*argv, "-point_sampling")) { sampling_method = "point"; argv++, argc--; continue; }
+    if (!strcmp(*argv, "-bilinear_sampling")) { sampling_method = "bilinear"; argv++, argc--; continue; }
+    if (!strcmp(*argv, "-gaussian_sampling")) { sampling_method = "gaussian"; argv++, argc--; continue; }
+    if (!strcmp(*argv, "-bicubic_sampling")) { sampling_method = "bicubic"; argv++, argc--; continue; }
+    if (!strcmp(*argv, "-lanczos_sampling")) { sampling_method = "lanczos"; argv++, argc--; continue; }
+
+    // Find operation
+    int k = 0;
+    int noperations = sizeof(cached_operations) / sizeof(cached_operations[0]);
+    while ((k < noperations) && strcmp(*argv, cached_operations[k].name)) k++;
+    if (k == noperations) return 0;
+    const char *arguments = cached_operations[k].arguments;
+    int narguments = strlen(arguments);
+    if (argc < narguments + 1) return 0;
+
+    // Describe operation and its arguments
+    if (cached_operations[k].description) {
+      description += cached_operations[k].description;
+      for (int i = 0; i < narguments; i++) {
+        const char *argument = argv[i + 1];
+        if (arguments[i] == 'r') sprintf(buffer, " %.17g", atof(argument));
+        else if (arguments[i] == 'i') sprintf(buffer, " %d", atoi(argument));
+        else {
+          std::vector<uint8_t> data;
+          if (!ReadFileBytes(argument, data)) return 0;
+          sprintf(buffer, " %s", R2Cache::Key("", data.data(), data.size()).c_str());
+        }
+        description += buffer;
+      }
+      if (!strcmp(*argv, "-scale")) description += std::string(" ") + sampling_method;
+      description += "\n";
+    }
+    argv += narguments + 1;
+    argc -= narguments + 1;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+FindCachedResult(R2Cache *cache, const char *input_name, const std::vector<uint8_t> *input_data,
+  const char *format, int argc, char **argv, int ascii_ppm, std::string& key, std::vector<uint8_t>& result)
+{
+  // Find result in cache, setting key to where it should be inserted 
+  // (left empty if it cannot be cached).  The input is input_data, or 
+  // the contents of input_name if input_data is NULL.
+  key.clear();
+  std::string description;
+  if (!cache || !cache->IsValid() || !format) return 0;
+  if (!DescribeOperations(argc, argv, format, ascii_ppm, description)) return 0;
+  std::vector<uint8_t> data;
+  if (!input_data) {
+    if (!ReadFileBytes(input_name, data)) return 0;
+    input_data = &data;
+  }
+  key = R2Cache::Key(description, input_data->data(), input_data->size());
+  return cache->Find(key, result);
+}
+
+
+
+static int
+WriteResult(const R2Image& image, const char *output_name, int ascii_ppm, R2Cache *cache, const std::string& key)
+{
+  // Write image, encoding it in memory to insert it into the cache
+  if (key.empty()) return image.Write(output_name, ascii_ppm);
+  std::vector<uint8_t> data;
+  if (!EncodeImage(image, OutputFormat(output_name), ascii_ppm, data)) return 0;
+  cache->Insert(key, data);
+  return WriteFileBytes(output_name, data);
+}
+
+
+
+static void
+PrintCacheStatistics(R2Cache *cache)
+{
+  // Print counts for this process
+  if (!cache) return;
+  R2CacheStatistics statistics = cache->Statistics();
+  size_t nlookups = statistics.nhits + statistics.nmisses;
+  fprintf(stderr, "Result cache: %lu hits, %lu misses (%.1f%% hits), %lu inserted, %lu evicted, %.1f MB\n",
+    (unsigned long) statistics.nhits, (unsigned long) statistics.nmisses,
+    (nlookups > 0) ? 100.0 * statistics.nhits / nlookups : 0.0,
+    (unsigned long) statistics.ninserts, (unsigned long) statistics.nevictions,
+    statistics.nbytes / 1048576.0);
+}
+
+
+
+static int
+ProcessImage(char *input_image_name, char *output_image_name, int argc, char **argv, int ascii_ppm, R2Cache *cache)
+{
+  // Write a cached result without decoding
+  std::string cache_key;
+  std::vector<uint8_t> result;
+  if (FindCachedResult(cache, input_image_name, NULL, OutputFormat(output_image_name), 
+        argc, argv, ascii_ppm, cache_key, result)) {
+    if (!WriteFileBytes(output_image_name, result)) {
+      fprintf(stderr, "Unable to write image to %s\n", output_image_name);
+      exit(-1);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Allocate image
+  R2Image *image = new R2Image();
+  if (!image) {
+    fprintf(stderr, "Unable to allocate image\n");
+    exit(-1);
+  }
+
+  // Read input image (applying a leading downscale while decoding JPEGs)
+  int leading_sampling_method;
+  char **leading_scale = LeadingScale(argc, argv, &leading_sampling_method);
+  int read_status = (leading_scale) ?
+    image->Read(input_image_name, atof(leading_scale[1]), atof(leading_scale[2]), leading_sampling_method) :
+    image->Read(input_image_name);
+  if (!read_status) {
+    fprintf(stderr, "Unable to read image from %s\n", input_image_name);
+    exit(-1);
+  }
+
+  // Apply operations
+  if (!ApplyOperations(image, argc, argv, leading_scale)) exit(-1);
+
+  // Write output image (inserting it into the cache)
+  if (!WriteResult(*image, output_image_name, ascii_ppm, cache, cache_key)) {
     fprintf(stderr, "Unable to write image to %s\n", output_image_name);
     exit(-1);
   }
@@ -262,3 +751,863 @@ main(int argc, char **argv)
 
 
 
+// Batch processing
+// Images pass through three stages, read, process and write, run by a
+// pool of workers.  Each worker takes the image furthest along (so images
+// in flight finish and free their memory first), and otherwise starts
+// reading the largest unread image if its estimated memory fits.
+
+// Memory held by an image in flight, in copies of its R2Pixels
+// (the image, the pipeline's result and its row buffers or temporaries)
+#define BATCH_MEMORY_PER_PIXEL (3 * sizeof(R2Pixel))
+
+// Memory for images in flight if not given, when physical memory is unknown
+#define BATCH_DEFAULT_MEMORY_LIMIT ((size_t) 1 << 30)
+
+
+
+struct BatchImage {
+  std::string input_name;
+  std::string output_name;
+  std::string cache_key;
+  double npixels;
+  size_t nbytes;
+  R2Image *image;
+};
+
+
+
+struct BatchQueues {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<BatchImage *> unread;
+  std::deque<BatchImage *> read;
+  std::deque<BatchImage *> processed;
+  R2Cache *cache;
+  size_t memory_limit;
+  size_t memory_used;
+  int nflight;
+  int nfailed;
+};
+
+
+
+static int
+BatchInputNames(const char *list, std::vector<std::string>& names)
+{
+  // Expand a glob pattern
+  if (strpbrk(list, "*?[")) {
+#if defined(_WIN32)
+    fprintf(stderr, "Glob patterns are not supported here, use a list file: %s\n", list);
+    return 0;
+#else
+    glob_t matches;
+    if (glob(list, 0, NULL, &matches) != 0) {
+      fprintf(stderr, "No files match %s\n", list);
+      return 0;
+    }
+    for (size_t i = 0; i < matches.gl_pathc; i++) names.push_back(matches.gl_pathv[i]);
+    globfree(&matches);
+    return 1;
+#endif
+  }
+
+  // Open list file
+  FILE *fp = fopen(list, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open batch list %s\n", list);
+    return 0;
+  }
+
+  // Read one filename per line (skipping blank lines and # comments)
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    int n = strlen(buffer);
+    while ((n > 0) && isspace((unsigned char) buffer[n-1])) buffer[--n] = '\0';
+    char *name = buffer;
+    while (isspace((unsigned char) *name)) name++;
+    if ((*name == '\0') || (*name == '#')) continue;
+    names.push_back(name);
+  }
+
+  // Close list file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+static void
+RunBatchWorker(BatchQueues *queues, int argc, char **argv, int ascii_ppm)
+{
+  // Find a leading scale to apply while reading
+  int leading_sampling_method;
+  char **leading_scale = LeadingScale(argc, argv, &leading_sampling_method);
+
+  // Run stages until all images are written
+  std::unique_lock<std::mutex> lock(queues->mutex);
+  while (true) {
+    // Take the image furthest along, or admit the largest unread one
+    BatchImage *item = NULL;
+    int stage = 0;
+    if (!queues->processed.empty()) {
+      item = queues->processed.front();
+      queues->processed.pop_front();
+      stage = 2;
+    }
+    else if (!queues->read.empty()) {
+      item = queues->read.front();
+      queues->read.pop_front();
+      stage = 1;
+    }
+    else if (!queues->unread.empty() && ((queues->nflight == 0) ||
+      (queues->memory_used + queues->unread.back()->nbytes <= queues->memory_limit))) {
+      item = queues->unread.back();
+      queues->unread.pop_back();
+      queues->memory_used += item->nbytes;
+      queues->nflight++;
+      stage = 0;
+    }
+    else if (queues->unread.empty() && (queues->nflight == 0)) {
+      return;
+    }
+    else {
+      queues->changed.wait(lock);
+      continue;
+    }
+
+    // Run stage without the lock (writing a cached result skips the rest)
+    lock.unlock();
+    int status = 1;
+    int cached = 0;
+    if (stage == 0) {
+      std::vector<uint8_t> result;
+      if (FindCachedResult(queues->cache, item->input_name.c_str(), NULL, OutputFormat(item->output_name.c_str()), 
+            argc, argv, ascii_ppm, item->cache_key, result)) {
+        cached = 1;
+        status = WriteFileBytes(item->output_name.c_str(), result);
+        if (!status) fprintf(stderr, "Unable to write image to %s\n", item->output_name.c_str());
+      }
+      else {
+        item->image = new R2Image();
+        status = (leading_scale) ?
+          item->image->Read(item->input_name.c_str(), atof(leading_scale[1]), atof(leading_scale[2]), leading_sampling_method) :
+          item->image->Read(item->input_name.c_str());
+        if (!status) fprintf(stderr, "Unable to read image from %s\n", item->input_name.c_str());
+      }
+    }
+    else if (stage == 1) {
+      status = ApplyOperations(item->image, argc, argv, leading_scale);
+    }
+    else {
+      status = WriteResult(*item->image, item->output_name.c_str(), ascii_ppm, queues->cache, item->cache_key);
+      if (!status) fprintf(stderr, "Unable to write image to %s\n", item->output_name.c_str());
+    }
+    lock.lock();
+
+    // Pass image to the next stage, or release it
+    if (status && !cached && (stage == 0)) queues->read.push_back(item);
+    else if (status && (stage == 1)) queues->processed.push_back(item);
+    else {
+      if (!status) queues->nfailed++;
+      delete item->image;
+      item->image = NULL;
+      queues->memory_used -= item->nbytes;
+      queues->nflight--;
+    }
+    queues->changed.notify_all();
+  }
+}
+
+
+
+static int
+ProcessBatch(int argc, char **argv, int ascii_ppm, R2Cache *cache)
+{
+  // Parse batch options (the rest are operations)
+  const char *list = NULL;
+  const char *output_directory = NULL;
+  int nworkers = R2NumThreads();
+  size_t memory_limit = 0;
+  while (argc > 0) {
+    if (!strcmp(*argv, "--batch")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); list = argv[1]; }
+    else if (!strcmp(*argv, "--out-dir")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); output_directory = argv[1]; }
+    else if (!strcmp(*argv, "--jobs")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); nworkers = atoi(argv[1]); }
+    else if (!strcmp(*argv, "--memory")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); memory_limit = (size_t) (atof(argv[1]) * 1048576.0); }
+    else break;
+    argv += 2; argc -= 2;
+  }
+  if (!list || !output_directory || (nworkers < 1)) ShowUsage();
+
+  // Default to half of physical memory for images in flight
+  if (memory_limit == 0) {
+    memory_limit = BATCH_DEFAULT_MEMORY_LIMIT;
+#if !defined(_WIN32)
+    long npages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if ((npages > 0) && (page_size > 0)) memory_limit = (size_t) npages * (size_t) page_size / 2;
+#endif
+  }
+
+  // Get input filenames
+  std::vector<std::string> input_names;
+  if (!BatchInputNames(list, input_names)) return EXIT_FAILURE;
+  double start_time = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  // Name outputs after inputs, refusing to run if two inputs have the
+  // same basename (one output would overwrite the other)
+  std::vector<std::string> output_names;
+  std::map<std::string, std::string> output_inputs;
+  int nduplicates = 0;
+  for (unsigned int i = 0; i < input_names.size(); i++) {
+    const char *input_name = input_names[i].c_str();
+    const char *basename = strrchr(input_name, '/');
+    basename = (basename) ? basename + 1 : input_name;
+    output_names.push_back(std::string(output_directory) + "/" + basename);
+    std::map<std::string, std::string>::iterator it = output_inputs.find(output_names.back());
+    if (it != output_inputs.end()) {
+      fprintf(stderr, "Inputs %s and %s would both be written to %s\n",
+        it->second.c_str(), input_name, output_names.back().c_str());
+      nduplicates++;
+    }
+    else {
+      output_inputs[output_names.back()] = input_names[i];
+    }
+  }
+  if (nduplicates > 0) return EXIT_FAILURE;
+
+  // Read image sizes from headers
+  // (images whose headers cannot be read fail here, before any decoding)
+  std::vector<BatchImage> images;
+  int nfailed = 0;
+  for (unsigned int i = 0; i < input_names.size(); i++) {
+    const char *input_name = input_names[i].c_str();
+    int width, height;
+    if (!R2Image::ReadSize(input_name, &width, &height)) {
+      fprintf(stderr, "Unable to read image size from %s\n", input_name);
+      nfailed++;
+      continue;
+    }
+    images.push_back(BatchImage());
+    BatchImage& item = images.back();
+    item.input_name = input_names[i];
+    item.output_name = output_names[i];
+    item.npixels = (double) width * height;
+    item.nbytes = (size_t) (item.npixels * BATCH_MEMORY_PER_PIXEL);
+    item.image = NULL;
+  }
+
+  // Queue images with the largest last (taken first)
+  BatchQueues queues;
+  for (unsigned int i = 0; i < images.size(); i++) queues.unread.push_back(&images[i]);
+  std::stable_sort(queues.unread.begin(), queues.unread.end(), [](const BatchImage *a, const BatchImage *b) {
+    return a->npixels < b->npixels;
+  });
+  queues.cache = cache;
+  queues.memory_limit = memory_limit;
+  queues.memory_used = 0;
+  queues.nflight = 0;
+  queues.nfailed = nfailed;
+
+  // Run workers
+  std::vector<std::thread> workers;
+  for (int i = 0; i < nworkers; i++)
+    workers.push_back(std::thread(RunBatchWorker, &queues, argc, argv, ascii_ppm));
+  for (int i = 0; i < nworkers; i++) workers[i].join();
+
+  // Print summary
+  double end_time = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  fprintf(stderr, "Batch: %d images, %d failed, %.2f seconds\n",
+    (int) input_names.size(), queues.nfailed, end_time - start_time);
+
+  // Return status
+  return (queues.nfailed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+// Server
+// A daemon listens on a Unix domain socket and runs jobs in its own
+// process, so the thread pool, the image buffer pool, the lookup tables
+// and each worker's request and reply buffers stay warm between jobs.
+// Each of --jobs workers accepts a connection and serves its requests in
+// turn, so at most that many jobs run at once and further clients wait
+// in the listen queue.  SIGUSR1 prints result cache statistics, and
+// SIGINT or SIGTERM stops accepting, lets running jobs reply, and
+// removes the socket.  Jobs are checked before decoding: the input, the
+// images read by -composite, and the result of each -scale must have
+// readable headers and at most --max-megapixels pixels, so that one bad
+// job fails instead of taking the daemon down.
+//
+// Requests and replies on the socket (integers are little endian):
+//   request: uint32 nbytes and nbytes of NUL-terminated arguments,
+//            then uint64 ndata and ndata bytes of input
+//     argument 0 is the input, "-" for the bytes that follow (JPEG, BMP
+//       or PPM), or a path for the daemon to read (and ndata is 0)
+//     argument 1 is the output format (jpg, bmp or ppm)
+//     the rest are imgpro options
+//   reply: uint32 status (0 for success), then uint64 ndata and ndata
+//          bytes of the encoded output image (or of an error message)
+
+// Largest request accepted
+#define SERVER_MAX_ARGUMENT_BYTES ((uint64_t) 1 << 20)
+#define SERVER_MAX_DATA_BYTES ((uint64_t) 1 << 30)
+
+// Largest image a job can read or make when no --max-megapixels is given
+#define SERVER_DEFAULT_MAX_MEGAPIXELS 256
+
+
+
+#if !defined(_WIN32)
+
+struct ServerState {
+  R2Cache *cache;
+  double max_pixels;
+  int listen_fd;
+  std::mutex mutex;
+  std::vector<int> connections;
+  bool stopping;
+};
+
+
+
+static int
+ReadSocket(int fd, void *buffer, size_t size)
+{
+  // Read size bytes (returning 0 at end of file or on error)
+  char *p = (char *) buffer;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return 0;
+    p += n;
+    size -= n;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+WriteSocket(int fd, const void *buffer, size_t size)
+{
+  // Write size bytes
+  const char *p = (const char *) buffer;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return 0;
+    p += n;
+    size -= n;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+ReadSocketInteger(int fd, uint64_t *value, int nbytes)
+{
+  // Read little endian integer
+  unsigned char buffer[8];
+  if (!ReadSocket(fd, buffer, nbytes)) return 0;
+  *value = 0;
+  for (int i = nbytes - 1; i >= 0; i--) *value = (*value << 8) | buffer[i];
+  return 1;
+}
+
+
+
+static int
+WriteSocketInteger(int fd, uint64_t value, int nbytes)
+{
+  // Write little endian integer
+  unsigned char buffer[8];
+  for (int i = 0; i < nbytes; i++) buffer[i] = (unsigned char) (value >> (8 * i));
+  return WriteSocket(fd, buffer, nbytes);
+}
+
+
+
+static int
+ReadMessage(int fd, int nbytes, uint64_t max_size, std::vector<uint8_t>& data)
+{
+  // Read length (of nbytes) and then that many bytes
+  uint64_t size;
+  if (!ReadSocketInteger(fd, &size, nbytes)) return 0;
+  if (size > max_size) {
+    fprintf(stderr, "Message of %.0f bytes is too large\n", (double) size);
+    return 0;
+  }
+  data.resize(size);
+  return (size == 0) || ReadSocket(fd, data.data(), size);
+}
+
+
+
+static int
+WriteMessage(int fd, int nbytes, const void *data, size_t size)
+{
+  // Write length (of nbytes) and then the data
+  if (!WriteSocketInteger(fd, size, nbytes)) return 0;
+  return (size == 0) || WriteSocket(fd, data, size);
+}
+
+
+
+static const char *
+CheckServerJobSize(int width, int height, int argc, char **argv, double max_pixels)
+{
+  // Return why a job with a width x height input should not be run, or
+  // NULL (a -crop bounds the size, each -scale multiplies it)
+  double npixels = (double) width * height;
+  if (npixels > max_pixels) return "Input image is larger than the server allows";
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-crop") && (i + 4 < argc)) {
+      double crop_pixels = fabs((double) atoi(argv[i+3]) * atoi(argv[i+4]));
+      if (crop_pixels < npixels) npixels = crop_pixels;
+      i += 4;
+    }
+    else if (!strcmp(argv[i], "-scale") && (i + 2 < argc)) {
+      if (!ValidScaleFactors(atof(argv[i+1]), atof(argv[i+2]))) return "Invalid scale factors";
+      npixels *= atof(argv[i+1]) * atof(argv[i+2]);
+      if (npixels > max_pixels) return "Scaled image is larger than the server allows";
+      i += 2;
+    }
+    else if (!strcmp(argv[i], "-composite") && (i + 4 < argc)) {
+      for (int k = 1; k <= 3; k++) {
+        int composite_width, composite_height;
+        if (!R2Image::ReadSize(argv[i+k], &composite_width, &composite_height)) 
+          return "Unable to read size of composite image";
+        if ((double) composite_width * composite_height > max_pixels) 
+          return "Composite image is larger than the server allows";
+      }
+      i += 4;
+    }
+  }
+  return NULL;
+}
+
+
+
+static int
+RunServerJob(R2Cache *cache, double max_pixels, std::vector<uint8_t>& arguments, const std::vector<uint8_t>& data, std::vector<uint8_t>& reply)
+{
+  // Split arguments (reply holds an error message if the job fails)
+  std::vector<char *> args;
+  const char *error = NULL;
+  if (arguments.empty() || (arguments.back() != '\0')) error = "Arguments are not NUL-terminated";
+  for (size_t i = 0; i < arguments.size(); i += strlen((char *) &arguments[i]) + 1) 
+    args.push_back((char *) &arguments[i]);
+  if (!error && (args.size() < 2)) error = "Missing input or output format";
+  if (error) {
+    reply.assign((const uint8_t *) error, (const uint8_t *) error + strlen(error));
+    return 0;
+  }
+  const char *input_name = args[0];
+  const char *format = (!strcmp(args[1], "jpeg")) ? "jpg" : args[1];
+  int argc = args.size() - 2;
+  char **argv = args.data() + 2;
+
+  // Set output options
+  int ascii_ppm = 1;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-binary_ppm")) ascii_ppm = 0;
+  }
+
+  // Return a cached result without decoding
+  int from_memory = !strcmp(input_name, "-");
+  std::string key;
+  if (!strcmp(format, "jpg") || !strcmp(format, "bmp") || !strcmp(format, "ppm")) {
+    if (FindCachedResult(cache, input_name, (from_memory) ? &data : NULL, format, argc, argv, ascii_ppm, key, reply)) return 1;
+  }
+
+  // Check the header and the sizes the job reads and makes before decoding
+  int width, height;
+  int status = (from_memory) ?
+    R2Image::ReadSizeFromMemory(data.data(), data.size(), &width, &height) :
+    R2Image::ReadSize(input_name, &width, &height);
+  if (!status) error = "Unable to read image size from input";
+  else error = CheckServerJobSize(width, height, argc, argv, max_pixels);
+
+  // Read input image (applying a leading downscale while decoding JPEGs)
+  R2Image image;
+  int leading_sampling_method;
+  char **leading_scale = LeadingScale(argc, argv, &leading_sampling_method);
+  if (!error && from_memory) {
+    if (data[0] == 'B') status = image.ReadBMPFromMemory(data.data(), data.size());
+    else if (data[0] == 'P') status = image.ReadPPMFromMemory(data.data(), data.size());
+    else if (leading_scale) status = image.ReadJPEGFromMemory(data.data(), data.size(), 
+      atof(leading_scale[1]), atof(leading_scale[2]), leading_sampling_method);
+    else status = image.ReadJPEGFromMemory(data.data(), data.size());
+    if (data[0] != 0xFF) leading_scale = NULL;
+    if (!status) error = "Unable to read input image";
+  }
+  else if (!error) {
+    status = (leading_scale) ?
+      image.Read(input_name, atof(leading_scale[1]), atof(leading_scale[2]), leading_sampling_method) :
+      image.Read(input_name);
+    if (!status) error = "Unable to read input image";
+  }
+
+  // Apply operations
+  if (!error && !ApplyOperations(&image, argc, argv, leading_scale)) error = "Invalid operations";
+
+  // Encode output image (and insert it into the cache)
+  if (!error) {
+    if (strcmp(format, "jpg") && strcmp(format, "bmp") && strcmp(format, "ppm")) error = "Unknown output format";
+    else if (!EncodeImage(image, format, ascii_ppm, reply)) error = "Unable to write output image";
+    else if (!key.empty()) cache->Insert(key, reply);
+  }
+
+  // Return error message
+  if (error) {
+    reply.assign((const uint8_t *) error, (const uint8_t *) error + strlen(error));
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static void
+RunServerWorker(ServerState *state)
+{
+  // Buffers are kept (and reused) across connections
+  std::vector<uint8_t> arguments, data, reply;
+
+  // Serve connections until the listening socket is shut down
+  while (true) {
+    int fd = accept(state->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+      return;
+    }
+
+    // Remember connection (so that stopping can end it)
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->stopping) { close(fd); return; }
+      state->connections.push_back(fd);
+    }
+
+    // Serve requests until the client closes the connection
+    while (ReadMessage(fd, 4, SERVER_MAX_ARGUMENT_BYTES, arguments) && 
+           ReadMessage(fd, 8, SERVER_MAX_DATA_BYTES, data)) {
+      // (a job that throws fails alone instead of ending the daemon)
+      int status = 0;
+      try {
+        status = RunServerJob(state->cache, state->max_pixels, arguments, data, reply);
+      }
+      catch (const std::exception& exception) {
+        std::string error = std::string("Unexpected exception: ") + exception.what();
+        reply.assign(error.begin(), error.end());
+      }
+      if (!status) fprintf(stderr, "Job failed: %.*s\n", (int) reply.size(), (const char *) reply.data());
+      if (!WriteSocketInteger(fd, (status) ? 0 : 1, 4)) break;
+      if (!WriteMessage(fd, 8, reply.data(), reply.size())) break;
+    }
+
+    // Close connection
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->connections.erase(std::find(state->connections.begin(), state->connections.end(), fd));
+    }
+    close(fd);
+  }
+}
+
+
+
+static int
+OpenSocketAddress(const char *socket_name, struct sockaddr_un *address)
+{
+  // Fill in address for socket_name
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "Socket name is too long: %s\n", socket_name);
+    return -1;
+  }
+  strcpy(address->sun_path, socket_name);
+
+  // Create socket
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+  return fd;
+}
+
+#endif
+
+
+
+static int
+Serve(int argc, char **argv, R2Cache *cache)
+{
+  // Parse server options
+  const char *socket_name = NULL;
+  int nworkers = R2NumThreads();
+  double max_megapixels = SERVER_DEFAULT_MAX_MEGAPIXELS;
+  while (argc > 0) {
+    if (!strcmp(*argv, "--serve")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); socket_name = argv[1]; }
+    else if (!strcmp(*argv, "--jobs")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); nworkers = atoi(argv[1]); }
+    else if (!strcmp(*argv, "--max-megapixels")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); max_megapixels = atof(argv[1]); }
+    else break;
+    argv += 2; argc -= 2;
+  }
+  if (!socket_name || (nworkers < 1) || (max_megapixels <= 0)) ShowUsage();
+
+#if defined(_WIN32)
+  fprintf(stderr, "Serving over Unix domain sockets is not supported here\n");
+  return EXIT_FAILURE;
+#else
+  // Create socket
+  struct sockaddr_un address;
+  ServerState state;
+  state.cache = cache;
+  state.max_pixels = 1e6 * max_megapixels;
+  state.listen_fd = OpenSocketAddress(socket_name, &address);
+  state.stopping = false;
+  if (state.listen_fd < 0) return EXIT_FAILURE;
+
+  // Replace a socket left by an earlier server (but no other file)
+  struct stat status;
+  if ((stat(socket_name, &status) == 0) && S_ISSOCK(status.st_mode)) unlink(socket_name);
+
+  // Listen on socket
+  if ((bind(state.listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0) ||
+      (listen(state.listen_fd, SOMAXCONN) < 0)) {
+    fprintf(stderr, "Unable to listen on %s: %s\n", socket_name, strerror(errno));
+    close(state.listen_fd);
+    return EXIT_FAILURE;
+  }
+
+  // Handle termination signals in this thread only (and let writes to 
+  // closed connections fail instead of raising SIGPIPE)
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start workers
+  fprintf(stderr, "Serving on %s with %d jobs\n", socket_name, nworkers);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < nworkers; i++) workers.push_back(std::thread(RunServerWorker, &state));
+
+  // Wait for a termination signal (printing statistics when asked)
+  int signal_number;
+  while ((sigwait(&signals, &signal_number) == 0) && (signal_number == SIGUSR1)) {
+    if (cache) PrintCacheStatistics(cache);
+    else fprintf(stderr, "Result cache is not enabled (see -cache)\n");
+  }
+
+  // Stop accepting, and end connections after their running jobs reply
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.stopping = true;
+    shutdown(state.listen_fd, SHUT_RDWR);
+    for (unsigned int i = 0; i < state.connections.size(); i++) shutdown(state.connections[i], SHUT_RD);
+  }
+  for (int i = 0; i < nworkers; i++) workers[i].join();
+
+  // Remove socket
+  close(state.listen_fd);
+  unlink(socket_name);
+
+  // Return success
+  return EXIT_SUCCESS;
+#endif
+}
+
+
+
+static int
+RunClient(int argc, char **argv)
+{
+  // Parse client options (the rest are the images and operations)
+  const char *socket_name = NULL;
+  int send_path = 0;
+  while (argc > 0) {
+    if (!strcmp(*argv, "--client")) { if (!CheckOption(*argv, argc, 2)) ShowUsage(); socket_name = argv[1]; argv += 2; argc -= 2; }
+    else if (!strcmp(*argv, "--send-path")) { send_path = 1; argv++, argc--; }
+    else break;
+  }
+  if (!socket_name || (argc < 2)) ShowUsage();
+  const char *input_image_name = argv[0];
+  const char *output_image_name = argv[1];
+  argv += 2; argc -= 2;
+
+#if defined(_WIN32)
+  fprintf(stderr, "Connecting over Unix domain sockets is not supported here\n");
+  return EXIT_FAILURE;
+#else
+  // Output format is the output filename's extension
+  const char *format = strrchr(output_image_name, '.');
+  if (!format) {
+    fprintf(stderr, "Output file has no extension (e.g., .jpg).\n");
+    return EXIT_FAILURE;
+  }
+
+  // Build arguments (the daemon reads a path relative to its own directory)
+  std::vector<uint8_t> arguments, data;
+  char path[PATH_MAX];
+  if (send_path && !realpath(input_image_name, path)) {
+    fprintf(stderr, "Unable to find %s\n", input_image_name);
+    return EXIT_FAILURE;
+  }
+  const char *input = (send_path) ? path : "-";
+  arguments.insert(arguments.end(), input, input + strlen(input) + 1);
+  arguments.insert(arguments.end(), format + 1, format + strlen(format) + 1);
+  for (int i = 0; i < argc; i++) arguments.insert(arguments.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+
+  // Read input image bytes
+  if (!send_path && !ReadFileBytes(input_image_name, data)) return EXIT_FAILURE;
+
+  // Connect to daemon
+  struct sockaddr_un address;
+  int fd = OpenSocketAddress(socket_name, &address);
+  if (fd < 0) return EXIT_FAILURE;
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "Unable to connect to %s: %s\n", socket_name, strerror(errno));
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  // Send request and read reply
+  uint64_t status;
+  std::vector<uint8_t> reply;
+  if (!WriteMessage(fd, 4, arguments.data(), arguments.size()) ||
+      !WriteMessage(fd, 8, data.data(), data.size()) ||
+      !ReadSocketInteger(fd, &status, 4) ||
+      !ReadMessage(fd, 8, SERVER_MAX_DATA_BYTES, reply)) {
+    fprintf(stderr, "Lost connection to %s\n", socket_name);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  // Check status
+  if (status != 0) {
+    fprintf(stderr, "%.*s\n", (int) reply.size(), (const char *) reply.data());
+    return EXIT_FAILURE;
+  }
+
+  // Write output image
+  if (!WriteFileBytes(output_image_name, reply)) {
+    fprintf(stderr, "Unable to write image to %s\n", output_image_name);
+    return EXIT_FAILURE;
+  }
+
+  // Return success
+  return EXIT_SUCCESS;
+#endif
+}
+
+
+
+int 
+main(int argc, char **argv)
+{
+  // Look for help
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-help")) {
+      ShowUsage();
+    }
+  }
+
+  // Set number of threads before reading (default from $R2_NUM_THREADS)
+  for (int i = 0; i < argc - 1; i++) {
+    if (!strcmp(argv[i], "-threads")) {
+      R2SetNumThreads(atoi(argv[i+1]));
+    }
+  }
+
+  // Start tracing before reading (written when done)
+  const char *trace_name = NULL;
+  for (int i = 0; i < argc - 1; i++) {
+    if (!strcmp(argv[i], "-trace")) {
+      trace_name = argv[i+1];
+      R2StartTrace();
+    }
+  }
+
+  // Start performance counters before the thread pool starts (reported when done)
+  int print_perf_counters = 0;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-perfcounters")) {
+      print_perf_counters = 1;
+      R2StartPerfCounters();
+    }
+  }
+
+  // Set output options
+  int ascii_ppm = 1;
+  int print_pool_statistics = 0;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-binary_ppm")) ascii_ppm = 0;
+    else if (!strcmp(argv[i], "-pool_statistics")) print_pool_statistics = 1;
+  }
+
+  // Open result cache (except for a client, whose options go to the server)
+  const char *cache_name = NULL;
+  size_t cache_size = R2_CACHE_DEFAULT_MAX_BYTES;
+  int print_cache_statistics = 0;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-cache") && (i < argc - 1)) cache_name = argv[i+1];
+    else if (!strcmp(argv[i], "-cache_size") && (i < argc - 1)) cache_size = (size_t) (atof(argv[i+1]) * 1048576.0);
+    else if (!strcmp(argv[i], "-cache_statistics")) print_cache_statistics = 1;
+  }
+  R2Cache *cache = NULL;
+  if (cache_name && ((argc < 2) || strcmp(argv[1], "--client"))) {
+    cache = new R2Cache(cache_name, cache_size);
+    if (!cache->IsValid()) exit(-1);
+  }
+
+  // Serve jobs, send one to a server, process a batch of images, or one image
+  int status = EXIT_SUCCESS;
+  if ((argc > 1) && !strcmp(argv[1], "--serve")) {
+    status = Serve(argc - 1, argv + 1, cache);
+  }
+  else if ((argc > 1) && !strcmp(argv[1], "--client")) {
+    status = RunClient(argc - 1, argv + 1);
+  }
+  else if ((argc > 1) && !strncmp(argv[1], "--", 2)) {
+    status = ProcessBatch(argc - 1, argv + 1, ascii_ppm, cache);
+  }
+  else {
+    if (argc < 3)  ShowUsage();
+    status = ProcessImage(argv[1], argv[2], argc - 3, argv + 3, ascii_ppm, cache);
+  }
+
+  // Write trace
+  if (trace_name && !R2WriteTrace(trace_name)) exit(-1);
+
+  // Print performance counters (as CSV on stdout)
+  if (print_perf_counters) R2WritePerfCounters(stdout);
+
+  // Print pool statistics
+  if (print_pool_statistics) {
+    R2ImagePoolStatistics statistics = R2GetImagePoolStatistics();
+    fprintf(stderr, "Image pool: %.1f MB high water, %.1f MB kept, %lu hits, %lu misses\n",
+      statistics.high_water_bytes / 1048576.0, statistics.idle_bytes / 1048576.0,
+      (unsigned long) statistics.nhits, (unsigned long) statistics.nmisses);
+  }
+
+  // Print result cache statistics
+  if (print_cache_statistics) PrintCacheStatistics(cache);
+  delete cache;
+
+  // Return status
+  return status;
+}
@@ -0,0 +1,235 @@
+/*
+ * jdatamem.c
+ *
+ * This file is written in the style of the Independent JPEG Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains data source and destination routines for the case of
+ * reading JPEG data from, and writing it to, a buffer in memory.  They are
+ * the in-memory counterparts of jdatasrc.c and jdatadst.c.
+ */
+
+/* this is not a core library module, so it doesn't define JPEG_INTERNALS */
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jerror.h"
+
+/* Expanded data source object for memory input */
+
+typedef struct {
+  struct jpeg_source_mgr pub;	/* public fields */
+
+  const JOCTET * data;		/* start of the caller's buffer */
+  size_t size;			/* number of bytes in it */
+} mem_source_mgr;
+
+typedef mem_source_mgr * mem_src_ptr;
+
+
+/*
+ * Initialize source --- called by jpeg_read_header
+ * before any data is actually read.
+ */
+
+METHODDEF(void)
+init_mem_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+/*
+ * Fill the input buffer --- called whenever buffer is emptied.
+ *
+ * The whole image is in the buffer from the start, so this is only called
+ * if the data is truncated.  As in jdatasrc.c, we warn and insert a fake
+ * EOI marker, so that the image decodes to whatever was there.
+ */
+
+METHODDEF(jboolean)
+fill_mem_input_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET eoi_buffer[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = eoi_buffer;
+  cinfo->src->bytes_in_buffer = 2;
+
+  return TRUE;
+}
+
+
+/*
+ * Skip data --- used to skip over a potentially large amount of
+ * uninteresting data (such as an APPn marker).
+ */
+
+METHODDEF(void)
+skip_mem_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr * src = cinfo->src;
+
+  if (num_bytes > 0) {
+    while (num_bytes > (long) src->bytes_in_buffer) {
+      num_bytes -= (long) src->bytes_in_buffer;
+      (void) fill_mem_input_buffer(cinfo);
+    }
+    src->next_input_byte += (size_t) num_bytes;
+    src->bytes_in_buffer -= (size_t) num_bytes;
+  }
+}
+
+
+/*
+ * Terminate source --- called by jpeg_finish_decompress
+ * after all data has been read.
+ */
+
+METHODDEF(void)
+term_mem_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+/*
+ * Prepare for input from a buffer in memory.
+ * The caller must keep the buffer unchanged until decompression is done.
+ */
+
+GLOBAL(void)
+jpeg_memory_src (j_decompress_ptr cinfo, const JOCTET * data, size_t size)
+{
+  mem_src_ptr src;
+
+  if (cinfo->src == NULL) {	/* first time for this JPEG object? */
+    cinfo->src = (struct jpeg_source_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  SIZEOF(mem_source_mgr));
+  }
+
+  src = (mem_src_ptr) cinfo->src;
+  src->pub.init_source = init_mem_source;
+  src->pub.fill_input_buffer = fill_mem_input_buffer;
+  src->pub.skip_input_data = skip_mem_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart; /* use default method */
+  src->pub.term_source = term_mem_source;
+  src->data = data;
+  src->size = size;
+  src->pub.bytes_in_buffer = size;
+  src->pub.next_input_byte = data;
+}
+
+
+/* Expanded data destination object for memory output */
+
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  JOCTET ** outbuffer;		/* where to store the malloc'd result */
+  size_t * outsize;		/* where to store its size */
+  JOCTET * buffer;		/* start of buffer */
+  size_t bufsize;		/* allocated size of buffer */
+} mem_destination_mgr;
+
+typedef mem_destination_mgr * mem_dest_ptr;
+
+#define OUTPUT_BUF_SIZE  65536	/* initial size of the output buffer */
+
+
+/*
+ * Initialize destination --- called by jpeg_start_compress
+ * before any data is actually written.
+ * The caller's pointer follows the buffer from here on, so that the
+ * caller frees it even if compression stops with an error.
+ */
+
+METHODDEF(void)
+init_mem_destination (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+
+  dest->bufsize = OUTPUT_BUF_SIZE;
+  dest->buffer = (JOCTET *) malloc(dest->bufsize);
+  if (dest->buffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  *dest->outbuffer = dest->buffer;
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->bufsize;
+}
+
+
+/*
+ * Empty the output buffer --- called whenever buffer fills up.
+ *
+ * Rather than writing the data anywhere, we double the size of the buffer
+ * and continue after the data written so far.
+ */
+
+METHODDEF(jboolean)
+empty_mem_output_buffer (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+  size_t nbytes = dest->bufsize;
+  JOCTET * buffer = (JOCTET *) realloc(dest->buffer, 2 * nbytes);
+
+  if (buffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 11);
+
+  dest->buffer = buffer;
+  dest->bufsize = 2 * nbytes;
+  *dest->outbuffer = buffer;
+  dest->pub.next_output_byte = buffer + nbytes;
+  dest->pub.free_in_buffer = dest->bufsize - nbytes;
+
+  return TRUE;
+}
+
+
+/*
+ * Terminate destination --- called by jpeg_finish_compress
+ * after all data has been written.  Gives the caller the size.
+ */
+
+METHODDEF(void)
+term_mem_destination (j_compress_ptr cinfo)
+{
+  mem_dest_ptr dest = (mem_dest_ptr) cinfo->dest;
+
+  *dest->outbuffer = dest->buffer;
+  *dest->outsize = dest->bufsize - dest->pub.free_in_buffer;
+  dest->buffer = NULL;
+}
+
+
+/*
+ * Prepare for output to a buffer in memory.
+ * After jpeg_finish_compress, *outbuffer points to the compressed data
+ * and *outsize holds its size in bytes.  *outbuffer is allocated with
+ * malloc, and must be freed by the caller also when compression fails
+ * (it is NULL if nothing was allocated).
+ */
+
+GLOBAL(void)
+jpeg_memory_dest (j_compress_ptr cinfo, JOCTET ** outbuffer, size_t * outsize)
+{
+  mem_dest_ptr dest;
+
+  if (cinfo->dest == NULL) {	/* first time for this JPEG object? */
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  SIZEOF(mem_destination_mgr));
+  }
+
+  dest = (mem_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_mem_destination;
+  dest->pub.empty_output_buffer = empty_mem_output_buffer;
+  dest->pub.term_destination = term_mem_destination;
+  dest->outbuffer = outbuffer;
+  dest->outsize = outsize;
+  dest->buffer = NULL;
+  dest->bufsize = 0;
+  *outbuffer = NULL;
+  *outsize = 0;
+}
@@ -836,6 +836,8 @@ typedef JMETHOD(jboolean, jpeg_marker_parser_method, (j_decompress_ptr cinfo));
 #define jpeg_destroy_decompress	jDestDecompress
 #define jpeg_stdio_dest		jStdDest
 #define jpeg_stdio_src		jStdSrc
+#define jpeg_memory_dest	jMemDest
+#define jpeg_memory_src		jMemSrc
 #define jpeg_set_defaults	jSetDefaults
 #define jpeg_set_colorspace	jSetColorspace
 #define jpeg_default_colorspace	jDefColorspace
@@ -909,6 +911,13 @@ EXTERN(void) jpeg_destroy_decompress JPP((j_decompress_ptr cinfo));
 /* Caller is responsible for opening the file before and closing after. */
 EXTERN(void) jpeg_stdio_dest JPP((j_compress_ptr cinfo, FILE * outfile));
 EXTERN(void) jpeg_stdio_src JPP((j_decompress_ptr cinfo, FILE * infile));
+/* Data source and destination managers for buffers in memory. */
+/* The destination buffer is malloc'd and must be freed by the caller, */
+/* also after an error. */
+EXTERN(void) jpeg_memory_dest JPP((j_compress_ptr cinfo,
+				   JOCTET ** outbuffer, size_t * outsize));
+EXTERN(void) jpeg_memory_src JPP((j_decompress_ptr cinfo,
+				  const JOCTET * data, size_t size));
 
 /* Default parameter setup for compression */
 EXTERN(void) jpeg_set_defaults JPP((j_compress_ptr cinfo));